@@ -0,0 +1,497 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fakes.h"
+#include "json.h"
+#include "nvs_interface.h"
+#include "schedule.h"
+#include "local_time.h"
+#include "intensity.h"
+#include "ledc_interface.h"
+#include "scheduler.h"
+#include "compositor.h"
+#include "solar.h"
+#include "lunar.h"
+#include "effects.h"
+
+/*
+  Microbenchmarks of the schedule, JSON and NVS hot paths over generated 
+  schedules. Results are written to stdout as JSON so they can be compared 
+  between firmware versions.
+
+  Usage: esp-pwm-bench [min_time_ms]
+*/
+
+#ifndef ESP_PWM_VERSION
+#define ESP_PWM_VERSION "unknown"
+#endif
+
+// Heap accounting of every C++ allocation. Each block carries its size in a header
+static struct
+{
+  uint64_t allocations;
+  size_t current;
+  size_t peak;
+} heap;
+
+static constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+
+// The replacements below pair malloc and free themselves
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size)
+{
+  uint8_t* block = (uint8_t*) malloc(size + HEADER_SIZE);
+  if (block == nullptr)
+    throw std::bad_alloc();
+
+  *((size_t*) block) = size;
+
+  heap.allocations++;
+  heap.current += size;
+  if (heap.current > heap.peak)
+    heap.peak = heap.current;
+
+  return block + HEADER_SIZE;
+}
+
+// Inlined into a delete, the header reads as before the deleted object
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Warray-bounds"
+void operator delete(void* pointer) noexcept
+{
+  if (pointer == nullptr)
+    return;
+
+  uint8_t* block = (uint8_t*) pointer - HEADER_SIZE;
+  heap.current -= *((size_t*) block);
+  free(block);
+}
+#pragma GCC diagnostic pop
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete[](void* pointer) noexcept { operator delete(pointer); }
+void operator delete(void* pointer, size_t) noexcept { operator delete(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { operator delete(pointer); }
+
+static constexpr size_t ROW_COUNTS[] = {10, 60, 240, 1440};
+
+struct result_t
+{
+  std::string name;
+  size_t rows;
+  uint64_t iterations;
+  double ns_per_op;
+  double allocations_per_op;
+  size_t peak_heap_bytes; // Above the heap in use before the benchmark
+  double flash_bytes_per_op; // Estimated NVS bytes programmed
+};
+
+static std::vector<result_t> results;
+static double min_time_ms = 200;
+
+// Keep the optimizer from discarding results
+static volatile uint64_t sink;
+
+/**
+  @brief  Time an operation until it has run for at least the minimum time
+  
+  @param  name Name of the benchmark
+  @param  rows Rows in the schedule under test
+  @param  op Operation to time
+  @retval none
+*/
+template<typename F> static void run(const std::string& name, size_t rows, F op)
+{
+  using clock = std::chrono::steady_clock;
+
+  // Warm up caches and any lazily built state
+  op();
+
+  uint64_t allocations = heap.allocations;
+  uint32_t entries_written = Fake::NVS::wear().entries_written;
+  size_t baseline = heap.current;
+  heap.peak = heap.current;
+
+  uint64_t iterations = 0;
+  auto start = clock::now();
+  auto elapsed = clock::duration::zero();
+  uint64_t batch = 1;
+
+  while (elapsed < std::chrono::duration<double, std::milli>(min_time_ms))
+  {
+    for (uint64_t i = 0; i < batch; i++)
+      op();
+
+    iterations += batch;
+    batch *= 2;
+    elapsed = clock::now() - start;
+  }
+
+  double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+
+  results.push_back({name, rows, iterations, ns / iterations, 
+                     (double) (heap.allocations - allocations) / iterations, heap.peak - baseline,
+                     (double) (Fake::NVS::wear().entries_written - entries_written) * Fake::NVS::ENTRY_SIZE / iterations});
+
+  fprintf(stderr, "%-28s %5zu rows %12.1f ns/op %8.1f allocs/op\n", name.c_str(), rows, ns / iterations, results.back().allocations_per_op);
+}
+
+/**
+  @brief  Format a time of day as the "HH:MM" key used by the schedule
+*/
+static std::string tod_key(int minutes)
+{
+  char key[16];
+  snprintf(key, sizeof(key), "%02d:%02d", minutes / 60, minutes % 60);
+  return key;
+}
+
+/**
+  @brief  Generate settings JSON with a schedule of evenly spaced rows 
+          setting every channel
+*/
+static nlohmann::json generate_settings(size_t rows)
+{
+  nlohmann::json settings;
+
+  for (int i = 0; i < LEDC_TIMER_MAX; i++)
+    settings["timers"][std::to_string(i)] = {{"id", i}, {"freq", 1000}};
+
+  for (size_t i = 0; i < LED_CHANNEL_COUNT; i++)
+    settings["channels"][std::to_string(i)] = {{"id", i}, {"enabled", true}, {"timer", 0}, {"gpio", 4 + i}, {"name", "Channel " + std::to_string(i)}, {"watts", 10}};
+
+  for (size_t r = 0; r < rows; r++)
+  {
+    nlohmann::json entry;
+    for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+      entry[std::to_string(c)] = (int) ((r * 7 + c * 13) % 101);
+
+    settings["schedule"][tod_key(r * 1440 / rows)] = entry;
+  }
+
+  settings["system"] = {{"hostname", "bench"}, {"timezone", CONFIG_LOCAL_TIMEZONE}, {"ntp_servers", {CONFIG_NTP_SERVER_1, CONFIG_NTP_SERVER_2}}};
+
+  return settings;
+}
+
+static void bench_rows(size_t rows)
+{
+  nlohmann::json settings = generate_settings(rows);
+  std::string jSettings = settings.dump();
+  std::string jEntry = settings["schedule"].begin().value().dump();
+
+  // Load the schedule the way the main loop does
+  Schedule schedule;
+  std::vector<Schedule::time_of_day_t> keys;
+  std::vector<Schedule::entry_t> entries;
+  for (auto& kv : settings["schedule"].items())
+  {
+    Schedule::time_of_day_t tod = Schedule::get_time_of_day(kv.key());
+    entries.push_back(JSON::parse_schedule_entry(kv.value().dump()));
+    schedule.set(tod, entries.back());
+    keys.push_back(tod);
+  }
+
+  // Random lookups so branch prediction doesn't flatter the tree walks
+  std::mt19937 random(rows);
+  std::vector<Schedule::time_of_day_t> times(1024);
+  for (auto& t : times)
+    t = random() % 86400;
+
+  size_t i = 0;
+  run("Schedule::next", rows, [&]() { sink += schedule.next(times[i++ % times.size()]); });
+  run("Schedule::prev", rows, [&]() { sink += schedule.prev(times[i++ % times.size()]); });
+  run("Schedule::operator[]", rows, [&]() { sink += schedule[keys[i++ % keys.size()]].size(); });
+
+  // Building the schedule from parsed entries. Peak heap is the schedule's footprint
+  run("Schedule::set", rows, [&]() 
+  {
+    Schedule built;
+    for (size_t r = 0; r < keys.size(); r++)
+      built.set(keys[r], entries[r]);
+
+    sink += built.next(0);
+  });
+
+  // What the timer expired handler does with an entry
+  run("Schedule entry iteration", rows, [&]() 
+  {
+    for (auto pair : schedule[keys[i++ % keys.size()]])
+      sink += pair.first + (uint64_t) pair.second;
+  });
+
+  run("JSON::parse_schedule_entry", rows, [&]() { sink += JSON::parse_schedule_entry(jEntry).size(); });
+  run("JSON::parse_settings", rows, [&]() { sink += JSON::parse_settings(jSettings); Fake::Events::take(); });
+  run("JSON::get_settings", rows, [&]() { sink += JSON::get_settings().size(); });
+  run("NVS::get_schedule_json", rows, [&]() { sink += NVS::get_schedule_json().size(); });
+
+  // Changing one keyframe by rewriting the whole schedule against an edit
+  nlohmann::json full = {{"schedule", settings["schedule"]}};
+  std::string key = settings["schedule"].items().begin().key();
+  uint32_t percent = 0;
+  run("Schedule rewrite", rows, [&]() 
+  {
+    full["schedule"][key]["0"] = (int) (percent++ % 101);
+    sink += JSON::parse_settings(full.dump());
+    Scheduler::handle_events(Fake::Events::take() & Scheduler::EVENTS);
+    Fake::Events::take();
+  });
+
+  run("Schedule edit", rows, [&]() 
+  {
+    nlohmann::json edit = {{"upsert", {{key, {{"0", (int) (percent++ % 101)}}}}}};
+    Scheduler::edit_t parsed;
+    sink += JSON::parse_schedule_edit(edit.dump(), parsed);
+    Scheduler::post_edit(parsed);
+    Scheduler::handle_events(Fake::Events::take() & Scheduler::EVENTS);
+    Fake::Events::take();
+  });
+}
+
+/**
+  @brief  Batched LEDC updates of every channel without and with the power 
+          budget limiting them, and the usage accounting of the channels
+*/
+static void bench_power()
+{
+  JSON::parse_settings(generate_settings(10).dump());
+  Fake::Events::take();
+  LEDC::reconfigure();
+
+  Schedule::entry_t intensities;
+  uint32_t i = 0;
+  auto update = [&]() 
+  {
+    for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+      intensities.set((ledc_channel_t) c, Intensity::from_percent((int32_t) ((i + c * 13) % 101)));
+    i++;
+
+    sink += LEDC::set_intensities(intensities, 5000);
+  };
+
+  run("LEDC::set_intensities", 0, update);
+
+  // Half of the full draw so nearly every update is scaled
+  NVS::save_power_budget(LED_CHANNEL_COUNT * 10 / 2);
+  LEDC::reconfigure();
+  run("LEDC::set_intensities budget", 0, update);
+
+  NVS::save_power_budget(0);
+  LEDC::reconfigure();
+
+  // A minute of accounting per update with every channel fading, saving 
+  // to the NVS once per save interval
+  update();
+  run("LEDC::update_usage", 0, []()
+  {
+    Fake::Clock::advance(60 * 1000000);
+    LEDC::update_usage();
+  });
+  Fake::Events::take();
+
+  Fake::LEDC::clear();
+}
+
+/**
+  @brief  Evaluation cost per change of a layer over a full base with every 
+          priority in use
+*/
+static void bench_compositor()
+{
+  static constexpr size_t LAYERS = 10;
+
+  Schedule::entry_t base;
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+    base.set((ledc_channel_t) c, Intensity::from_percent((int32_t) (c * 10)));
+
+  Compositor::set_base(base, 5000);
+
+  std::vector<Compositor::layer_t> layers(LAYERS);
+  for (size_t l = 0; l < LAYERS; l++)
+  {
+    Compositor::layer_t& layer = layers[l];
+    layer.name = "layer " + std::to_string(l);
+    layer.priority = (Compositor::priority_t) (Compositor::PRIORITY_SCENE + l % 3);
+    layer.mode = layer.priority == Compositor::PRIORITY_LIMIT ? Compositor::MODE_LIMIT : Compositor::MODE_OVERRIDE;
+    layer.expires = 0;
+    layer.blend_ms = 2000;
+
+    for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+      layer.intensities.set((ledc_channel_t) c, Intensity::from_percent((int32_t) ((l * 7 + c * 13) % 101)));
+
+    Compositor::set_layer(layer);
+  }
+
+  Compositor::update();
+  Fake::Events::take();
+
+  // Change one channel of one layer per update
+  uint32_t i = 0;
+  run("Compositor::update", LAYERS, [&]() 
+  {
+    Compositor::layer_t& layer = layers[i % LAYERS];
+    layer.intensities.set((ledc_channel_t) (i % LED_CHANNEL_COUNT), Intensity::from_percent((int32_t) (i % 101)));
+    i++;
+
+    Compositor::set_layer(layer);
+    sink += Compositor::update();
+    Fake::Events::take();
+  });
+
+  for (auto& layer : layers)
+    Compositor::remove_layer(layer.name);
+
+  Compositor::update();
+  Fake::Events::take();
+  Fake::LEDC::clear();
+}
+
+/**
+  @brief  Enable effects on every channel with clouds and a storm open all day
+  
+  @param  seed Seed of the effects
+  @retval none
+*/
+static void enable_effects(uint32_t seed)
+{
+  nlohmann::json channels = nlohmann::json::array();
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+    channels.push_back(c);
+
+  nlohmann::json effects = {
+    {"seed", seed},
+    {"channels", channels},
+    {"clouds", {{"start", "00:00"}, {"end", "23:59"}, {"cover", 50}, {"depth", 60}, {"period", 120}}},
+    {"storm", {{"start", "00:00"}, {"end", "23:59"}, {"darkening", 70}, {"flashes", 60}, {"flash", 100}}},
+  };
+
+  JSON::parse_settings(nlohmann::json({{"effects", effects}}).dump());
+  Effects::handle_events(Fake::Events::take() & Effects::EVENTS);
+}
+
+/**
+  @brief  Cost of a tick of the effects for every channel, alone and with 
+          the LEDC writes and statistics of the main loop
+*/
+static void bench_effects()
+{
+  enable_effects(1);
+
+  Effects::config_t config = NVS::get_effects_config();
+  int64_t utc_ms = 1718884800LL * 1000;
+  run("Effects::evaluate", 0, [&]()
+  {
+    Intensity::intensity_t intensities[LED_CHANNEL_COUNT];
+    std::fill(intensities, intensities + LED_CHANNEL_COUNT, Intensity::FULL_SCALE);
+    sink += Effects::evaluate(config, utc_ms, 0, intensities) + intensities[0];
+    utc_ms += 1000 / Effects::TICK_HZ;
+  });
+
+  Schedule::entry_t full;
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+    full.set((ledc_channel_t) c, Intensity::FULL_SCALE);
+  Effects::set_base(full, 0);
+
+  run("Effects tick", 0, []()
+  {
+    Fake::Clock::advance(1000000 / Effects::TICK_HZ);
+    Fake::Events::take();
+    Effects::handle_events(MAIN_EVENT_EFFECTS_TICK);
+
+    // Keep the recorder from growing without bound
+    if (Fake::LEDC::writes().size() > 100000)
+      Fake::LEDC::clear();
+  });
+
+  NVS::save_effects_config(Effects::DEFAULT_CONFIG);
+  Effects::handle_events(MAIN_EVENT_CONFIG_UPDATE);
+  Fake::LEDC::clear();
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1)
+    min_time_ms = atof(argv[1]);
+
+  // Keep the first boot NVS warnings out of the results
+  Fake::Log::set_level(ESP_LOG_ERROR);
+  NVS::init();
+  LocalTime::init();
+  Compositor::init();
+  LEDC::init();
+  Effects::init();
+
+  // Evaluate real TZ rules like the device does
+  setenv("TZ", CONFIG_LOCAL_TIMEZONE, 1);
+  tzset();
+
+  // Independent of schedule size
+  run("Schedule::get_time_of_day", 0, []() { sink += Schedule::get_time_of_day("13:37"); });
+
+  // Local time conversion uncached against cached, over advancing times
+  time_t utc = time(nullptr);
+  run("localtime_r", 0, [&]() { struct tm local_tm; localtime_r(&utc, &local_tm); sink += local_tm.tm_sec; utc++; });
+  run("LocalTime::get_wall_time", 0, [&]() { sink += LocalTime::get_wall_time(utc++); });
+  run("JSON::get_status", 0, []() { sink += JSON::get_status().size(); });
+
+  // Intensity to duty, the previous double math against fixed point
+  const uint32_t max_duty = (1 << LEDC::LED_RESOLUTION) - 1;
+  uint32_t percent = 0;
+  run("double duty", 0, [&]() { double p = (float) (percent++ % 101); sink += (uint32_t) (p / 100.0 * max_duty); });
+  run("Intensity::to_duty", 0, [&]() { sink += Intensity::to_duty(Intensity::from_percent((int32_t) (percent++ % 101)), max_duty); });
+
+  Scheduler::init();
+  run("LEDC::set_intensity", 0, [&]() { LEDC::set_intensity(LEDC_CHANNEL_0, Intensity::from_percent((int32_t) (percent++ % 101))); });
+  Fake::LEDC::clear();
+
+  bench_compositor();
+  bench_power();
+  bench_effects();
+
+  // Solar events are computed once a day, elevation once per keyframe
+  Solar::config_t solar = {.enabled = true, .latitude = 40.7128f, .longitude = -74.006f, .channel = 0, .intensity = Intensity::FULL_SCALE};
+  time_t date = 1718841600; // 2024-06-20
+  run("Solar::get_day", 0, [&]() { sink += Solar::get_day(solar, date + (sink & 1) * 86400).events[Solar::ANCHOR_NOON]; });
+
+  Solar::day_t day = Solar::get_day(solar, date);
+  time_t t = date;
+  run("Solar::get_sin_elevation", 0, [&]() { sink += Solar::get_sin_elevation(day, t) > 0; t += Solar::ELEVATION_STEP_S; });
+  run("Lunar::get_sin_altitude", 0, [&]() { sink += Lunar::get_sin_altitude(solar, t) > 0; t += Solar::ELEVATION_STEP_S; });
+  run("Lunar::get_day", 0, [&]() { sink += Lunar::get_day(solar, date + (sink & 1) * 86400).rise; });
+
+  for (size_t rows : ROW_COUNTS)
+    bench_rows(rows);
+
+  nlohmann::json root;
+  root["version"] = ESP_PWM_VERSION;
+  root["min_time_ms"] = min_time_ms;
+  root["entry_bytes"] = sizeof(Schedule::entry_t);
+
+  // Share of one core the effects take at the fastest tick rate
+  auto tick = std::find_if(results.begin(), results.end(), [](const result_t& r) { return r.name == "Effects tick"; });
+  root["effects_tick_cpu_percent_100Hz"] = tick->ns_per_op * 100 / 1e7;
+
+  nlohmann::json& list = root["results"] = nlohmann::json::array();
+  for (auto& r : results)
+  {
+    list.push_back({
+      {"name", r.name},
+      {"rows", r.rows},
+      {"iterations", r.iterations},
+      {"ns_per_op", r.ns_per_op},
+      {"allocations_per_op", r.allocations_per_op},
+      {"peak_heap_bytes", r.peak_heap_bytes},
+      {"flash_bytes_per_op", r.flash_bytes_per_op},
+    });
+  }
+
+  printf("%s\n", root.dump(2).c_str());
+  return 0;
+}
\ No newline at end of file
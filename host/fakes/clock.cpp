@@ -0,0 +1,148 @@
+#include <sys/time.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+#include "esp_timer.h"
+#include "fakes.h"
+
+static struct
+{
+  int64_t boot_us = 0;
+  int64_t utc_offset_us = 0; // Wall clock minus time since boot
+  int64_t slew_us = 0;       // Outstanding adjtime() correction
+  int64_t slew_start_us = 0; // Boot time the correction started
+} clock_state;
+
+// ESP-IDF slews the wall clock by 1/64 of the elapsed time
+static constexpr int ADJTIME_CORRECTION_FACTOR = 6;
+
+/**
+  @brief  Correction applied so far by adjtime()
+*/
+static int64_t slew_applied_us()
+{
+  int64_t applied = (clock_state.boot_us - clock_state.slew_start_us) >> ADJTIME_CORRECTION_FACTOR;
+  if (applied >= std::abs(clock_state.slew_us))
+    return clock_state.slew_us;
+
+  return clock_state.slew_us < 0 ? -applied : applied;
+}
+
+/**
+  @brief  Fold the applied part of a correction into the offset and drop the rest
+*/
+static void stop_slew()
+{
+  clock_state.utc_offset_us += slew_applied_us();
+  clock_state.slew_us = 0;
+}
+
+// Fires a single timer. Defined with the FreeRTOS timer fakes
+bool fake_timers_fire_next(int64_t limit_us);
+
+int64_t Fake::Clock::boot_us()
+{
+  return clock_state.boot_us;
+}
+
+int64_t Fake::Clock::utc_us()
+{
+  return clock_state.boot_us + clock_state.utc_offset_us + slew_applied_us();
+}
+
+void Fake::Clock::set_utc(int64_t utc_us)
+{
+  clock_state.slew_us = 0;
+  clock_state.utc_offset_us = utc_us - clock_state.boot_us;
+}
+
+void Fake::Clock::advance(int64_t us)
+{
+  int64_t target = clock_state.boot_us + us;
+
+  // Callbacks may restart timers so look for the next expiry each time
+  while (fake_timers_fire_next(target))
+    ;
+
+  clock_state.boot_us = std::max(clock_state.boot_us, target);
+}
+
+bool Fake::Clock::advance_to_next_timer(int64_t limit_us)
+{
+  return fake_timers_fire_next(clock_state.boot_us + limit_us);
+}
+
+void Fake::Clock::reset(int64_t utc_us)
+{
+  clock_state.boot_us = 0;
+  clock_state.utc_offset_us = utc_us;
+  clock_state.slew_us = 0;
+}
+
+// Move the clock to a timer expiry. Only the timer fakes call this
+void fake_clock_set_boot_us(int64_t boot_us)
+{
+  clock_state.boot_us = std::max(clock_state.boot_us, boot_us);
+}
+
+/*
+  Interpose the libc wall clock so the code under test runs on virtual time. 
+  Benchmarks measure with std::chrono which uses clock_gettime and is unaffected
+*/
+extern "C" time_t time(time_t* t) __THROW
+{
+  time_t now = Fake::Clock::utc_us() / 1000000;
+  if (t != nullptr)
+    *t = now;
+
+  return now;
+}
+
+extern "C" int gettimeofday(struct timeval* __restrict tv, void* __restrict /* tz */) __THROW
+{
+  int64_t now = Fake::Clock::utc_us();
+  tv->tv_sec = now / 1000000;
+  tv->tv_usec = now % 1000000;
+
+  return 0;
+}
+
+extern "C" int settimeofday(const struct timeval* tv, const struct timezone* /* tz */) __THROW
+{
+  if (tv != nullptr)
+    Fake::Clock::set_utc((int64_t) tv->tv_sec * 1000000 + tv->tv_usec);
+
+  return 0;
+}
+
+extern "C" int adjtime(const struct timeval* delta, struct timeval* olddelta) __THROW
+{
+  // Remaining correction
+  int64_t remaining = clock_state.slew_us - slew_applied_us();
+  if (olddelta != nullptr)
+  {
+    olddelta->tv_sec = remaining / 1000000;
+    olddelta->tv_usec = remaining % 1000000;
+  }
+
+  if (delta != nullptr)
+  {
+    // A new correction replaces the outstanding one
+    stop_slew();
+    clock_state.slew_us = (int64_t) delta->tv_sec * 1000000 + delta->tv_usec;
+    clock_state.slew_start_us = clock_state.boot_us;
+  }
+
+  return 0;
+}
+
+/**
+  @brief  Time from the host's monotonic clock for measuring CPU time
+*/
+int64_t esp_timer_get_time()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
\ No newline at end of file
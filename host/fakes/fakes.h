@@ -0,0 +1,131 @@
+#ifndef __FAKES_H__
+#define __FAKES_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "driver/ledc.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+
+/**
+  @brief  Inspection and control of the host fakes of ESP-IDF
+*/
+namespace Fake
+{
+  namespace Clock
+  {
+    // Microseconds since boot. Drives FreeRTOS ticks and timers
+    int64_t boot_us(void);
+
+    // Microseconds since the epoch. Drives time() and gettimeofday(). Slewed 
+    // by adjtime() at 1/64 of elapsed time like ESP-IDF
+    int64_t utc_us(void);
+
+    // Step the wall clock without moving time since boot, like settimeofday(). 
+    // Cancels any adjtime() correction
+    void set_utc(int64_t utc_us);
+
+    // Advance both clocks, firing FreeRTOS timers in expiry order on the way
+    void advance(int64_t us);
+
+    // Advance to the next timer expiry, up to limit_us from now. Returns false if nothing fired
+    bool advance_to_next_timer(int64_t limit_us);
+
+    // Restart both clocks. Wall clock starts at utc_us
+    void reset(int64_t utc_us = 0);
+  }
+
+  namespace Timers
+  {
+    // Boot time in microseconds of the next expiry, -1 if no timer is active
+    int64_t next_expiry_us(void);
+
+    void reset(void);
+  }
+
+  /**
+    @brief  In-memory NVS. Flash wear is estimated the way NVS lays out items. 
+            Each item takes one 32 byte entry, strings and blobs take one 
+            more entry for every 32 bytes of data. Rewriting an unchanged 
+            value is skipped as ESP-IDF does. Pages hold 126 entries and are 
+            erased once filled
+  */
+  namespace NVS
+  {
+    static constexpr size_t ENTRY_SIZE = 32;
+    static constexpr size_t ENTRIES_PER_PAGE = 126;
+
+    struct wear_t
+    {
+      uint32_t sets;            // Calls to nvs_set_*
+      uint32_t skipped;         // Sets which didn't change the stored value
+      uint32_t entries_written; // Entries programmed to flash
+      uint32_t entries_erased;  // Entries marked erased by overwrite or erase
+      uint32_t commits;
+      uint32_t gets;
+
+      // Estimated page erases to reclaim space
+      uint32_t page_erases(void) const { return entries_written / ENTRIES_PER_PAGE; }
+    };
+
+    const wear_t& wear(void);
+    void reset_wear(void);
+
+    // Number of times each "namespace/key" was written to flash
+    const std::map<std::string, uint32_t>& key_writes(void);
+
+    // Clear the storage and the wear counters
+    void reset(void);
+  }
+
+  /**
+    @brief  Recorder of LEDC duty changes with virtual timestamps
+  */
+  namespace LEDC
+  {
+    struct duty_write_t
+    {
+      int64_t time_us;        // Boot time of the write
+      ledc_channel_t channel;
+      uint32_t from;          // Duty at the time of the write
+      uint32_t to;            // Target duty
+      uint32_t fade_ms;       // 0 for an immediate change
+    };
+
+    const std::vector<duty_write_t>& writes(void);
+
+    // Duty of a channel at a boot time, interpolating fades
+    uint32_t duty_at(ledc_channel_t channel, int64_t time_us);
+
+    uint32_t frequency(ledc_timer_t timer);
+
+    void clear(void);
+  }
+
+  /**
+    @brief  Contents of partitions as read by esp_partition_read. Partitions
+            without contents read as erased
+  */
+  namespace Flash
+  {
+    void set_contents(const esp_partition_t* partition, const std::vector<uint8_t>& data);
+  }
+
+  namespace Events
+  {
+    // Return and clear the events passed to signal_event()
+    uint32_t take(void);
+  }
+
+  namespace Log
+  {
+    // Logs above this level are dropped. Defaults to warnings
+    void set_level(esp_log_level_t level);
+  }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+
+#include "esp_heap_caps.h"
+#include "esp_partition.h"
+#include "fakes.h"
+
+static std::map<const esp_partition_t*, std::vector<uint8_t>> contents;
+
+void Fake::Flash::set_contents(const esp_partition_t* partition, const std::vector<uint8_t>& data)
+{
+  // Unwritten flash reads as erased
+  std::vector<uint8_t>& flash = contents[partition];
+  flash.assign(partition->size, 0xFF);
+  std::copy(data.begin(), data.begin() + std::min<size_t>(data.size(), partition->size), flash.begin());
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size)
+{
+  if (partition == nullptr || dst == nullptr)
+    return ESP_ERR_INVALID_ARG;
+
+  if (src_offset > partition->size || size > partition->size - src_offset)
+    return ESP_ERR_INVALID_SIZE;
+
+  auto flash = contents.find(partition);
+  if (flash == contents.end())
+    memset(dst, 0xFF, size);
+  else
+    memcpy(dst, flash->second.data() + src_offset, size);
+
+  return ESP_OK;
+}
+
+void* heap_caps_malloc(size_t size, uint32_t /* caps */)
+{
+  return malloc(size);
+}
+
+void heap_caps_free(void* ptr)
+{
+  free(ptr);
+}
\ No newline at end of file
@@ -0,0 +1,280 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "fakes.h"
+
+void fake_clock_set_boot_us(int64_t boot_us);
+
+struct tmrTimerControl
+{
+  std::string name;
+  TickType_t period;
+  bool auto_reload;
+  void* id;
+  TimerCallbackFunction_t callback;
+  bool active;
+  int64_t expiry_us;
+};
+
+struct QueueDefinition
+{
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::vector<uint8_t>> items;
+  UBaseType_t length;
+  UBaseType_t item_size;
+};
+
+static constexpr int64_t US_PER_TICK = 1000000 / configTICK_RATE_HZ;
+
+static std::list<tmrTimerControl*> timers;
+
+/**
+  @brief  Fire the earliest timer expiring no later than the limit, moving the
+          clock to its expiry
+  
+  @param  limit_us Boot time limit
+  @retval bool - A timer fired
+*/
+bool fake_timers_fire_next(int64_t limit_us)
+{
+  int64_t next = Fake::Timers::next_expiry_us();
+  if (next < 0 || next > limit_us)
+    return false;
+
+  // Timers expiring together fire in creation order like the timer task would
+  for (tmrTimerControl* timer : timers)
+  {
+    if (!timer->active || timer->expiry_us != next)
+      continue;
+
+    fake_clock_set_boot_us(next);
+
+    if (timer->auto_reload)
+      timer->expiry_us += timer->period * US_PER_TICK;
+    else
+      timer->active = false;
+
+    timer->callback(timer);
+    return true;
+  }
+
+  return false;
+}
+
+int64_t Fake::Timers::next_expiry_us()
+{
+  int64_t next = -1;
+  for (tmrTimerControl* timer : timers)
+  {
+    if (timer->active && (next < 0 || timer->expiry_us < next))
+      next = timer->expiry_us;
+  }
+
+  return next;
+}
+
+void Fake::Timers::reset()
+{
+  for (tmrTimerControl* timer : timers)
+    delete timer;
+
+  timers.clear();
+}
+
+TickType_t xTaskGetTickCount()
+{
+  return Fake::Clock::boot_us() / US_PER_TICK;
+}
+
+void vTaskDelay(const TickType_t xTicksToDelay)
+{
+  Fake::Clock::advance((int64_t) xTicksToDelay * US_PER_TICK);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char* const /* pcName */, const uint32_t /* usStackDepth */, void* const pvParameters, UBaseType_t /* uxPriority */, TaskHandle_t* const /* pvCreatedTask */)
+{
+  std::thread(pvTaskCode, pvParameters).detach();
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t /* xTaskToDelete */)
+{
+  // The thread ends when the task function returns
+}
+
+TimerHandle_t xTimerCreate(const char* const pcTimerName, const TickType_t xTimerPeriodInTicks, const UBaseType_t uxAutoReload, void* const pvTimerID, TimerCallbackFunction_t pxCallbackFunction)
+{
+  // FreeRTOS rejects zero periods
+  if (xTimerPeriodInTicks == 0)
+    return nullptr;
+
+  tmrTimerControl* timer = new tmrTimerControl{pcTimerName, xTimerPeriodInTicks, uxAutoReload != pdFALSE, pvTimerID, pxCallbackFunction, false, 0};
+  timers.push_back(timer);
+
+  return timer;
+}
+
+BaseType_t xTimerStart(TimerHandle_t xTimer, TickType_t xTicksToWait)
+{
+  return xTimerReset(xTimer, xTicksToWait);
+}
+
+BaseType_t xTimerStop(TimerHandle_t xTimer, TickType_t /* xTicksToWait */)
+{
+  xTimer->active = false;
+  return pdPASS;
+}
+
+BaseType_t xTimerReset(TimerHandle_t xTimer, TickType_t /* xTicksToWait */)
+{
+  xTimer->active = true;
+  xTimer->expiry_us = Fake::Clock::boot_us() + xTimer->period * US_PER_TICK;
+  return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t xTimer, TickType_t xNewPeriod, TickType_t xTicksToWait)
+{
+  if (xNewPeriod == 0)
+    return pdFAIL;
+
+  // Changing the period also starts the timer
+  xTimer->period = xNewPeriod;
+  return xTimerReset(xTimer, xTicksToWait);
+}
+
+BaseType_t xTimerDelete(TimerHandle_t xTimer, TickType_t /* xTicksToWait */)
+{
+  timers.remove(xTimer);
+  delete xTimer;
+  return pdPASS;
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t xTimer)
+{
+  return xTimer->active ? pdTRUE : pdFALSE;
+}
+
+TickType_t xTimerGetPeriod(TimerHandle_t xTimer)
+{
+  return xTimer->period;
+}
+
+TickType_t xTimerGetExpiryTime(TimerHandle_t xTimer)
+{
+  return xTimer->expiry_us / US_PER_TICK;
+}
+
+void* pvTimerGetTimerID(const TimerHandle_t xTimer)
+{
+  return xTimer->id;
+}
+
+void vTimerSetTimerID(TimerHandle_t xTimer, void* pvNewID)
+{
+  xTimer->id = pvNewID;
+}
+
+/**
+  @brief  Wait on a queue until a condition holds or the wait times out
+
+  @param  queue Queue to wait on
+  @param  lock Lock of the queue's mutex
+  @param  ticks Ticks to wait. portMAX_DELAY waits forever
+  @param  ready Condition to wait for
+  @retval bool - Condition holds
+*/
+template <typename T>
+static bool wait(QueueDefinition* queue, std::unique_lock<std::mutex>& lock, TickType_t ticks, T ready)
+{
+  if (ticks == portMAX_DELAY)
+  {
+    queue->changed.wait(lock, ready);
+    return true;
+  }
+
+  return queue->changed.wait_for(lock, std::chrono::milliseconds((int64_t) ticks * portTICK_PERIOD_MS), ready);
+}
+
+QueueHandle_t xQueueCreate(const UBaseType_t uxQueueLength, const UBaseType_t uxItemSize)
+{
+  QueueDefinition* queue = new QueueDefinition();
+  queue->length = uxQueueLength;
+  queue->item_size = uxItemSize;
+
+  return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t xQueue, const void* const pvItemToQueue, TickType_t xTicksToWait)
+{
+  std::unique_lock<std::mutex> lock(xQueue->mutex);
+  if (!wait(xQueue, lock, xTicksToWait, [xQueue]() { return xQueue->items.size() < xQueue->length; }))
+    return pdFAIL;
+
+  const uint8_t* item = (const uint8_t*) pvItemToQueue;
+  xQueue->items.emplace_back(item, item + xQueue->item_size);
+  xQueue->changed.notify_all();
+
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void* const pvBuffer, TickType_t xTicksToWait)
+{
+  std::unique_lock<std::mutex> lock(xQueue->mutex);
+  if (!wait(xQueue, lock, xTicksToWait, [xQueue]() { return !xQueue->items.empty(); }))
+    return pdFAIL;
+
+  if (xQueue->item_size > 0)
+    memcpy(pvBuffer, xQueue->items.front().data(), xQueue->item_size);
+
+  xQueue->items.pop_front();
+  xQueue->changed.notify_all();
+
+  return pdPASS;
+}
+
+void vQueueDelete(QueueHandle_t xQueue)
+{
+  delete xQueue;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+  // A mutex starts available
+  SemaphoreHandle_t mutex = xQueueCreate(1, 0);
+  xQueueSend(mutex, nullptr, 0);
+
+  return mutex;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+  return xQueueCreate(1, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime)
+{
+  return xQueueReceive(xSemaphore, nullptr, xBlockTime);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+  return xQueueSend(xSemaphore, nullptr, 0);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore)
+{
+  vQueueDelete(xSemaphore);
+}
\ No newline at end of file
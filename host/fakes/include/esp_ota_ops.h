@@ -0,0 +1,10 @@
+#ifndef __ESP_OTA_OPS_H__
+#define __ESP_OTA_OPS_H__
+
+#include <stdint.h>
+
+#include "esp_partition.h"
+
+typedef uint32_t esp_ota_handle_t;
+
+#endif
\ No newline at end of file
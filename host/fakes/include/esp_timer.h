@@ -0,0 +1,10 @@
+#ifndef __ESP_TIMER_H__
+#define __ESP_TIMER_H__
+
+#include <stdint.h>
+
+// Microseconds of the host's monotonic clock rather than the virtual clock, 
+// so the firmware's own measurements of CPU time stay meaningful
+int64_t esp_timer_get_time(void);
+
+#endif
\ No newline at end of file
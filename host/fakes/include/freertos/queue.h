@@ -0,0 +1,22 @@
+#ifndef __FREERTOS_QUEUE_H__
+#define __FREERTOS_QUEUE_H__
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct QueueDefinition* QueueHandle_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Queues are shared between host threads. Waits are in real time, not on the virtual clock
+QueueHandle_t xQueueCreate(const UBaseType_t uxQueueLength, const UBaseType_t uxItemSize);
+BaseType_t xQueueSend(QueueHandle_t xQueue, const void* const pvItemToQueue, TickType_t xTicksToWait);
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void* const pvBuffer, TickType_t xTicksToWait);
+void vQueueDelete(QueueHandle_t xQueue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef __FREERTOS_TASK_H__
+#define __FREERTOS_TASK_H__
+
+#include "freertos/FreeRTOS.h"
+
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void* pvParameters);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Ticks of the virtual clock since boot
+TickType_t xTaskGetTickCount(void);
+
+// Advances the virtual clock, firing any timers that expire on the way
+void vTaskDelay(const TickType_t xTicksToDelay);
+
+// Tasks run on host threads. A task deleting itself must return right after
+BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char* const pcName, const uint32_t usStackDepth, void* const pvParameters, UBaseType_t uxPriority, TaskHandle_t* const pvCreatedTask);
+void vTaskDelete(TaskHandle_t xTaskToDelete);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
\ No newline at end of file
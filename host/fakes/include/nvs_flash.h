@@ -0,0 +1,17 @@
+#ifndef __NVS_FLASH_H__
+#define __NVS_FLASH_H__
+
+#include "nvs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
\ No newline at end of file
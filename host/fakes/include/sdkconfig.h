@@ -0,0 +1,17 @@
+#ifndef __SDKCONFIG_H__
+#define __SDKCONFIG_H__
+
+// Host stand-in for the generated sdkconfig.h. Values match sdkconfig.defaults 
+// and the Kconfig defaults of the project
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_LWIP_LOCAL_HOSTNAME "espressif"
+#define CONFIG_LWIP_DHCP_MAX_NTP_SERVERS 2
+#define CONFIG_NTP_SERVER_1 "0.pool.ntp.org"
+#define CONFIG_NTP_SERVER_2 "1.pool.ntp.org"
+#define CONFIG_LOCAL_TIMEZONE "MST7MDT,M3.2.0,M11.1.0"
+#define CONFIG_LED_CHANNEL_COUNT 8
+#define CONFIG_USAGE_SAVE_MINUTES 60
+#define CONFIG_USAGE_SAVE_WH 100
+#define CONFIG_EFFECTS_TICK_HZ 50
+
+#endif
\ No newline at end of file
@@ -0,0 +1,158 @@
+#include <vector>
+
+#include "driver/ledc.h"
+#include "driver/gpio.h"
+#include "fakes.h"
+
+static struct
+{
+  uint32_t frequency[LEDC_TIMER_MAX];
+  ledc_timer_bit_t resolution[LEDC_TIMER_MAX];
+  ledc_timer_t timer[LEDC_CHANNEL_MAX];
+  uint32_t pending[LEDC_CHANNEL_MAX];   // Duty set but not yet updated
+  uint32_t fade_ms[LEDC_CHANNEL_MAX];   // Fade time of the pending duty
+  std::vector<Fake::LEDC::duty_write_t> writes;
+} ledc;
+
+/**
+  @brief  Record a duty change of a channel starting now
+*/
+static void record(ledc_channel_t channel, uint32_t duty, uint32_t fade_ms)
+{
+  int64_t now = Fake::Clock::boot_us();
+  uint32_t from = Fake::LEDC::duty_at(channel, now);
+
+  ledc.writes.push_back({now, channel, from, duty, fade_ms});
+}
+
+esp_err_t ledc_fade_func_install(int /* intr_alloc_flags */)
+{
+  return ESP_OK;
+}
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t* timer_conf)
+{
+  if (timer_conf->timer_num >= LEDC_TIMER_MAX)
+    return ESP_ERR_INVALID_ARG;
+
+  ledc.frequency[timer_conf->timer_num] = timer_conf->freq_hz;
+  ledc.resolution[timer_conf->timer_num] = timer_conf->duty_resolution;
+  return ESP_OK;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t* ledc_conf)
+{
+  if (ledc_conf->channel >= LEDC_CHANNEL_MAX || ledc_conf->timer_sel >= LEDC_TIMER_MAX)
+    return ESP_ERR_INVALID_ARG;
+
+  ledc.timer[ledc_conf->channel] = ledc_conf->timer_sel;
+  record(ledc_conf->channel, ledc_conf->duty, 0);
+  return ESP_OK;
+}
+
+esp_err_t ledc_stop(ledc_mode_t /* speed_mode */, ledc_channel_t channel, uint32_t /* idle_level */)
+{
+  if (channel >= LEDC_CHANNEL_MAX)
+    return ESP_ERR_INVALID_ARG;
+
+  record(channel, 0, 0);
+  return ESP_OK;
+}
+
+esp_err_t ledc_set_duty(ledc_mode_t /* speed_mode */, ledc_channel_t channel, uint32_t duty)
+{
+  if (channel >= LEDC_CHANNEL_MAX)
+    return ESP_ERR_INVALID_ARG;
+
+  ledc.pending[channel] = duty;
+  ledc.fade_ms[channel] = 0;
+  return ESP_OK;
+}
+
+esp_err_t ledc_update_duty(ledc_mode_t /* speed_mode */, ledc_channel_t channel)
+{
+  if (channel >= LEDC_CHANNEL_MAX)
+    return ESP_ERR_INVALID_ARG;
+
+  record(channel, ledc.pending[channel], 0);
+  return ESP_OK;
+}
+
+uint32_t ledc_get_duty(ledc_mode_t /* speed_mode */, ledc_channel_t channel)
+{
+  return Fake::LEDC::duty_at(channel, Fake::Clock::boot_us());
+}
+
+esp_err_t ledc_set_fade_with_time(ledc_mode_t /* speed_mode */, ledc_channel_t channel, uint32_t target_duty, int max_fade_time_ms)
+{
+  if (channel >= LEDC_CHANNEL_MAX)
+    return ESP_ERR_INVALID_ARG;
+
+  ledc.pending[channel] = target_duty;
+  ledc.fade_ms[channel] = max_fade_time_ms;
+  return ESP_OK;
+}
+
+esp_err_t ledc_fade_start(ledc_mode_t /* speed_mode */, ledc_channel_t channel, ledc_fade_mode_t fade_mode)
+{
+  if (channel >= LEDC_CHANNEL_MAX)
+    return ESP_ERR_INVALID_ARG;
+
+  record(channel, ledc.pending[channel], ledc.fade_ms[channel]);
+
+  // Waiting lets the fade complete on the virtual clock
+  if (fade_mode == LEDC_FADE_WAIT_DONE)
+    Fake::Clock::advance((int64_t) ledc.fade_ms[channel] * 1000);
+
+  return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t /* gpio_num */)
+{
+  return ESP_OK;
+}
+
+esp_err_t gpio_set_pull_mode(gpio_num_t /* gpio_num */, gpio_pull_mode_t /* pull */)
+{
+  return ESP_OK;
+}
+
+const std::vector<Fake::LEDC::duty_write_t>& Fake::LEDC::writes()
+{
+  return ledc.writes;
+}
+
+uint32_t Fake::LEDC::duty_at(ledc_channel_t channel, int64_t time_us)
+{
+  // Find the last write to the channel before the time
+  const duty_write_t* last = nullptr;
+  for (auto it = ledc.writes.rbegin(); it != ledc.writes.rend(); it++)
+  {
+    if (it->channel == channel && it->time_us <= time_us)
+    {
+      last = &(*it);
+      break;
+    }
+  }
+
+  if (last == nullptr)
+    return 0;
+
+  // Linear fade from the previous duty
+  int64_t elapsed_us = time_us - last->time_us;
+  int64_t fade_us = (int64_t) last->fade_ms * 1000;
+  if (elapsed_us >= fade_us)
+    return last->to;
+
+  return last->from + ((int64_t) last->to - (int64_t) last->from) * elapsed_us / fade_us;
+}
+
+uint32_t Fake::LEDC::frequency(ledc_timer_t timer)
+{
+  return (timer < LEDC_TIMER_MAX) ? ledc.frequency[timer] : 0;
+}
+
+void Fake::LEDC::clear()
+{
+  ledc.writes.clear();
+}
\ No newline at end of file
@@ -0,0 +1,313 @@
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "nvs_flash.h"
+#include "fakes.h"
+
+struct item_t
+{
+  nvs_type_t type;
+  std::vector<uint8_t> data;
+};
+
+struct nvs_opaque_iterator_t
+{
+  std::vector<nvs_entry_info_t> entries;
+  size_t index;
+};
+
+static struct
+{
+  std::map<std::string, std::map<std::string, item_t>> namespaces;
+  std::vector<std::string> handles; // Namespace of each handle. Handle is index + 1
+  Fake::NVS::wear_t wear;
+  std::map<std::string, uint32_t> key_writes;
+} nvs;
+
+/**
+  @brief  Number of 32 byte entries an item occupies in flash
+*/
+static uint32_t item_entries(const item_t& item)
+{
+  if (item.type != NVS_TYPE_STR && item.type != NVS_TYPE_BLOB)
+    return 1;
+
+  return 1 + (item.data.size() + Fake::NVS::ENTRY_SIZE - 1) / Fake::NVS::ENTRY_SIZE;
+}
+
+static std::map<std::string, item_t>* lookup(nvs_handle_t handle)
+{
+  if (handle == 0 || handle > nvs.handles.size())
+    return nullptr;
+
+  return &nvs.namespaces[nvs.handles[handle - 1]];
+}
+
+static esp_err_t set_item(nvs_handle_t handle, const char* key, nvs_type_t type, const void* data, size_t length)
+{
+  std::map<std::string, item_t>* space = lookup(handle);
+  if (space == nullptr)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+
+  if (key == nullptr || strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+    return ESP_ERR_NVS_KEY_TOO_LONG;
+
+  nvs.wear.sets++;
+
+  item_t item = {type, std::vector<uint8_t>((const uint8_t*) data, (const uint8_t*) data + length)};
+
+  auto it = space->find(key);
+  if (it != space->end())
+  {
+    // Unchanged values aren't rewritten
+    if (it->second.type == type && it->second.data == item.data)
+    {
+      nvs.wear.skipped++;
+      return ESP_OK;
+    }
+
+    nvs.wear.entries_erased += item_entries(it->second);
+  }
+
+  nvs.wear.entries_written += item_entries(item);
+  nvs.key_writes[nvs.handles[handle - 1] + "/" + key]++;
+
+  (*space)[key] = item;
+  return ESP_OK;
+}
+
+static esp_err_t get_item(nvs_handle_t handle, const char* key, nvs_type_t type, const item_t** out)
+{
+  std::map<std::string, item_t>* space = lookup(handle);
+  if (space == nullptr)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+
+  nvs.wear.gets++;
+
+  // Items are looked up by key and type
+  auto it = space->find(key);
+  if (it == space->end() || it->second.type != type)
+    return ESP_ERR_NVS_NOT_FOUND;
+
+  *out = &it->second;
+  return ESP_OK;
+}
+
+template<typename T> static esp_err_t get_value(nvs_handle_t handle, const char* key, nvs_type_t type, T* out_value)
+{
+  const item_t* item = nullptr;
+  esp_err_t result = get_item(handle, key, type, &item);
+  if (result != ESP_OK)
+    return result;
+
+  memcpy(out_value, item->data.data(), sizeof(T));
+  return ESP_OK;
+}
+
+static esp_err_t get_data(nvs_handle_t handle, const char* key, nvs_type_t type, void* out_value, size_t* length)
+{
+  const item_t* item = nullptr;
+  esp_err_t result = get_item(handle, key, type, &item);
+  if (result != ESP_OK)
+    return result;
+
+  // Report required length only
+  if (out_value == nullptr)
+  {
+    *length = item->data.size();
+    return ESP_OK;
+  }
+
+  if (*length < item->data.size())
+  {
+    *length = item->data.size();
+    return ESP_ERR_NVS_INVALID_LENGTH;
+  }
+
+  memcpy(out_value, item->data.data(), item->data.size());
+  *length = item->data.size();
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_init()
+{
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase()
+{
+  Fake::NVS::reset();
+  return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t /* open_mode */, nvs_handle_t* out_handle)
+{
+  if (name == nullptr || strlen(name) >= NVS_NS_NAME_MAX_SIZE)
+    return ESP_ERR_NVS_INVALID_NAME;
+
+  nvs.namespaces[name];
+  nvs.handles.push_back(name);
+  *out_handle = nvs.handles.size();
+
+  return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t /* handle */)
+{
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+  if (lookup(handle) == nullptr)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+
+  // Items are written to flash as they are set so a commit costs nothing
+  nvs.wear.commits++;
+  return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key)
+{
+  std::map<std::string, item_t>* space = lookup(handle);
+  if (space == nullptr)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+
+  auto it = space->find(key);
+  if (it == space->end())
+    return ESP_ERR_NVS_NOT_FOUND;
+
+  nvs.wear.entries_erased += item_entries(it->second);
+  space->erase(it);
+
+  return ESP_OK;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+  std::map<std::string, item_t>* space = lookup(handle);
+  if (space == nullptr)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+
+  for (auto& kv : *space)
+    nvs.wear.entries_erased += item_entries(kv.second);
+
+  space->clear();
+  return ESP_OK;
+}
+
+esp_err_t nvs_set_i8(nvs_handle_t handle, const char* key, int8_t value) { return set_item(handle, key, NVS_TYPE_I8, &value, sizeof(value)); }
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char* key, uint8_t value) { return set_item(handle, key, NVS_TYPE_U8, &value, sizeof(value)); }
+esp_err_t nvs_set_i16(nvs_handle_t handle, const char* key, int16_t value) { return set_item(handle, key, NVS_TYPE_I16, &value, sizeof(value)); }
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char* key, uint16_t value) { return set_item(handle, key, NVS_TYPE_U16, &value, sizeof(value)); }
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char* key, int32_t value) { return set_item(handle, key, NVS_TYPE_I32, &value, sizeof(value)); }
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char* key, uint32_t value) { return set_item(handle, key, NVS_TYPE_U32, &value, sizeof(value)); }
+esp_err_t nvs_set_i64(nvs_handle_t handle, const char* key, int64_t value) { return set_item(handle, key, NVS_TYPE_I64, &value, sizeof(value)); }
+esp_err_t nvs_set_u64(nvs_handle_t handle, const char* key, uint64_t value) { return set_item(handle, key, NVS_TYPE_U64, &value, sizeof(value)); }
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char* key, const char* value)
+{
+  return set_item(handle, key, NVS_TYPE_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length)
+{
+  return set_item(handle, key, NVS_TYPE_BLOB, value, length);
+}
+
+esp_err_t nvs_get_i8(nvs_handle_t handle, const char* key, int8_t* out_value) { return get_value(handle, key, NVS_TYPE_I8, out_value); }
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char* key, uint8_t* out_value) { return get_value(handle, key, NVS_TYPE_U8, out_value); }
+esp_err_t nvs_get_i16(nvs_handle_t handle, const char* key, int16_t* out_value) { return get_value(handle, key, NVS_TYPE_I16, out_value); }
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char* key, uint16_t* out_value) { return get_value(handle, key, NVS_TYPE_U16, out_value); }
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char* key, int32_t* out_value) { return get_value(handle, key, NVS_TYPE_I32, out_value); }
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char* key, uint32_t* out_value) { return get_value(handle, key, NVS_TYPE_U32, out_value); }
+esp_err_t nvs_get_i64(nvs_handle_t handle, const char* key, int64_t* out_value) { return get_value(handle, key, NVS_TYPE_I64, out_value); }
+esp_err_t nvs_get_u64(nvs_handle_t handle, const char* key, uint64_t* out_value) { return get_value(handle, key, NVS_TYPE_U64, out_value); }
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char* key, char* out_value, size_t* length)
+{
+  return get_data(handle, key, NVS_TYPE_STR, out_value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length)
+{
+  return get_data(handle, key, NVS_TYPE_BLOB, out_value, length);
+}
+
+nvs_iterator_t nvs_entry_find(const char* /* part_name */, const char* namespace_name, nvs_type_t type)
+{
+  nvs_iterator_t iterator = new nvs_opaque_iterator_t{{}, 0};
+
+  for (auto& space : nvs.namespaces)
+  {
+    if (namespace_name != nullptr && space.first.compare(namespace_name) != 0)
+      continue;
+
+    for (auto& kv : space.second)
+    {
+      if (type != NVS_TYPE_ANY && kv.second.type != type)
+        continue;
+
+      nvs_entry_info_t info = {};
+      strncpy(info.namespace_name, space.first.c_str(), sizeof(info.namespace_name) - 1);
+      strncpy(info.key, kv.first.c_str(), sizeof(info.key) - 1);
+      info.type = kv.second.type;
+
+      iterator->entries.push_back(info);
+    }
+  }
+
+  if (iterator->entries.empty())
+  {
+    delete iterator;
+    return nullptr;
+  }
+
+  return iterator;
+}
+
+nvs_iterator_t nvs_entry_next(nvs_iterator_t iterator)
+{
+  if (++iterator->index < iterator->entries.size())
+    return iterator;
+
+  // Iterator is released once exhausted
+  delete iterator;
+  return nullptr;
+}
+
+void nvs_entry_info(nvs_iterator_t iterator, nvs_entry_info_t* out_info)
+{
+  *out_info = iterator->entries[iterator->index];
+}
+
+void nvs_release_iterator(nvs_iterator_t iterator)
+{
+  delete iterator;
+}
+
+const Fake::NVS::wear_t& Fake::NVS::wear()
+{
+  return nvs.wear;
+}
+
+void Fake::NVS::reset_wear()
+{
+  nvs.wear = wear_t();
+  nvs.key_writes.clear();
+}
+
+const std::map<std::string, uint32_t>& Fake::NVS::key_writes()
+{
+  return nvs.key_writes;
+}
+
+void Fake::NVS::reset()
+{
+  // Open handles stay valid but see empty namespaces
+  for (auto& space : nvs.namespaces)
+    space.second.clear();
+
+  reset_wear();
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#include "main.h"
+#include "http.h"
+#include "ota_pull.h"
+#include "fakes.h"
+
+// Stand-ins for the parts of the firmware outside the host build
+
+static uint32_t events = 0;
+
+void signal_event(MAIN_EVENT event)
+{
+  events |= event;
+}
+
+uint32_t Fake::Events::take()
+{
+  uint32_t taken = events;
+  events = 0;
+
+  return taken;
+}
+
+OTA::pull_status_t OTA::get_pull_status()
+{
+  return { .state = OTA::PULL_IDLE, .target = "", .received = 0, .total = -1, .message = "" };
+}
+
+void HTTP::push_status()
+{
+}
\ No newline at end of file
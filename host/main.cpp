@@ -0,0 +1,62 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "fakes.h"
+#include "json.h"
+#include "ledc_interface.h"
+#include "local_time.h"
+#include "main.h"
+#include "nvs_interface.h"
+
+/**
+  @brief  Apply a settings file the way the web interface would and report 
+          the resulting configuration, LEDC activity and NVS wear
+
+  Usage: esp-pwm-host [settings.json]
+*/
+int main(int argc, char** argv)
+{
+  NVS::init();
+  LocalTime::init();
+  LEDC::init();
+
+  if (argc > 1)
+  {
+    std::ifstream file(argv[1]);
+    if (!file)
+    {
+      std::cerr << "Failed to open " << argv[1] << std::endl;
+      return 1;
+    }
+
+    std::stringstream settings;
+    settings << file.rdbuf();
+
+    Fake::NVS::reset_wear();
+
+    if (!JSON::parse_settings(settings.str()))
+    {
+      std::cerr << "Failed to parse settings." << std::endl;
+      return 1;
+    }
+
+    if (Fake::Events::take() & MAIN_EVENT_CONFIG_UPDATE)
+      LEDC::reconfigure();
+  }
+
+  std::cout << JSON::get_settings() << std::endl;
+
+  const Fake::NVS::wear_t& wear = Fake::NVS::wear();
+  std::cerr << "NVS: " << wear.sets << " sets, " << wear.skipped << " unchanged, " 
+            << wear.entries_written << " entries written, " << wear.page_erases() << " page erases" << std::endl;
+
+  for (auto& w : Fake::LEDC::writes())
+  {
+    std::cerr << "LEDC: " << w.time_us << " us channel " << w.channel << " duty " 
+              << w.from << " -> " << w.to << " over " << w.fade_ms << " ms" << std::endl;
+  }
+
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,516 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <sys/time.h>
+#include <time.h>
+
+#include "freertos/timers.h"
+#include "clock.h"
+#include "fakes.h"
+#include "json.h"
+#include "ledc_interface.h"
+#include "local_time.h"
+#include "main.h"
+#include "nvs_interface.h"
+#include "scheduler.h"
+#include "compositor.h"
+#include "effects.h"
+
+/*
+  Accelerated simulation of the main loop on a virtual clock. Replays days 
+  of schedule events including DST transitions, a device crystal that 
+  drifts against the SNTP server, clock steps, a schedule edit, a 
+  re-save of unchanged settings and an expiring manual override, and 
+  writes a trace of every LEDC duty change as CSV with the clock error at 
+  the time of the change.
+
+  Usage: esp-pwm-sim [options]
+    --start YYYY-MM-DDTHH:MM  Local start time. Defaults to the day DST starts
+    --days N                  Days to simulate. Defaults to 1
+    --tz TZ                   POSIX timezone. Defaults to CONFIG_LOCAL_TIMEZONE
+    --settings FILE           Settings JSON to load instead of the generated schedule
+    --drift PPM               Rate the device crystal runs fast. Defaults to 50
+    --sync-hours H            Hours between SNTP syncs. Defaults to 1
+    --trace FILE              Write the trace to FILE instead of stdout
+    --budget W                Power budget in watts. Generated channels draw 10 W at full
+    --solar LAT,LON           Locate the device, add keyframes relative to sunrise and sunset 
+                              and let the last channel follow the solar elevation
+    --moon max|add            With --solar, light the second last channel by the moon, blended 
+                              with its schedule by the maximum or the sum
+    --bench N                 Simulate N days without a trace and report days per second
+*/
+
+static constexpr int64_t US_PER_S = 1000000;
+static constexpr int64_t BOOT_ERROR_S = 90;   // Device clock error before the first sync
+static constexpr int64_t DISTURBANCE_S = -30; // Clock error introduced mid-day, stepped out by the next sync
+static constexpr int CHANNELS = 4;
+static constexpr double CHANNEL_WATTS = 10;
+
+static struct
+{
+  double drift_ppm = 50;
+  int64_t sync_hours = 1;
+  double budget_W = -1; // Budget of the settings when negative
+  std::string solar;    // Location as LAT,LON. Empty for none
+  std::string moon;     // Blend of the moonlight channel. Empty for none
+  int64_t start_us = 0; // True UTC at boot
+  FILE* trace = nullptr;
+  size_t traced = 0; // LEDC writes already traced
+} sim;
+
+/**
+  @brief  Generate settings with a daily ramp on a few channels. Includes an 
+          entry inside the spring forward gap and one in the repeated hour 
+          of the fall back
+*/
+static std::string generate_settings()
+{
+  nlohmann::json settings;
+
+  settings["timers"]["0"] = {{"id", 0}, {"freq", 1000}};
+  for (int i = 0; i < CHANNELS; i++)
+    settings["channels"][std::to_string(i)] = {{"id", i}, {"enabled", true}, {"timer", 0}, {"gpio", 4 + i}, {"name", "Channel " + std::to_string(i)}, {"watts", CHANNEL_WATTS}};
+
+  const char* times[] = {"01:30", "02:30", "06:00", "07:00", "08:00", "12:00", "18:00", "20:00", "21:00", "22:00"};
+  const int levels[] = {5, 0, 10, 40, 80, 100, 80, 40, 10, 0};
+
+  for (size_t r = 0; r < sizeof(levels) / sizeof(levels[0]); r++)
+  {
+    for (int c = 0; c < CHANNELS; c++)
+      settings["schedule"][times[r]][std::to_string(c)] = std::max(0, levels[r] - 5 * c);
+  }
+
+  return settings.dump();
+}
+
+/**
+  @brief  True UTC at a boot time, as the SNTP server sees it
+*/
+static int64_t get_true_us(int64_t boot_us)
+{
+  return sim.start_us + boot_us - (int64_t) (boot_us * sim.drift_ppm / 1e6);
+}
+
+/**
+  @brief  Write the duty changes recorded since the last call to the trace. 
+          Called after each batch of events so the wall time is the one the 
+          device saw when it made the change
+*/
+static void write_trace()
+{
+  const auto& writes = Fake::LEDC::writes();
+  int64_t offset_us = Fake::Clock::utc_us() - Fake::Clock::boot_us();
+
+  if (sim.trace == nullptr)
+    sim.traced = writes.size();
+
+  for (; sim.traced < writes.size(); sim.traced++)
+  {
+    const auto& w = writes[sim.traced];
+
+    time_t utc = (w.time_us + offset_us) / US_PER_S;
+    struct tm local;
+    localtime_r(&utc, &local);
+
+    char datetime[32];
+    strftime(datetime, sizeof(datetime), "%FT%T%z", &local);
+
+    double error_ms = (w.time_us + offset_us - get_true_us(w.time_us)) / 1e3;
+
+    fprintf(sim.trace, "%.3f,%s,%.3f,%d,%u,%u,%u\n", w.time_us / 1e6, datetime, error_ms, w.channel, w.from, w.to, w.fade_ms);
+  }
+}
+
+/**
+  @brief  Peak estimated draw of the recorded duties. The draw is linear 
+          between writes and fade ends so the peak is at one of them
+*/
+static double peak_power()
+{
+  const double max_duty = (1 << LEDC::LED_RESOLUTION) - 1;
+
+  double watts[LED_CHANNEL_COUNT];
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+  {
+    channel_config_t config = NVS::get_channel_config(c).second;
+    watts[c] = config.enabled ? config.watts : 0;
+  }
+
+  std::set<int64_t> times;
+  for (auto& w : Fake::LEDC::writes())
+  {
+    times.insert(w.time_us);
+    times.insert(w.time_us + w.fade_ms * 1000);
+  }
+
+  double peak = 0;
+  for (int64_t t : times)
+  {
+    double total = 0;
+    for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+      total += watts[c] * Fake::LEDC::duty_at((ledc_channel_t) c, t) / max_duty;
+
+    peak = std::max(peak, total);
+  }
+
+  return peak;
+}
+
+/**
+  @brief  Energy of a channel integrated from the recorded duties up to a 
+          boot time. Reference for the firmware's own accounting
+*/
+static double traced_energy_Wh(size_t channel, int64_t end_us)
+{
+  const double max_duty = (1 << LEDC::LED_RESOLUTION) - 1;
+
+  channel_config_t config = NVS::get_channel_config(channel).second;
+  if (!config.enabled)
+    return 0;
+
+  std::set<int64_t> times = {end_us};
+  for (auto& w : Fake::LEDC::writes())
+  {
+    if (w.channel != channel)
+      continue;
+
+    times.insert(std::min(w.time_us, end_us));
+    times.insert(std::min(w.time_us + w.fade_ms * 1000, end_us));
+  }
+
+  // Linear between the breakpoints so the trapezoid rule is exact
+  double joules = 0;
+  int64_t previous = 0;
+  for (int64_t t : times)
+  {
+    double a = Fake::LEDC::duty_at((ledc_channel_t) channel, previous);
+    double b = Fake::LEDC::duty_at((ledc_channel_t) channel, t);
+    joules += config.watts * (a + b) / (2 * max_duty) * (t - previous) / US_PER_S;
+    previous = t;
+  }
+
+  return joules / 3600;
+}
+
+/**
+  @brief  Run the main loop until the virtual clock reaches a boot time
+*/
+static void run_until(int64_t end_us)
+{
+  while (true)
+  {
+    // Handle events the same way app_main does
+    uint32_t events;
+    while ((events = Fake::Events::take()) != 0)
+    {
+      Scheduler::handle_events(events & Scheduler::EVENTS);
+      Effects::handle_events(events & Effects::EVENTS);
+
+      if (events & MAIN_EVENT_USAGE_UPDATE)
+        LEDC::update_usage();
+
+      if (events & MAIN_EVENT_RECONFIGURE_SNTP)
+        signal_event(MAIN_EVENT_SYSTEM_TIME_UPDATED);
+    }
+
+    write_trace();
+
+    int64_t next = Fake::Timers::next_expiry_us();
+    if (next < 0 || next > end_us)
+      break;
+
+    Fake::Clock::advance_to_next_timer(end_us - Fake::Clock::boot_us());
+  }
+
+  Fake::Clock::advance(end_us - Fake::Clock::boot_us());
+}
+
+/**
+  @brief  SNTP poll. Hands the server's time to the clock discipline like 
+          sntp_sync_time does
+*/
+static void sntp_sync(TimerHandle_t /* timer */)
+{
+  int64_t now = get_true_us(Fake::Clock::boot_us());
+
+  struct timeval tv = {
+    .tv_sec = (time_t) (now / US_PER_S),
+    .tv_usec = (suseconds_t) (now % US_PER_S),
+  };
+
+  Clock::sync(&tv);
+  signal_event(MAIN_EVENT_SYSTEM_TIME_UPDATED);
+}
+
+/**
+  @brief  Knock the clock off between syncs, like a bad server answering once
+*/
+static void disturb_clock(TimerHandle_t /* timer */)
+{
+  Fake::Clock::set_utc(Fake::Clock::utc_us() + DISTURBANCE_S * US_PER_S);
+}
+
+/**
+  @brief  Edit the schedule through the web interface path
+*/
+static void edit_schedule(TimerHandle_t /* timer */)
+{
+  nlohmann::json settings = nlohmann::json::parse(JSON::get_settings());
+
+  // Move the evening ramp half an hour later
+  const nlohmann::json& schedule = settings["schedule"];
+  if (!schedule.contains("20:00"))
+    return;
+
+  nlohmann::json edit;
+  edit["upsert"]["20:30"] = schedule["20:00"];
+  edit["delete"] = {"20:00"};
+
+  Scheduler::edit_t parsed;
+  if (JSON::parse_schedule_edit(edit.dump(), parsed))
+    Scheduler::post_edit(parsed);
+}
+
+/**
+  @brief  Turn the lights up for half an hour, like a photo mode
+*/
+static void manual_override(TimerHandle_t /* timer */)
+{
+  nlohmann::json request = {{"name", "photo"}, {"priority", "manual"}, {"duration", 1800}, {"blend", 2000}};
+  for (int c = 0; c < CHANNELS; c++)
+    request["intensities"][std::to_string(c)] = 100;
+
+  Compositor::layer_t layer;
+  bool remove;
+  if (JSON::parse_layer(request.dump(), layer, remove))
+    Compositor::set_layer(layer);
+}
+
+/**
+  @brief  Save the settings back unchanged, which reloads the whole schedule
+*/
+static void resave_settings(TimerHandle_t /* timer */)
+{
+  JSON::parse_settings(JSON::get_settings());
+}
+
+int main(int argc, char** argv)
+{
+  std::string start = "2024-03-10T00:00";
+  std::string tz = CONFIG_LOCAL_TIMEZONE;
+  std::string settings_file;
+  std::string trace_file;
+  int64_t days = 1;
+  int64_t bench_days = 0;
+
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    std::string option = argv[i];
+    std::string value = argv[i + 1];
+
+    if (option == "--start")
+      start = value;
+    else if (option == "--days")
+      days = atoll(value.c_str());
+    else if (option == "--tz")
+      tz = value;
+    else if (option == "--settings")
+      settings_file = value;
+    else if (option == "--drift")
+      sim.drift_ppm = atof(value.c_str());
+    else if (option == "--sync-hours")
+      sim.sync_hours = std::max(1LL, atoll(value.c_str()));
+    else if (option == "--trace")
+      trace_file = value;
+    else if (option == "--budget")
+      sim.budget_W = atof(value.c_str());
+    else if (option == "--solar")
+      sim.solar = value;
+    else if (option == "--moon")
+      sim.moon = value;
+    else if (option == "--bench")
+      bench_days = atoll(value.c_str());
+    else
+    {
+      fprintf(stderr, "Unknown option '%s'.\n", option.c_str());
+      return 1;
+    }
+  }
+
+  setenv("TZ", tz.c_str(), 1);
+  tzset();
+
+  struct tm local = {};
+  if (strptime(start.c_str(), "%Y-%m-%dT%H:%M", &local) == nullptr)
+  {
+    fprintf(stderr, "Invalid start time '%s'.\n", start.c_str());
+    return 1;
+  }
+
+  local.tm_isdst = -1;
+  sim.start_us = (int64_t) mktime(&local) * US_PER_S;
+  Fake::Clock::reset(sim.start_us + BOOT_ERROR_S * US_PER_S);
+
+  // Settings as saved by the web interface
+  Fake::Log::set_level(bench_days ? ESP_LOG_ERROR : ESP_LOG_WARN);
+  NVS::init();
+  LocalTime::init();
+
+  std::string settings = generate_settings();
+  if (!settings_file.empty())
+  {
+    FILE* file = fopen(settings_file.c_str(), "r");
+    if (file == nullptr)
+    {
+      fprintf(stderr, "Failed to open '%s'.\n", settings_file.c_str());
+      return 1;
+    }
+
+    settings.clear();
+    char buffer[1024];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+      settings.append(buffer, length);
+
+    fclose(file);
+  }
+
+  JSON::parse_settings(settings);
+  Fake::Events::take();
+
+  if (sim.budget_W >= 0)
+    NVS::save_power_budget(sim.budget_W);
+
+  if (!sim.solar.empty())
+  {
+    double latitude = 0, longitude = 0;
+    if (sscanf(sim.solar.c_str(), "%lf,%lf", &latitude, &longitude) != 2)
+    {
+      fprintf(stderr, "Invalid location '%s'.\n", sim.solar.c_str());
+      return 1;
+    }
+
+    nlohmann::json solar = {{"latitude", latitude}, {"longitude", longitude}, {"channel", CHANNELS - 1}, {"intensity", 100}};
+    JSON::parse_settings(nlohmann::json({{"solar", solar}}).dump());
+
+    Scheduler::edit_t edit;
+    JSON::parse_schedule_edit(R"({"upsert": {"sunrise-00:30": {"0": 20, "1": 15}, "sunset+00:30": {"0": 5, "1": 0}}})", edit);
+    Fake::Events::take();
+  }
+
+  if (!sim.moon.empty())
+  {
+    if (sim.solar.empty() || (sim.moon != "max" && sim.moon != "add"))
+    {
+      fprintf(stderr, "Invalid moon blend '%s'. --moon needs --solar.\n", sim.moon.c_str());
+      return 1;
+    }
+
+    nlohmann::json moon = {{"channel", CHANNELS - 2}, {"intensity", 10}, {"blend", sim.moon}};
+    JSON::parse_settings(nlohmann::json({{"moon", moon}}).dump());
+    Fake::Events::take();
+  }
+
+  // Boot the same way app_main does. Time is synced immediately
+  Compositor::init();
+  Scheduler::init();
+  Clock::init();
+  LEDC::init();
+  Effects::init();
+
+  sntp_sync(nullptr);
+  Fake::Events::take();
+
+  TimerHandle_t sntp_timer = xTimerCreate("SNTP", pdMS_TO_TICKS64(sim.sync_hours * 3600 * 1000), true, nullptr, sntp_sync);
+  xTimerStart(sntp_timer, 0);
+
+  TimerHandle_t disturb_timer = xTimerCreate("Disturb", pdMS_TO_TICKS64(12.5 * 3600 * 1000), false, nullptr, disturb_clock);
+  xTimerStart(disturb_timer, 0);
+
+  signal_event(MAIN_EVENT_SCHEDULE_UPDATE);
+
+  if (bench_days > 0)
+  {
+    auto begin = std::chrono::steady_clock::now();
+
+    for (int64_t day = 0; day < bench_days; day++)
+    {
+      run_until((day + 1) * 86400 * US_PER_S);
+
+      // Keep the recorder from growing without bound
+      Fake::LEDC::clear();
+      sim.traced = 0;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    printf("{\"days\": %lld, \"seconds\": %f, \"days_per_second\": %f}\n", (long long) bench_days, seconds, bench_days / seconds);
+    return 0;
+  }
+
+  // Edit the schedule midway through the first day
+  TimerHandle_t edit_timer = xTimerCreate("Edit", pdMS_TO_TICKS64(12 * 3600 * 1000), false, nullptr, edit_schedule);
+  xTimerStart(edit_timer, 0);
+
+  // Reloading settings that didn't change shouldn't touch the lights
+  TimerHandle_t resave_timer = xTimerCreate("Resave", pdMS_TO_TICKS64(15 * 3600 * 1000), false, nullptr, resave_settings);
+  xTimerStart(resave_timer, 0);
+
+  // Override the lights for half an hour in the morning
+  TimerHandle_t override_timer = xTimerCreate("Override", pdMS_TO_TICKS64(9 * 3600 * 1000), false, nullptr, manual_override);
+  xTimerStart(override_timer, 0);
+
+  sim.trace = trace_file.empty() ? stdout : fopen(trace_file.c_str(), "w");
+  if (sim.trace == nullptr)
+  {
+    fprintf(stderr, "Failed to open '%s'.\n", trace_file.c_str());
+    return 1;
+  }
+
+  fprintf(sim.trace, "boot_s,local_time,clock_error_ms,channel,from,to,fade_ms\n");
+
+  auto begin = std::chrono::steady_clock::now();
+  run_until(days * 86400 * US_PER_S);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  if (sim.trace != stdout)
+    fclose(sim.trace);
+
+  Clock::stats_t stats = Clock::get_stats();
+
+  fprintf(stderr, "Simulated %lld day(s) in %.3f ms. %zu duty writes.\n", (long long) days, seconds * 1000, Fake::LEDC::writes().size());
+  if (!sim.solar.empty())
+  {
+    nlohmann::json today = nlohmann::json::parse(JSON::get_settings())["solar"]["today"];
+    fprintf(stderr, "Solar: %s on the last day.\n", today.dump().c_str());
+  }
+  if (!sim.moon.empty())
+  {
+    nlohmann::json today = nlohmann::json::parse(JSON::get_settings())["moon"]["today"];
+    fprintf(stderr, "Moon: %s on the last day.\n", today.dump().c_str());
+  }
+  fprintf(stderr, "Power: peak %.2f W, budget %.2f W.\n", peak_power(), NVS::get_power_budget());
+
+  LEDC::update_usage();
+  std::array<channel_usage_t, LED_CHANNEL_COUNT> usage = LEDC::get_usage();
+
+  uint32_t usage_saves = 0;
+  for (auto& pair : Fake::NVS::key_writes())
+  {
+    if (pair.first.size() > 6 && pair.first.compare(pair.first.size() - 6, 6, "/usage") == 0)
+      usage_saves += pair.second;
+  }
+
+  for (int c = 0; c < CHANNELS; c++)
+  {
+    fprintf(stderr, "Usage: channel %d %.3f Wh (trace %.3f Wh), %.3f h on.\n", 
+      c, usage[c].energy_uJ / 3.6e9, traced_energy_Wh(c, Fake::Clock::boot_us()), usage[c].on_ms / 3.6e6);
+  }
+  fprintf(stderr, "Usage: %u saves to NVS.\n", usage_saves);
+  fprintf(stderr, "Clock: %u syncs, %u steps, drift %.2f ppm, last offset %.3f ms, jitter %.3f ms.\n", 
+    stats.syncs, stats.steps, stats.drift_ppm, stats.offset_us / 1e3, stats.jitter_us / 1e3);
+  return 0;
+}
\ No newline at end of file
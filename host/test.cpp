@@ -0,0 +1,851 @@
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "fakes.h"
+#include "intensity.h"
+#include "json.h"
+#include "ledc_interface.h"
+#include "local_time.h"
+#include "main.h"
+#include "nvs_interface.h"
+#include "ota_interface.h"
+#include "schedule.h"
+#include "scheduler.h"
+#include "compositor.h"
+#include "solar.h"
+#include "lunar.h"
+#include "effects.h"
+#include "mbedtls/sha256.h"
+
+/*
+  Tests of the core logic against the host fakes. Each failed check is
+  printed and the run exits nonzero so CTest reports it.
+
+  Usage: esp-pwm-test
+*/
+
+static uint32_t failures = 0;
+
+/**
+  @brief  Record a failure if a condition doesn't hold
+
+  @param  ok Condition which should be true
+  @param  format printf style description of the check
+  @retval bool - ok
+*/
+static bool check(bool ok, const char* format, ...)
+{
+  if (ok)
+    return true;
+
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "FAIL: ");
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+
+  failures++;
+  return false;
+}
+
+/**
+  @brief  OTA handle which keeps the image in memory. Programming lags
+          behind the writes by whole blocks like OTA::Writer
+*/
+class MemoryHandle : public OTA::Handle
+{
+  public:
+    std::vector<uint8_t> image;
+    uint32_t timeout_ms = 0;
+    size_t lag_blocks = 0;       // Full blocks buffered but not yet programmed
+    size_t fail_after = SIZE_MAX; // Writes fail once the image reaches this size
+
+    esp_err_t start(void) { image.clear(); return ESP_OK; }
+
+    esp_err_t write(uint8_t* data, uint16_t length)
+    {
+      if (image.size() + length > fail_after)
+        return ESP_FAIL;
+
+      image.insert(image.end(), data, data + length);
+      return ESP_OK;
+    }
+
+    OTA::end_result_t end(void) { return {ESP_OK, nullptr}; }
+    esp_err_t cleanup(void) { return ESP_OK; }
+    void expect_sha256(const uint8_t* /* sha256 */) {}
+    void set_timeout(uint32_t timeout_ms) { this->timeout_ms = timeout_ms; }
+
+    size_t written_bytes(void) const { return image.size(); }
+
+    size_t programmed_bytes(void) const
+    {
+      size_t blocks = image.size() / OTA::Writer::BLOCK_SIZE;
+      return (blocks > lag_blocks ? blocks - lag_blocks : 0) * OTA::Writer::BLOCK_SIZE;
+    }
+};
+
+/**
+  @brief  Send part of an upload in chunks like a connection would
+
+  @param  upload Handle receiving the upload
+  @param  data Whole upload
+  @param  offset Offset to send from
+  @param  length Bytes to send
+  @param  random Source of chunk sizes
+  @retval bool - All writes succeeded
+*/
+static bool send(OTA::Handle& upload, std::vector<uint8_t>& data, size_t offset, size_t length, std::mt19937& random)
+{
+  std::uniform_int_distribution<size_t> chunk(1, 1460);
+
+  size_t end = std::min(offset + length, data.size());
+  while (offset < end)
+  {
+    uint16_t count = std::min(chunk(random), end - offset);
+    if (upload.write(data.data() + offset, count) != ESP_OK)
+      return false;
+
+    offset += count;
+  }
+
+  return true;
+}
+
+/**
+  @brief  Interrupt an upload at random points and resume it from the offset
+          the handle reports, as tools/ota_upload.py does
+
+  @param  none
+  @retval none
+*/
+static void test_ota_resume()
+{
+  std::mt19937 random(1);
+
+  std::vector<uint8_t> data(200000);
+  for (uint8_t& b : data)
+    b = random();
+
+  for (size_t lag = 0; lag < OTA::Writer::BLOCK_COUNT; lag++)
+  {
+    MemoryHandle* inner = new MemoryHandle();
+    inner->lag_blocks = lag;
+
+    OTA::ResumableHandle upload(inner, "firmware", "image");
+    check(inner->timeout_ms == OTA::ResumableHandle::RESUME_TIMEOUT_MS, "Resumable upload extends the timeout to wait for a reconnect");
+    check(upload.start() == ESP_OK, "Resumable upload starts");
+
+    std::uniform_int_distribution<size_t> disconnect(1, 40000);
+
+    size_t offset = 0;
+    size_t sent = 0;
+    uint32_t resumes = 0;
+    while (sent < data.size())
+    {
+      size_t length = disconnect(random);
+      check(send(upload, data, offset, length, random), "Write from offset %zu succeeds", offset);
+      sent = std::min(offset + length, data.size());
+
+      // Reconnect from the offset reported by GET /ota
+      size_t committed = upload.committed();
+      check(committed <= inner->programmed_bytes(), "Committed offset %zu is programmed (%zu)", committed, inner->programmed_bytes());
+      check(committed >= offset, "Committed offset %zu doesn't go back from %zu", committed, offset);
+      check(upload.resume(committed), "Resume from the committed offset %zu", committed);
+
+      offset = committed;
+      resumes++;
+    }
+
+    // Resending the tail again is dropped as well
+    check(upload.resume(upload.committed()) && send(upload, data, upload.committed(), data.size(), random), "Resend the tail");
+
+    check(inner->image == data, "Image with %zu blocks lag survives %u disconnects", lag, resumes);
+    check(!upload.resume(data.size() + 1), "Resume past the accepted data is refused");
+    check(upload.end().status == ESP_OK, "Resumable upload ends");
+  }
+
+  // A write the handle rejects is never committed
+  MemoryHandle* inner = new MemoryHandle();
+  inner->fail_after = 50000;
+
+  OTA::ResumableHandle upload(inner, "spiffs", "image");
+  upload.start();
+
+  check(!send(upload, data, 0, data.size(), random), "Writes past a flash error fail");
+  check(upload.committed() <= inner->fail_after, "Committed offset %zu stops at the flash error", upload.committed());
+
+  check(upload.matches("spiffs", "image") && !upload.matches("firmware", "image") && !upload.matches("spiffs", ""), "Upload matches its target and identity");
+}
+
+/**
+  @brief  Append a little endian uint32_t to a buffer
+*/
+static void append_u32(std::vector<uint8_t>& data, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    data.push_back(value >> (8 * i));
+}
+
+/**
+  @brief  Compute the SHA-256 of a buffer
+*/
+static std::vector<uint8_t> sha256(const std::vector<uint8_t>& data)
+{
+  std::vector<uint8_t> digest(32);
+
+  mbedtls_sha256_context context;
+  mbedtls_sha256_init(&context);
+  mbedtls_sha256_starts_ret(&context, 0);
+  mbedtls_sha256_update_ret(&context, data.data(), data.size());
+  mbedtls_sha256_finish_ret(&context, digest.data());
+  mbedtls_sha256_free(&context);
+
+  return digest;
+}
+
+/**
+  @brief  Apply a patch through a delta handle against the fake flash
+
+  @param  partition Base partition
+  @param  patch Whole patch
+  @param  image Reconstructed image
+  @param  random Source of chunk sizes
+  @retval esp_err_t - Result of the upload
+*/
+static esp_err_t apply_patch(const esp_partition_t* partition, std::vector<uint8_t>& patch, std::vector<uint8_t>& image, std::mt19937& random)
+{
+  MemoryHandle* inner = new MemoryHandle();
+  OTA::DeltaHandle delta(inner, partition);
+
+  esp_err_t result = delta.start();
+  if (result != ESP_OK)
+    return result;
+
+  if (!send(delta, patch, 0, patch.size(), random))
+  {
+    delta.cleanup();
+    image = inner->image;
+    return ESP_FAIL;
+  }
+
+  result = delta.end().status;
+  image = inner->image;
+
+  return result;
+}
+
+/**
+  @brief  Rebuild an image from an EPD1 patch against a base partition and
+          reject patches for another base or cut short
+
+  @param  none
+  @retval none
+*/
+static void test_ota_delta()
+{
+  std::mt19937 random(2);
+
+  std::vector<uint8_t> base(300000);
+  for (uint8_t& b : base)
+    b = random();
+
+  esp_partition_t partition = {};
+  partition.size = 0x100000;
+  Fake::Flash::set_contents(&partition, base);
+
+  std::vector<uint8_t> inserted(5000);
+  for (uint8_t& b : inserted)
+    b = random();
+
+  // Keep the start, insert new data, move the tail and repeat the start
+  std::vector<uint8_t> target(base.begin(), base.begin() + 100000);
+  target.insert(target.end(), inserted.begin(), inserted.end());
+  target.insert(target.end(), base.begin() + 150000, base.end());
+  target.insert(target.end(), base.begin(), base.begin() + 20000);
+
+  std::vector<uint8_t> base_sha256 = sha256(base);
+  std::vector<uint8_t> target_sha256 = sha256(target);
+
+  auto build = [&](const std::vector<uint8_t>& expected_base) {
+    std::vector<uint8_t> patch;
+    append_u32(patch, OTA::DeltaHandle::MAGIC);
+    append_u32(patch, base.size());
+    append_u32(patch, target.size());
+    patch.insert(patch.end(), expected_base.begin(), expected_base.end());
+    patch.insert(patch.end(), target_sha256.begin(), target_sha256.end());
+
+    auto op = [&](uint8_t code, uint32_t offset, uint32_t length) {
+      patch.push_back(code);
+      append_u32(patch, offset);
+      append_u32(patch, length);
+    };
+
+    op(OTA::DeltaHandle::OP_COPY, 0, 100000);
+    op(OTA::DeltaHandle::OP_INSERT, 0, inserted.size());
+    patch.insert(patch.end(), inserted.begin(), inserted.end());
+    op(OTA::DeltaHandle::OP_COPY, 150000, 150000);
+    op(OTA::DeltaHandle::OP_COPY, 0, 20000);
+
+    return patch;
+  };
+
+  std::vector<uint8_t> patch = build(base_sha256);
+  check(patch.size() == OTA::DeltaHandle::HEADER_SIZE + 4 * OTA::DeltaHandle::OP_SIZE + inserted.size(), "Patch has a header and four ops");
+
+  std::vector<uint8_t> image;
+  check(apply_patch(&partition, patch, image, random) == ESP_OK, "Delta patch applies");
+  check(image == target, "Delta patch rebuilds the target (%zu of %zu bytes)", image.size(), target.size());
+
+  // A patch generated against other firmware must not write anything
+  std::vector<uint8_t> other = base_sha256;
+  other[0] ^= 0xFF;
+  std::vector<uint8_t> wrong = build(other);
+  check(apply_patch(&partition, wrong, image, random) != ESP_OK, "Delta patch with the wrong base hash fails");
+  check(image.empty(), "Delta patch with the wrong base hash writes nothing");
+
+  // Cut the last op in half
+  std::vector<uint8_t> truncated(patch.begin(), patch.end() - OTA::DeltaHandle::OP_SIZE / 2);
+  check(apply_patch(&partition, truncated, image, random) == ESP_ERR_INVALID_SIZE, "Delta patch truncated mid op fails");
+
+  // Copies are bounded by the base image
+  std::vector<uint8_t> outside = patch;
+  outside[OTA::DeltaHandle::HEADER_SIZE + 1 + 2] = 0x10; // First copy from 0x100000
+  check(apply_patch(&partition, outside, image, random) != ESP_OK, "Delta copy outside the base fails");
+}
+
+/**
+  @brief  Malformed layers and schedule edits are rejected rather than
+          throwing, since the firmware is built without exceptions
+
+  @param  none
+  @retval none
+*/
+static void test_json_validation()
+{
+  const char* bad_layers[] = {
+    R"({"name": "a", "intensities": {"x": 10}})",
+    R"({"name": "a", "intensities": {"99999999999": 10}})",
+    R"({"name": "a", "intensities": {"-1": 10}})",
+    R"({"name": "a", "intensities": {"0": "bright"}})",
+    R"({"name": "a", "intensities": {"0": [10]}})",
+    R"({"name": "a", "intensities": [10]})",
+    R"({"name": "a", "remove": "yes"})",
+    R"({"name": "a", "priority": 2, "intensities": {"0": 10}})",
+    R"({"name": "a", "mode": true, "intensities": {"0": 10}})",
+    R"({"name": "a", "duration": -1, "intensities": {"0": 10}})",
+    R"({"name": "a", "blend": "slow", "intensities": {"0": 10}})",
+  };
+
+  for (const char* json : bad_layers)
+  {
+    Compositor::layer_t layer;
+    bool remove = false;
+    check(!JSON::parse_layer(json, layer, remove), "Layer %s is rejected", json);
+  }
+
+  Compositor::layer_t layer;
+  bool remove = false;
+  check(JSON::parse_layer(R"({"name": "a", "priority": "scene", "intensities": {"0": 10, "1": null, "2": "", "99": 5}, "duration": 60})", layer, remove) && 
+        !remove && layer.intensities.get(LEDC_CHANNEL_0) == Intensity::from_percent(10) && !layer.intensities.contains(LEDC_CHANNEL_1) && !layer.intensities.contains(LEDC_CHANNEL_2),
+        "Layer with empty cells and an unknown channel is accepted");
+
+  Scheduler::edit_t edit;
+  check(!JSON::parse_schedule_edit(R"({"upsert": {"08:00": {"zero": 10}}})", edit), "Schedule upsert with a bad channel is rejected");
+  check(!JSON::parse_schedule_edit(R"({"upsert": {"08:00": {"0": {}}}})", edit), "Schedule upsert with a bad intensity is rejected");
+
+  Schedule::entry_t entry = JSON::parse_schedule_entry(R"({"tod": "08:00", "0": 50, "1": "x"})");
+  check(entry.empty(), "Malformed stored entry parses as empty");
+}
+
+/**
+  @brief  Fixed point intensities give the duties of the previous floating 
+          point conversion and round trip whole percentages
+
+  @param  none
+  @retval none
+*/
+static void test_intensity()
+{
+  const uint32_t max_duty = (1 << LEDC::LED_RESOLUTION) - 1;
+
+  for (int32_t percent = 0; percent <= 100; percent++)
+  {
+    // Stored as float, scaled with double math and truncated
+    float stored = percent;
+    uint32_t expected = (double) stored / 100.0 * max_duty;
+
+    Intensity::intensity_t intensity = Intensity::from_percent(percent);
+    uint32_t duty = Intensity::to_duty(intensity, max_duty);
+
+    check(duty == expected, "Duty at %d%% is %u, expected %u", percent, duty, expected);
+    check(Intensity::to_percent(intensity) == (uint32_t) percent, "%d%% round trips as %u%%", percent, Intensity::to_percent(intensity));
+  }
+}
+
+/**
+  @brief  Computed sunrise and sunset are within a minute of published times,
+          which are rounded to the minute. Days without a sunrise or sunset 
+          report none
+
+  @param  none
+  @retval none
+*/
+static void test_solar()
+{
+  static constexpr int32_t MAX_ERROR_S = 60;
+
+  struct reference_t
+  {
+    const char* city;
+    float latitude;
+    float longitude;
+    int year, month, day;
+    int32_t sunrise_min; // Minutes from midnight UTC of the date. Negative for the day before
+    int32_t sunset_min;
+  };
+
+  static const reference_t references[] = {
+    {"London", 51.5074f, -0.1278f, 2024, 6, 20, 3 * 60 + 43, 20 * 60 + 21},       // 04:43 and 21:21 BST
+    {"London", 51.5074f, -0.1278f, 2024, 12, 21, 8 * 60 + 4, 15 * 60 + 53},       // 08:04 and 15:53 GMT
+    {"New York", 40.7128f, -74.006f, 2024, 6, 20, 9 * 60 + 25, 24 * 60 + 31},     // 05:25 and 20:31 EDT
+    {"New York", 40.7128f, -74.006f, 2024, 12, 21, 12 * 60 + 17, 21 * 60 + 32},   // 07:17 and 16:32 EST
+    {"Sydney", -33.8688f, 151.2093f, 2024, 12, 21, -(5 * 60 + 19), 9 * 60 + 5},   // 05:41 and 20:05 AEDT
+    {"Sydney", -33.8688f, 151.2093f, 2024, 6, 21, -(3 * 60), 6 * 60 + 54},        // 07:00 and 16:54 AEST
+  };
+
+  for (auto& r : references)
+  {
+    struct tm date_tm = {};
+    date_tm.tm_year = r.year - 1900;
+    date_tm.tm_mon = r.month - 1;
+    date_tm.tm_mday = r.day;
+    time_t date = timegm(&date_tm);
+
+    Solar::config_t config = {.enabled = true, .latitude = r.latitude, .longitude = r.longitude, .channel = -1, .intensity = Intensity::FULL_SCALE};
+    Solar::day_t day = Solar::get_day(config, date);
+
+    int32_t sunrise = day.events[Solar::ANCHOR_SUNRISE] - (date + r.sunrise_min * 60);
+    int32_t sunset = day.events[Solar::ANCHOR_SUNSET] - (date + r.sunset_min * 60);
+
+    check(std::abs(sunrise) <= MAX_ERROR_S, "Sunrise in %s on %04d-%02d-%02d is %d s off", r.city, r.year, r.month, r.day, sunrise);
+    check(std::abs(sunset) <= MAX_ERROR_S, "Sunset in %s on %04d-%02d-%02d is %d s off", r.city, r.year, r.month, r.day, sunset);
+  }
+
+  // Tromso has polar night at the winter solstice and midnight sun at the summer solstice
+  for (int month : {6, 12})
+  {
+    struct tm date_tm = {};
+    date_tm.tm_year = 2024 - 1900;
+    date_tm.tm_mon = month - 1;
+    date_tm.tm_mday = 21;
+
+    Solar::config_t config = {.enabled = true, .latitude = 69.6492f, .longitude = 18.9553f, .channel = -1, .intensity = Intensity::FULL_SCALE};
+    Solar::day_t day = Solar::get_day(config, timegm(&date_tm));
+
+    float noon = Solar::get_sin_elevation(day, day.events[Solar::ANCHOR_NOON]);
+    check(day.events[Solar::ANCHOR_SUNRISE] == Solar::INVALID_TIME && day.events[Solar::ANCHOR_SUNSET] == Solar::INVALID_TIME, "Tromso has no sunrise or sunset in month %d", month);
+    check((month == 6) == (noon > 0), "Tromso noon elevation in month %d is %f", month, noon);
+  }
+}
+
+/**
+  @brief  The moon phase is within 12 hours of the new and full moons of 
+          eclipses, and the moon rises within 2 hours of sunrise when new and 
+          of sunset when full
+
+  @param  none
+  @retval none
+*/
+static void test_lunar()
+{
+  static constexpr float MAX_ERROR_H = 12;
+  static constexpr int64_t MAX_RISE_ERROR_S = 2 * 3600;
+
+  struct reference_t
+  {
+    int year, month, day, hour, minute; // UTC
+    bool full;
+  };
+
+  static const reference_t references[] = {
+    {2024, 3, 25, 7, 0, true},    // Penumbral lunar eclipse
+    {2024, 4, 8, 18, 21, false},  // Total solar eclipse
+    {2024, 9, 18, 2, 34, true},   // Partial lunar eclipse
+    {2024, 10, 2, 18, 49, false}, // Annular solar eclipse
+    {2025, 3, 14, 6, 55, true},   // Total lunar eclipse
+    {2025, 3, 29, 10, 58, false}, // Partial solar eclipse
+  };
+
+  // New York, whose local day starting at 05:00 UTC holds the rise near the event
+  Solar::config_t location = {.enabled = true, .latitude = 40.7128f, .longitude = -74.006f, .channel = -1, .intensity = Intensity::FULL_SCALE};
+
+  for (auto& r : references)
+  {
+    struct tm event_tm = {};
+    event_tm.tm_year = r.year - 1900;
+    event_tm.tm_mon = r.month - 1;
+    event_tm.tm_mday = r.day;
+    event_tm.tm_hour = r.hour;
+    event_tm.tm_min = r.minute;
+    time_t event = timegm(&event_tm);
+
+    float expected = r.full ? Lunar::SYNODIC_MONTH_DAYS / 2 : 0;
+    float error = Lunar::get_age(event) - expected;
+    if (error > Lunar::SYNODIC_MONTH_DAYS / 2)
+      error -= Lunar::SYNODIC_MONTH_DAYS;
+
+    check(std::abs(error) * 24 <= MAX_ERROR_H, "Moon phase on %04d-%02d-%02d is %.2f h off", r.year, r.month, r.day, error * 24);
+
+    // A new moon rises with the sun and a full moon as it sets
+    time_t date = event - event % 86400;
+    Solar::day_t sun = Solar::get_day(location, date);
+    Lunar::day_t moon = Lunar::get_day(location, date + 5 * 3600);
+    time_t solar_event = sun.events[r.full ? Solar::ANCHOR_SUNSET : Solar::ANCHOR_SUNRISE];
+
+    check(moon.rise != Lunar::INVALID_TIME && std::abs((int64_t) (moon.rise - solar_event)) <= MAX_RISE_ERROR_S,
+          "Moonrise on %04d-%02d-%02d is %lld s from the sun", r.year, r.month, r.day, (long long) (moon.rise - solar_event));
+  }
+}
+
+/**
+  @brief  Enable effects on every channel with clouds and a storm open all day
+  
+  @param  seed Seed of the effects
+  @retval none
+*/
+static void enable_effects(uint32_t seed)
+{
+  nlohmann::json channels = nlohmann::json::array();
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+    channels.push_back(c);
+
+  nlohmann::json effects = {
+    {"seed", seed},
+    {"channels", channels},
+    {"clouds", {{"start", "00:00"}, {"end", "23:59"}, {"cover", 50}, {"depth", 60}, {"period", 120}}},
+    {"storm", {{"start", "00:00"}, {"end", "23:59"}, {"darkening", 70}, {"flashes", 60}, {"flash", 100}}},
+  };
+
+  JSON::parse_settings(nlohmann::json({{"effects", effects}}).dump());
+  Effects::handle_events(Fake::Events::take() & Effects::EVENTS);
+}
+
+/**
+  @brief  Step the effects at the tick rate over the LEDC fake for a while 
+          from a fixed wall time
+  
+  @param  seed Seed of the effects
+  @retval std::vector<std::pair<ledc_channel_t, uint32_t>> - Duties written
+*/
+static std::vector<std::pair<ledc_channel_t, uint32_t>> record_effects(uint32_t seed)
+{
+  static constexpr int64_t START_US = 1718884800LL * 1000000; // 2024-06-20 12:00 UTC
+  static constexpr uint32_t TICKS = 10 * 60 * Effects::TICK_HZ;
+
+  Schedule::entry_t off;
+  Schedule::entry_t full;
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+  {
+    off.set((ledc_channel_t) c, Intensity::OFF);
+    full.set((ledc_channel_t) c, Intensity::FULL_SCALE);
+  }
+
+  LEDC::set_intensities(off, 0);
+  Fake::LEDC::clear();
+  Fake::Clock::set_utc(START_US);
+
+  enable_effects(seed);
+  Effects::set_base(full, 0);
+
+  for (uint32_t t = 0; t < TICKS; t++)
+  {
+    Fake::Clock::advance(1000000 / Effects::TICK_HZ);
+    Fake::Events::take();
+    Effects::handle_events(MAIN_EVENT_EFFECTS_TICK);
+  }
+
+  std::vector<std::pair<ledc_channel_t, uint32_t>> duties;
+  for (auto& write : Fake::LEDC::writes())
+    duties.push_back({write.channel, write.to});
+
+  return duties;
+}
+
+/**
+  @brief  The effects reproduce from the seed through the LEDC and depend on 
+          it, and a storm configured for 60 flashes an hour flashes about as 
+          often
+
+  @param  none
+  @retval none
+*/
+static void test_effects()
+{
+  std::vector<std::pair<ledc_channel_t, uint32_t>> first = record_effects(1);
+  check(!first.empty(), "Effects write no duties");
+  check(record_effects(1) == first, "Effects differ between runs of the same seed");
+  check(record_effects(2) != first, "Effects don't depend on the seed");
+
+  // Lightning over a dark base. Strokes closer than a stroke period belong to one flash
+  Effects::config_t config = NVS::get_effects_config();
+  int64_t start_ms = 1718884800LL * 1000;
+  int64_t last_ms = INT64_MIN / 2;
+
+  uint32_t flashes = 0;
+  for (int64_t t = start_ms; t < start_ms + 3600 * 1000; t += 10)
+  {
+    Intensity::intensity_t intensities[LED_CHANNEL_COUNT] = {};
+    Effects::evaluate(config, t, 0, intensities);
+    if (intensities[0] == Intensity::OFF)
+      continue;
+
+    if (t - last_ms > 120)
+      flashes++;
+
+    last_ms = t;
+  }
+
+  check(flashes >= 40 && flashes <= 80, "Storm of 60 flashes an hour flashed %u times", flashes);
+
+  // Still running over the full base of the last recording
+  Schedule::entry_t full;
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+    full.set((ledc_channel_t) c, Intensity::FULL_SCALE);
+
+  check(Effects::running() && !Effects::set_base(full, 5000), "Effects report an unchanged base as no change");
+
+  full.set(LEDC_CHANNEL_0, Intensity::OFF);
+  check(Effects::set_base(full, 5000), "Effects report a changed base");
+
+  // A tick held up by other work of the main loop is counted late
+  Effects::stats_t before = Effects::get_stats();
+  Fake::Clock::advance(150 * 1000);
+  Fake::Events::take();
+  Effects::handle_events(MAIN_EVENT_EFFECTS_TICK);
+
+  Effects::stats_t after = Effects::get_stats();
+  check(before.late == 0 && after.late == 1 && after.max_latency_ms >= 100, "Tick 150 ms behind is late (%u late, %u ms)", after.late, after.max_latency_ms);
+
+  // Hand the output back
+  NVS::save_effects_config(Effects::DEFAULT_CONFIG);
+  Effects::handle_events(MAIN_EVENT_CONFIG_UPDATE);
+  Fake::LEDC::clear();
+}
+
+/**
+  @brief  Run the main loop's scheduler until the virtual clock reaches a 
+          boot time
+
+  @param  end_us Boot time to stop at
+  @retval none
+*/
+static void run_until(int64_t end_us)
+{
+  while (true)
+  {
+    uint32_t events;
+    while ((events = Fake::Events::take()) != 0)
+      Scheduler::handle_events(events & Scheduler::EVENTS);
+
+    int64_t next = Fake::Timers::next_expiry_us();
+    if (next < 0 || next > end_us)
+      break;
+
+    Fake::Clock::advance_to_next_timer(end_us - Fake::Clock::boot_us());
+  }
+
+  Fake::Clock::advance(end_us - Fake::Clock::boot_us());
+}
+
+/**
+  @brief  Events land on the first instant of their wall time across both 
+          DST transitions of CONFIG_LOCAL_TIMEZONE in 2024. Entries in the 
+          skipped hour fire at the transition and entries in the repeated 
+          hour fire once, every day between them
+
+  @param  none
+  @retval none
+*/
+static void test_dst_transitions()
+{
+  static constexpr time_t DST_START = 1710061200; // 2024-03-10 09:00 UTC, 02:00 MST
+  static constexpr time_t DST_END = 1730620800;   // 2024-11-03 08:00 UTC, 02:00 MDT
+  static constexpr time_t SPRING = 1710028800;    // 2024-03-10 as a wall time
+  static constexpr time_t FALL = 1730592000;      // 2024-11-03 as a wall time
+
+  // First UTC instant of a wall time, from the rules rather than the TZ database
+  auto expected = [](time_t wall) -> time_t
+  {
+    time_t mdt = wall + 6 * 3600;
+    time_t mst = wall + 7 * 3600;
+    bool mdt_valid = mdt >= DST_START && mdt < DST_END;
+    bool mst_valid = mst < DST_START || mst >= DST_END;
+
+    if (mdt_valid && mst_valid)
+      return std::min(mdt, mst);
+
+    return mdt_valid ? mdt : mst_valid ? mst : DST_START;
+  };
+
+  for (time_t date : {SPRING, FALL})
+  {
+    for (time_t tod : {0, 5400, 9000, 43200})
+    {
+      time_t event = Schedule::get_event_time(date + tod);
+      check(event == expected(date + tod), "Event at wall %lld is %lld, expected %lld", (long long) (date + tod), (long long) event, (long long) expected(date + tod));
+    }
+  }
+
+  // One entry in the hour skipped in spring and one in the hour repeated in the fall
+  nlohmann::json settings;
+  settings["timers"]["0"] = {{"id", 0}, {"freq", 1000}};
+  settings["channels"]["0"] = {{"id", 0}, {"enabled", true}, {"timer", 0}, {"gpio", 4}, {"name", "Channel 0"}, {"watts", 10.0}};
+  settings["schedule"]["01:30"] = {{"0", 50}};
+  settings["schedule"]["02:30"] = {{"0", 10}};
+
+  JSON::parse_settings(settings.dump());
+  Fake::Events::take();
+
+  time_t start = expected(SPRING);
+  time_t end = expected(FALL + 86400);
+  Fake::Clock::reset((int64_t) start * 1000000);
+  Fake::LEDC::clear();
+
+  Scheduler::init();
+  signal_event(MAIN_EVENT_SYSTEM_TIME_UPDATED);
+  signal_event(MAIN_EVENT_SCHEDULE_UPDATE);
+
+  run_until((int64_t) (end - start) * 1000000);
+
+  const uint32_t max_duty = (1 << LEDC::LED_RESOLUTION) - 1;
+  std::vector<time_t> ramps[2];
+  for (auto& write : Fake::LEDC::writes())
+  {
+    time_t utc = start + (write.time_us + 500000) / 1000000;
+    if (write.channel != LEDC_CHANNEL_0 || write.time_us == 0)
+      continue;
+
+    if (write.to == Intensity::to_duty(Intensity::from_percent(50), max_duty))
+      ramps[0].push_back(utc);
+    else if (write.to == Intensity::to_duty(Intensity::from_percent(10), max_duty))
+      ramps[1].push_back(utc);
+  }
+
+  size_t days = (FALL - SPRING) / 86400 + 1;
+  check(ramps[0].size() == days && ramps[1].size() == days, "Each entry fires once a day over %zu days: %zu and %zu", days, ramps[0].size(), ramps[1].size());
+
+  for (size_t d = 0; d < std::min(days, ramps[0].size()); d++)
+    check(ramps[0][d] == expected(SPRING + d * 86400 + 5400), "01:30 on day %zu fired at %lld", d, (long long) ramps[0][d]);
+
+  for (size_t d = 0; d < std::min(days, ramps[1].size()); d++)
+    check(ramps[1][d] == expected(SPRING + d * 86400 + 9000), "02:30 on day %zu fired at %lld", d, (long long) ramps[1][d]);
+}
+
+/**
+  @brief  Edits of a schedule with solar keys, a channel following the sun
+          and moonlight drive the lights the same as loading the edited
+          schedule again
+
+  @param  none
+  @retval none
+*/
+static void test_solar_edits()
+{
+  static constexpr time_t START = 1718409600; // 2024-06-14 18:00 MDT
+
+  nlohmann::json settings;
+  settings["timers"]["0"] = {{"id", 0}, {"freq", 1000}};
+  for (int c = 0; c < 3; c++)
+    settings["channels"][std::to_string(c)] = {{"id", c}, {"enabled", true}, {"timer", 0}, {"gpio", 4 + c}, {"name", "Channel"}, {"watts", 10.0}};
+
+  settings["schedule"]["08:00"] = {{"0", 50}, {"1", 20}};
+  settings["schedule"]["12:00"] = {{"0", 60}};
+  settings["schedule"]["20:00"] = {{"0", 0}, {"1", 0}};
+  settings["schedule"]["sunrise-00:30"] = {{"0", 20}};
+  settings["schedule"]["sunset+00:30"] = {{"1", 5}, {"2", 50}};
+  settings["solar"] = {{"latitude", 40.0}, {"longitude", -105.0}, {"channel", 2}, {"intensity", 100}};
+  settings["moon"] = {{"channel", 1}, {"intensity", 10}, {"blend", "max"}};
+
+  const char* edit_json = R"({"upsert": {"sunset+01:00": {"0": 10, "1": 30}, "10:00": {"1": 40}, "14:07": {"2": 70}}, "delete": ["sunrise-00:30", ["19:00", "21:00"]]})";
+
+  // Duty writes of the rest of the day after editing at 00:30, by posting the edit or by loading the schedule again
+  std::vector<Fake::LEDC::duty_write_t> writes[2];
+  for (int reload = 0; reload < 2; reload++)
+  {
+    JSON::parse_settings(settings.dump());
+    Fake::Events::take();
+
+    Fake::Clock::reset((int64_t) START * 1000000);
+    Fake::LEDC::clear();
+
+    Scheduler::init();
+    signal_event(MAIN_EVENT_SYSTEM_TIME_UPDATED);
+    signal_event(MAIN_EVENT_SCHEDULE_UPDATE);
+    run_until((int64_t) 6 * 3600 * 1000000 + 1800 * 1000000);
+
+    Scheduler::edit_t edit;
+    check(JSON::parse_schedule_edit(edit_json, edit), "Solar schedule edit is accepted");
+    check(edit.solar_erases.size() == 1 && edit.solar_upserts.size() == 1 && edit.upserts.size() == 2, "Solar keys are edited by name");
+
+    if (reload)
+      signal_event(MAIN_EVENT_SCHEDULE_UPDATE);
+    else
+      Scheduler::post_edit(edit);
+
+    size_t before = Fake::LEDC::writes().size();
+    run_until((int64_t) 29 * 3600 * 1000000 + 1800 * 1000000);
+
+    writes[reload].assign(Fake::LEDC::writes().begin() + before, Fake::LEDC::writes().end());
+  }
+
+  bool same = writes[0].size() == writes[1].size();
+  for (size_t i = 0; same && i < writes[0].size(); i++)
+  {
+    same = writes[0][i].time_us == writes[1][i].time_us && writes[0][i].channel == writes[1][i].channel &&
+           writes[0][i].from == writes[1][i].from && writes[0][i].to == writes[1][i].to;
+  }
+
+  check(!writes[0].empty() && same, "Edited solar schedule drives %zu duty writes like a reload (%zu)", writes[0].size(), writes[1].size());
+}
+
+int main()
+{
+  // Rejected input is expected to log errors
+  Fake::Log::set_level(ESP_LOG_NONE);
+  NVS::init();
+  LocalTime::init();
+  Compositor::init();
+  LEDC::init();
+  Effects::init();
+
+  // Evaluate real TZ rules like the device does
+  setenv("TZ", CONFIG_LOCAL_TIMEZONE, 1);
+  tzset();
+
+  test_ota_resume();
+  test_ota_delta();
+  test_json_validation();
+  test_intensity();
+  test_solar();
+  test_lunar();
+  test_effects();
+  test_dst_transitions();
+  test_solar_edits();
+
+  if (failures != 0)
+  {
+    fprintf(stderr, "%u checks failed.\n", failures);
+    return 1;
+  }
+
+  printf("All checks passed.\n");
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,200 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sys/time.h>
+
+#include "clock.h"
+
+#define TAG "Clock"
+
+static constexpr double MAX_DRIFT_PPM = 500;
+static constexpr double DRIFT_GAIN = 0.5;       // Fraction of the measured drift error corrected each sync
+static constexpr int64_t MIN_DRIFT_INTERVAL_S = 60; // Syncs closer than this don't update the drift estimate
+
+static struct
+{
+  SemaphoreHandle_t mutex;
+  TimerHandle_t timer;
+  Clock::stats_t stats;
+  int64_t last_sync_us;     // Local time of the last sync, after correction
+  bool drift_valid;         // A sync has happened
+  double compensation_us;   // Fraction of a microsecond carried between periods
+} discipline;
+
+/**
+  @brief  Get the current UTC time in microseconds
+  
+  @param  none
+  @retval int64_t
+*/
+static int64_t get_time_us()
+{
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  return (int64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/**
+  @brief  Get the adjtime() correction still outstanding
+  
+  @param  none
+  @retval int64_t - Microseconds
+*/
+static int64_t get_remaining_slew()
+{
+  struct timeval old;
+  adjtime(nullptr, &old);
+
+  return (int64_t) old.tv_sec * 1000000 + old.tv_usec;
+}
+
+/**
+  @brief  Start slewing the clock by a correction
+  
+  @param  delta_us Correction in microseconds
+  @retval none
+*/
+static void slew(int64_t delta_us)
+{
+  struct timeval tv = {
+    .tv_sec = (time_t) (delta_us / 1000000),
+    .tv_usec = (suseconds_t) (delta_us % 1000000),
+  };
+
+  if (adjtime(&tv, nullptr) != 0)
+    ESP_LOGE(TAG, "Failed to slew clock by %lld us.", (long long) delta_us);
+}
+
+/**
+  @brief  Timer callback. Slew out the drift expected over the last period 
+          so time stays correct between syncs
+  
+  @param  timer Discipline timer
+  @retval none
+*/
+static void compensate(TimerHandle_t /* timer */)
+{
+  xSemaphoreTake(discipline.mutex, portMAX_DELAY);
+
+  if (discipline.drift_valid)
+  {
+    discipline.compensation_us -= discipline.stats.drift_ppm * Clock::DISCIPLINE_PERIOD_S;
+
+    // Carry the fraction to the next period
+    int64_t delta = (int64_t) discipline.compensation_us;
+    discipline.compensation_us -= delta;
+
+    // Add to any correction in progress
+    if (delta != 0)
+      slew(get_remaining_slew() + delta);
+  }
+
+  xSemaphoreGive(discipline.mutex);
+}
+
+/**
+  @brief  Start the periodic drift compensation
+  
+  @param  none
+  @retval none
+*/
+void Clock::init()
+{
+  discipline.mutex = xSemaphoreCreateMutex();
+
+  discipline.timer = xTimerCreate("ClockTimer", pdMS_TO_TICKS(DISCIPLINE_PERIOD_S * 1000), true, nullptr, compensate);
+  if (discipline.timer == NULL || xTimerStart(discipline.timer, 0) != pdPASS)
+    ESP_LOGE(TAG, "Failed to start clock discipline timer.");
+}
+
+/**
+  @brief  Discipline the clock to a time received from a server. Small 
+          offsets are slewed, large ones stepped. The offset remaining after 
+          compensation updates the drift estimate
+  
+  @param  server Time from the server
+  @retval none
+*/
+void Clock::sync(const struct timeval* server)
+{
+  xSemaphoreTake(discipline.mutex, portMAX_DELAY);
+
+  int64_t now = get_time_us();
+  int64_t offset = (int64_t) server->tv_sec * 1000000 + server->tv_usec - now;
+
+  // Correction still outstanding was already accounted for
+  int64_t residual = offset - get_remaining_slew();
+
+  stats_t& stats = discipline.stats;
+
+  // A step says nothing about how closely the clock was kept
+  bool step = std::abs(offset) > STEP_THRESHOLD_US;
+
+  double interval_s = (now - discipline.last_sync_us) / 1e6;
+  if (discipline.drift_valid && interval_s >= MIN_DRIFT_INTERVAL_S)
+  {
+    // A clock running fast reads ahead of the server
+    double error_ppm = -residual / interval_s;
+
+    // Anything faster than a crystal could drift is a step from elsewhere
+    if (std::abs(error_ppm) <= MAX_DRIFT_PPM)
+    {
+      stats.drift_ppm = std::min(std::max(stats.drift_ppm + DRIFT_GAIN * error_ppm, -MAX_DRIFT_PPM), MAX_DRIFT_PPM);
+
+      if (!step)
+      {
+        double error = (double) residual;
+        stats.jitter_us = std::sqrt(stats.jitter_us * stats.jitter_us + (error * error - stats.jitter_us * stats.jitter_us) / 4);
+      }
+    }
+    else
+      ESP_LOGW(TAG, "Offset of %lld ms over %.0f s is not drift. Ignoring.", (long long) residual / 1000, interval_s);
+  }
+
+  if (step)
+  {
+    ESP_LOGW(TAG, "Stepping clock by %lld ms.", (long long) offset / 1000);
+
+    settimeofday(server, nullptr);
+    stats.steps++;
+  }
+  else
+  {
+    ESP_LOGI(TAG, "Slewing clock by %lld us. Drift: %.2f ppm", (long long) offset, stats.drift_ppm);
+    slew(offset);
+  }
+
+  // Time before the first sync is arbitrary so it can't measure drift
+  discipline.drift_valid = true;
+
+  stats.offset_us = offset;
+  stats.syncs++;
+  stats.last_sync = server->tv_sec;
+
+  discipline.last_sync_us = (int64_t) server->tv_sec * 1000000 + server->tv_usec;
+
+  xSemaphoreGive(discipline.mutex);
+}
+
+/**
+  @brief  Get the clock discipline statistics
+  
+  @param  none
+  @retval Clock::stats_t
+*/
+Clock::stats_t Clock::get_stats()
+{
+  if (discipline.mutex == NULL)
+    return discipline.stats;
+
+  xSemaphoreTake(discipline.mutex, portMAX_DELAY);
+  stats_t stats = discipline.stats;
+  xSemaphoreGive(discipline.mutex);
+
+  return stats;
+}
\ No newline at end of file
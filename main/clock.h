@@ -0,0 +1,30 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <stdint.h>
+#include <sys/time.h>
+
+namespace Clock
+{
+  // Offsets larger than this are stepped. adjtime() slews at 1/64 so this takes about a minute
+  constexpr int64_t STEP_THRESHOLD_US = 1000000;
+
+  // Drift compensation is applied this often between syncs
+  constexpr uint32_t DISCIPLINE_PERIOD_S = 60;
+
+  typedef struct stats_t
+  {
+    int64_t offset_us; // Offset measured by the last sync, server minus local
+    double drift_ppm;  // Estimated rate the local clock runs fast
+    double jitter_us;  // RMS of the offset left after compensation, steps excluded
+    uint32_t syncs;
+    uint32_t steps;
+    time_t last_sync;
+  } stats_t;
+
+  void init(void);
+  void sync(const struct timeval* server);
+  stats_t get_stats(void);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,281 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include <algorithm>
+#include <time.h>
+
+#include "compositor.h"
+#include "main.h"
+#include "ledc_interface.h"
+#include "effects.h"
+
+#define TAG "Compositor"
+
+static struct
+{
+  SemaphoreHandle_t mutex;
+  TimerHandle_t timer;                      // Expires with the earliest layer
+  Schedule::entry_t base;                   // Schedule state beneath all layers
+  std::vector<Compositor::layer_t> layers;  // Sorted by priority, oldest first within a priority
+  Schedule::entry_t output;                 // Result of the last evaluation
+  Schedule::entry_t held;                   // Intensities layers are over on channels the base doesn't set
+  bool dirty;
+  uint32_t fade_ms;                         // Longest fade of the changes since the last evaluation
+} compositor;
+
+/**
+  @brief  Mark the output stale. Must hold the mutex
+
+  @param  fade_ms Fade time of the change
+  @retval none
+*/
+static void invalidate(uint32_t fade_ms)
+{
+  compositor.dirty = true;
+  compositor.fade_ms = std::max(compositor.fade_ms, fade_ms);
+}
+
+/**
+  @brief  Evaluate the layers over the base. Channels the base doesn't set 
+          are held at the intensity they had when a layer first touched 
+          them, so limits cap their real intensity and they return to it 
+          once no layer sets them. Must hold the mutex
+
+  @param  none
+  @retval Schedule::entry_t
+*/
+static Schedule::entry_t evaluate()
+{
+  Schedule::entry_t output = compositor.base;
+
+  uint32_t layered = 0;
+  for (auto& layer : compositor.layers)
+  {
+    for (auto pair : layer.intensities)
+    {
+      layered |= 1u << pair.first;
+
+      if (!output.contains(pair.first) && !compositor.held.contains(pair.first))
+        compositor.held.set(pair.first, LEDC::get_intensity(pair.first));
+    }
+  }
+
+  for (auto pair : compositor.held)
+  {
+    if (!output.contains(pair.first))
+      output.set(pair.first, pair.second);
+
+    // Released channels are commanded back to the held intensity once more
+    if (compositor.base.contains(pair.first) || (layered & (1u << pair.first)) == 0)
+      compositor.held.clear(pair.first);
+  }
+
+  for (auto& layer : compositor.layers)
+  {
+    for (auto pair : layer.intensities)
+    {
+      if (layer.mode == Compositor::MODE_OVERRIDE || output.get(pair.first) > pair.second)
+        output.set(pair.first, pair.second);
+    }
+  }
+
+  return output;
+}
+
+/**
+  @brief  Create the layer expiry timer
+
+  @param  none
+  @retval none
+*/
+void Compositor::init()
+{
+  compositor.mutex = xSemaphoreCreateMutex();
+
+  compositor.timer = xTimerCreate("LayerTimer", 1, false, nullptr,
+    [](TimerHandle_t /* t */) {
+      signal_event(MAIN_EVENT_LAYER_UPDATE);
+    });
+
+  if (compositor.timer == NULL)
+    ESP_LOGE(TAG, "Failed to create layer timer.");
+}
+
+/**
+  @brief  Set the schedule state beneath the layers and apply the result.
+          Called from the main loop
+
+  @param  state Intensities the schedule holds now
+  @param  fade_ms Fade time of the change
+  @retval bool - Any channel was commanded
+*/
+bool Compositor::set_base(const Schedule::entry_t& state, uint32_t fade_ms)
+{
+  xSemaphoreTake(compositor.mutex, portMAX_DELAY);
+  compositor.base = state;
+  invalidate(fade_ms);
+  xSemaphoreGive(compositor.mutex);
+
+  return update();
+}
+
+/**
+  @brief  Add a layer or replace the layer of the same name. Safe to call
+          from other tasks
+
+  @param  layer Layer to add
+  @retval bool - Layer was valid and added
+*/
+bool Compositor::set_layer(const layer_t& layer)
+{
+  if (layer.priority <= PRIORITY_SCHEDULE || layer.priority >= PRIORITY_MAX || layer.name.empty())
+    return false;
+
+  xSemaphoreTake(compositor.mutex, portMAX_DELAY);
+
+  auto existing = std::find_if(compositor.layers.begin(), compositor.layers.end(), [&](const layer_t& l) { return l.name == layer.name; });
+  if (existing != compositor.layers.end())
+    compositor.layers.erase(existing);
+  else if (compositor.layers.size() >= MAX_LAYERS)
+  {
+    xSemaphoreGive(compositor.mutex);
+
+    ESP_LOGW(TAG, "Layer limit of %d reached.", (int) MAX_LAYERS);
+    return false;
+  }
+
+  // Insert after the layers of equal priority
+  auto position = std::upper_bound(compositor.layers.begin(), compositor.layers.end(), layer.priority,
+    [](priority_t priority, const layer_t& l) { return priority < l.priority; });
+  compositor.layers.insert(position, layer);
+
+  invalidate(layer.blend_ms);
+
+  xSemaphoreGive(compositor.mutex);
+
+  ESP_LOGI(TAG, "Layer '%s' set. Priority: %d, Expires: %lld", layer.name.c_str(), layer.priority, (long long) layer.expires);
+
+  signal_event(MAIN_EVENT_LAYER_UPDATE);
+  return true;
+}
+
+/**
+  @brief  Remove a layer by name. Safe to call from other tasks
+
+  @param  name Name of the layer
+  @retval bool - Layer existed
+*/
+bool Compositor::remove_layer(const std::string& name)
+{
+  xSemaphoreTake(compositor.mutex, portMAX_DELAY);
+
+  auto existing = std::find_if(compositor.layers.begin(), compositor.layers.end(), [&](const layer_t& l) { return l.name == name; });
+  bool found = existing != compositor.layers.end();
+  if (found)
+  {
+    invalidate(existing->blend_ms);
+    compositor.layers.erase(existing);
+  }
+
+  xSemaphoreGive(compositor.mutex);
+
+  if (found)
+    signal_event(MAIN_EVENT_LAYER_UPDATE);
+
+  return found;
+}
+
+/**
+  @brief  Get a copy of the active layers
+
+  @param  none
+  @retval std::vector<Compositor::layer_t>
+*/
+std::vector<Compositor::layer_t> Compositor::get_layers()
+{
+  xSemaphoreTake(compositor.mutex, portMAX_DELAY);
+  std::vector<layer_t> layers = compositor.layers;
+  xSemaphoreGive(compositor.mutex);
+
+  return layers;
+}
+
+/**
+  @brief  Get the intensities of the last evaluation
+
+  @param  none
+  @retval Schedule::entry_t
+*/
+Schedule::entry_t Compositor::get_output()
+{
+  xSemaphoreTake(compositor.mutex, portMAX_DELAY);
+  Schedule::entry_t output = compositor.output;
+  xSemaphoreGive(compositor.mutex);
+
+  return output;
+}
+
+/**
+  @brief  Drop expired layers, evaluate the stack if anything changed and
+          send the result to the LEDC in one batch. Rearms the expiry timer
+          so it also follows changes of the system time. Called from the
+          main loop
+
+  @param  none
+  @retval bool - Any channel was commanded
+*/
+bool Compositor::update()
+{
+  time_t now = time(nullptr);
+
+  xSemaphoreTake(compositor.mutex, portMAX_DELAY);
+
+  // Expired layers blend out over their own blend time
+  time_t next_expiry = 0;
+  for (auto it = compositor.layers.begin(); it != compositor.layers.end();)
+  {
+    if (it->expires != 0 && it->expires <= now)
+    {
+      ESP_LOGI(TAG, "Layer '%s' expired.", it->name.c_str());
+
+      invalidate(it->blend_ms);
+      it = compositor.layers.erase(it);
+      continue;
+    }
+
+    if (it->expires != 0 && (next_expiry == 0 || it->expires < next_expiry))
+      next_expiry = it->expires;
+
+    ++it;
+  }
+
+  bool dirty = compositor.dirty;
+  uint32_t fade_ms = compositor.fade_ms;
+
+  if (dirty)
+  {
+    compositor.output = evaluate();
+    compositor.dirty = false;
+    compositor.fade_ms = 0;
+  }
+
+  Schedule::entry_t output = compositor.output;
+
+  xSemaphoreGive(compositor.mutex);
+
+  if (next_expiry == 0)
+    xTimerStop(compositor.timer, pdMS_TO_TICKS(1000));
+  else if (xTimerChangePeriod(compositor.timer, std::max<TickType_t>(pdMS_TO_TICKS64((next_expiry - now) * 1000), 1), pdMS_TO_TICKS(1000)) != pdPASS)
+    ESP_LOGE(TAG, "Failed to update layer timer.");
+
+  if (!dirty)
+    return false;
+
+  // Running effects fade the output in software beneath their modulation
+  if (Effects::running())
+    return Effects::set_base(output, fade_ms);
+
+  return LEDC::set_intensities(output, fade_ms) > 0;
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+#ifndef __COMPOSITOR_H__
+#define __COMPOSITOR_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "schedule.h"
+
+/**
+  @brief  Stack of layers evaluated over the schedule to produce the channel
+          intensities. Higher priorities are evaluated later so a manual
+          override beats a scene and limits cap everything beneath them
+*/
+namespace Compositor
+{
+  typedef enum
+  {
+    PRIORITY_SCHEDULE, // Base layer fed by the scheduler
+    PRIORITY_SCENE,
+    PRIORITY_MANUAL,
+    PRIORITY_LIMIT,
+    PRIORITY_MAX,
+  } priority_t;
+
+  typedef enum
+  {
+    MODE_OVERRIDE, // Replace the intensity of the channels the layer sets
+    MODE_LIMIT,    // Cap the intensity of the channels the layer sets
+  } mode_t;
+
+  typedef struct
+  {
+    std::string name;
+    priority_t priority;
+    mode_t mode;
+    Schedule::entry_t intensities;
+    time_t expires;    // UTC time the layer is removed. 0 never expires
+    uint32_t blend_ms; // Fade time when the layer is applied or removed
+  } layer_t;
+
+  constexpr size_t MAX_LAYERS = 16;
+
+  void init(void);
+
+  bool set_base(const Schedule::entry_t& state, uint32_t fade_ms);
+  bool set_layer(const layer_t& layer);
+  bool remove_layer(const std::string& name);
+  std::vector<layer_t> get_layers(void);
+
+  bool update(void);
+  Schedule::entry_t get_output(void);
+}
+
+#endif
\ No newline at end of file
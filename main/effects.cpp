@@ -0,0 +1,442 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <algorithm>
+#include <sys/time.h>
+
+#include "effects.h"
+#include "main.h"
+#include "compositor.h"
+#include "ledc_interface.h"
+#include "local_time.h"
+#include "nvs_interface.h"
+
+#define TAG "Effects"
+
+static constexpr int64_t MS_PER_DAY = 86400 * 1000;
+static constexpr uint32_t Q16_ONE = 1 << 16;
+static constexpr uint32_t STORM_SALT = 0x5f3759df;  // Separates the lightning hashes from the clouds
+static constexpr uint32_t STROKE_MS = 50;           // Length of one lightning stroke
+static constexpr uint32_t STROKE_PERIOD_MS = 120;   // Time from one stroke of a flash to the next
+static constexpr uint32_t MAX_STROKES = 3;
+
+static struct
+{
+  SemaphoreHandle_t mutex;                              // Guards the stats read by other tasks
+  TimerHandle_t timer;
+  Effects::config_t config;
+  bool active;                                          // Effects own the compositor output
+  uint32_t period_ms;                                   // Tick period the timer runs at
+  Schedule::entry_t target;                             // Compositor output the software fade approaches
+  Intensity::intensity_t from[LED_CHANNEL_COUNT];       // Base intensities the software fade started at
+  TickType_t fade_start;
+  TickType_t fade_ticks;
+  volatile TickType_t signaled;                         // Tick the timer signaled the pending tick at
+  volatile bool pending;                                // A tick was signaled and not yet run
+  Effects::stats_t stats;
+  uint64_t total_us;
+} effects;
+
+/**
+  @brief  Mix the bits of a word. Integer only so the host and the device
+          generate the same effects from a seed
+
+  @param  x Word to mix
+  @retval uint32_t
+*/
+static uint32_t hash(uint32_t x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+
+  return x;
+}
+
+/**
+  @brief  Smooth value noise in one dimension. Random values at the integer
+          lattice points are joined with a smoothstep
+
+  @param  seed Seed of the lattice
+  @param  position Position in lattice units, Q16
+  @retval uint32_t - 0 to Q16_ONE
+*/
+static uint32_t noise(uint32_t seed, int64_t position)
+{
+  uint32_t cell = (uint32_t) (position >> 16);
+  uint64_t f = position & (Q16_ONE - 1);
+  uint64_t s = (f * f * (3 * Q16_ONE - 2 * f)) >> 32;
+
+  int64_t a = hash(seed ^ hash(cell)) >> 16;
+  int64_t b = hash(seed ^ hash(cell + 1)) >> 16;
+
+  return a + (((b - a) * (int64_t) s) >> 16);
+}
+
+/**
+  @brief  Scale a Q16 fraction by another
+
+  @param  a Q16 fraction
+  @param  b Q16 fraction
+  @retval uint32_t
+*/
+static uint32_t scale(uint32_t a, uint32_t b)
+{
+  return ((uint64_t) a * b) >> 16;
+}
+
+/**
+  @brief  Strength of a window at a local time of day. Ramps over RAMP_S at
+          each edge so effects never start or stop abruptly
+
+  @param  window Window of the effect
+  @param  tod_ms Local time of day in milliseconds
+  @retval uint32_t - 0 outside the window to Q16_ONE
+*/
+static uint32_t envelope(const Effects::window_t& window, int64_t tod_ms)
+{
+  int64_t length = ((window.end - window.start) * 1000 % MS_PER_DAY + MS_PER_DAY) % MS_PER_DAY;
+  int64_t since = ((tod_ms - window.start * 1000) % MS_PER_DAY + MS_PER_DAY) % MS_PER_DAY;
+  if (length == 0 || since >= length)
+    return 0;
+
+  int64_t edge = std::min(since, length - since);
+
+  return std::min<int64_t>(edge * Q16_ONE / (Effects::RAMP_S * 1000), Q16_ONE);
+}
+
+/**
+  @brief  Intensity of lightning at a time. Each second holds a flash with
+          the probability of the configured rate, of up to MAX_STROKES
+          strokes starting at a random point of the second
+
+  @param  config Effects configuration
+  @param  utc_ms UTC time in milliseconds
+  @retval uint32_t - Q16 fraction of the flash intensity. 0 when dark
+*/
+static uint32_t lightning(const Effects::config_t& config, int64_t utc_ms)
+{
+  // Chance of a flash in a second, scaled to the full range of the hash
+  uint64_t threshold = ((uint64_t) config.flashes_per_hour << 32) / 3600;
+
+  // A flash late in the previous second can run into this one
+  int64_t second = utc_ms / 1000;
+  for (int64_t s = second - 1; s <= second; s++)
+  {
+    uint32_t h = hash(config.seed ^ STORM_SALT ^ hash((uint32_t) s));
+    if (h >= threshold)
+      continue;
+
+    uint32_t detail = hash(h);
+    int64_t since = utc_ms - (s * 1000 + detail % 1000);
+    uint32_t strokes = 1 + (detail >> 10) % MAX_STROKES;
+    if (since < 0 || since >= strokes * STROKE_PERIOD_MS || since % STROKE_PERIOD_MS >= STROKE_MS)
+      continue;
+
+    // Strokes vary between half and full brightness
+    return Q16_ONE / 2 + (hash(detail + since / STROKE_PERIOD_MS) >> 17);
+  }
+
+  return 0;
+}
+
+/**
+  @brief  Modulate intensities by the effects at a time. A pure function of
+          its arguments. Clouds reach each channel a little after the one
+          before so they appear to cross the lights
+
+  @param  config Effects configuration
+  @param  utc_ms UTC time in milliseconds
+  @param  utc_offset_s Local time minus UTC in seconds
+  @param  intensities Intensities of all channels, modulated in place
+  @retval bool - A window is open
+*/
+bool Effects::evaluate(const config_t& config, int64_t utc_ms, int32_t utc_offset_s, Intensity::intensity_t* intensities)
+{
+  int64_t tod_ms = ((utc_ms + utc_offset_s * 1000LL) % MS_PER_DAY + MS_PER_DAY) % MS_PER_DAY;
+
+  uint32_t clouds = config.cover > 0 && config.period_s > 0 ? envelope(config.clouds, tod_ms) : 0;
+  uint32_t storm = envelope(config.storm, tod_ms);
+  if (clouds == 0 && storm == 0)
+    return false;
+
+  // Storms darken every channel alike
+  uint32_t base = Q16_ONE - scale(config.darkening, storm);
+  uint32_t flash = storm ? scale(lightning(config, utc_ms), config.flash) : 0;
+
+  // Clouds pass where the noise is above the cover, with soft edges a quarter of the range wide
+  int64_t threshold = (int64_t) Q16_ONE - config.cover;
+  int64_t period_ms = config.period_s * 1000LL;
+  int64_t lag_ms = period_ms / 16;
+
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+  {
+    if ((config.channels & (1 << c)) == 0)
+      continue;
+
+    uint32_t factor = base;
+    if (clouds)
+    {
+      int64_t position = (utc_ms - c * lag_ms) * Q16_ONE / period_ms;
+      int64_t n = (2 * noise(config.seed, position) + noise(config.seed + 1, 2 * position)) / 3;
+      int64_t cloud = std::min<int64_t>(std::max<int64_t>(4 * (n - threshold) + Q16_ONE / 2, 0), Q16_ONE);
+
+      factor = scale(factor, Q16_ONE - scale(scale(config.depth, cloud), clouds));
+    }
+
+    uint32_t intensity = scale(intensities[c], factor);
+    intensities[c] = std::min<uint32_t>(std::max(intensity, flash), Intensity::FULL_SCALE);
+  }
+
+  return true;
+}
+
+/**
+  @brief  Base intensity of each channel along the software fade
+
+  @param  now Current tick
+  @param  intensities Intensities of all channels
+  @retval bool - Fade is still in progress
+*/
+static bool base_at(TickType_t now, Intensity::intensity_t* intensities)
+{
+  TickType_t elapsed = now - effects.fade_start;
+  bool fading = elapsed < effects.fade_ticks;
+
+  std::fill(intensities, intensities + LED_CHANNEL_COUNT, Intensity::OFF);
+
+  for (auto pair : effects.target)
+  {
+    int64_t from = effects.from[pair.first];
+    int64_t to = pair.second;
+    intensities[pair.first] = fading ? from + (to - from) * (int64_t) elapsed / effects.fade_ticks : to;
+  }
+
+  return fading;
+}
+
+/**
+  @brief  Change the period of the tick timer if it differs
+
+  @param  period_ms New period
+  @retval none
+*/
+static void set_period(uint32_t period_ms)
+{
+  if (period_ms == effects.period_ms)
+    return;
+
+  effects.period_ms = period_ms;
+  if (xTimerChangePeriod(effects.timer, pdMS_TO_TICKS(period_ms), pdMS_TO_TICKS(1000)) != pdPASS)
+    ESP_LOGE(TAG, "Failed to change effects timer period.");
+}
+
+/**
+  @brief  Evaluate the effects over the software fade and step the LEDC
+          towards the result. Runs at the tick rate while a window is open
+          or the base is fading, and slows to IDLE_MS otherwise
+
+  @param  latency_ms Time the tick waited for the main loop
+  @retval none
+*/
+static void tick(uint32_t latency_ms)
+{
+  int64_t begin = esp_timer_get_time();
+
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  int64_t utc_ms = now.tv_sec * 1000LL + now.tv_usec / 1000;
+
+  Intensity::intensity_t intensities[LED_CHANNEL_COUNT];
+  bool fading = base_at(xTaskGetTickCount(), intensities);
+  bool open = Effects::evaluate(effects.config, utc_ms, LocalTime::get_offset(now.tv_sec), intensities);
+
+  Schedule::entry_t entry;
+  for (auto pair : effects.target)
+    entry.set(pair.first, intensities[pair.first]);
+
+  uint32_t step_ms = 1000 / Effects::TICK_HZ;
+  bool wrote = LEDC::step_intensities(entry, step_ms) > 0;
+
+  set_period(open || fading ? step_ms : Effects::IDLE_MS);
+
+  uint32_t elapsed_us = esp_timer_get_time() - begin;
+
+  xSemaphoreTake(effects.mutex, portMAX_DELAY);
+  effects.total_us += elapsed_us;
+  effects.stats.ticks++;
+  effects.stats.mean_us = effects.total_us / effects.stats.ticks;
+  effects.stats.max_us = std::max(effects.stats.max_us, elapsed_us);
+  effects.stats.writes += wrote;
+  effects.stats.max_latency_ms = std::max(effects.stats.max_latency_ms, latency_ms);
+  effects.stats.late += latency_ms > step_ms;
+  xSemaphoreGive(effects.mutex);
+}
+
+/**
+  @brief  Load the configuration and take over or hand back the compositor
+          output as effects are enabled or disabled
+
+  @param  none
+  @retval none
+*/
+static void configure()
+{
+  effects.config = NVS::get_effects_config();
+
+  bool windows = effects.config.clouds.start != effects.config.clouds.end || effects.config.storm.start != effects.config.storm.end;
+  bool active = effects.config.channels != 0 && windows;
+  if (active == effects.active)
+    return;
+
+  TickType_t now = xTaskGetTickCount();
+
+  if (active)
+  {
+    ESP_LOGI(TAG, "Effects enabled. Seed: %u, Channels: 0x%02x", effects.config.seed, effects.config.channels);
+
+    // Take over from wherever the compositor left the output
+    effects.target = Compositor::get_output();
+    effects.fade_start = now;
+    effects.fade_ticks = 0;
+    effects.active = true;
+
+    effects.period_ms = 0;
+    set_period(1000 / Effects::TICK_HZ);
+    if (xTimerStart(effects.timer, pdMS_TO_TICKS(1000)) != pdPASS)
+      ESP_LOGE(TAG, "Failed to start effects timer.");
+
+    return;
+  }
+
+  ESP_LOGI(TAG, "Effects disabled.");
+
+  // Hand the output back, finishing the software fade in hardware
+  TickType_t elapsed = now - effects.fade_start;
+  TickType_t remaining = elapsed < effects.fade_ticks ? effects.fade_ticks - elapsed : 0;
+
+  effects.active = false;
+  xTimerStop(effects.timer, pdMS_TO_TICKS(1000));
+
+  LEDC::set_intensities(effects.target, std::max<uint32_t>(remaining * 1000 / configTICK_RATE_HZ, 1000));
+}
+
+/**
+  @brief  Create the tick timer and apply the saved configuration
+
+  @param  none
+  @retval none
+*/
+void Effects::init()
+{
+  effects.mutex = xSemaphoreCreateMutex();
+
+  effects.timer = xTimerCreate("EffectsTimer", pdMS_TO_TICKS(1000 / TICK_HZ), true, nullptr,
+    [](TimerHandle_t /* t */) {
+      // Measure from the first signal if the main loop falls behind
+      if (!effects.pending)
+      {
+        effects.signaled = xTaskGetTickCount();
+        effects.pending = true;
+      }
+
+      signal_event(MAIN_EVENT_EFFECTS_TICK);
+    });
+
+  if (effects.timer == NULL)
+  {
+    ESP_LOGE(TAG, "Failed to create effects timer.");
+    return;
+  }
+
+  configure();
+}
+
+/**
+  @brief  Handle the main loop events of the effects
+
+  @param  events Main loop events
+  @retval none
+*/
+void Effects::handle_events(uint32_t events)
+{
+  if (events & MAIN_EVENT_CONFIG_UPDATE)
+    configure();
+
+  if (!(events & MAIN_EVENT_EFFECTS_TICK))
+    return;
+
+  // The tick shares the main loop, so record how long it waited there
+  uint32_t latency_ms = 0;
+  if (effects.pending)
+  {
+    latency_ms = (xTaskGetTickCount() - effects.signaled) * 1000 / configTICK_RATE_HZ;
+    effects.pending = false;
+  }
+
+  if (effects.active)
+    tick(latency_ms);
+}
+
+/**
+  @brief  Check if the effects own the compositor output
+
+  @param  none
+  @retval bool
+*/
+bool Effects::running()
+{
+  return effects.active;
+}
+
+/**
+  @brief  Take a new compositor output to fade to in software while effects
+          are running. Called from the main loop
+
+  @param  state Intensities the compositor produced
+  @param  fade_ms Fade time of the change
+  @retval bool - Base changed
+*/
+bool Effects::set_base(const Schedule::entry_t& state, uint32_t fade_ms)
+{
+  // An unchanged base keeps its fade going
+  if (!effects.active || state == effects.target)
+    return false;
+
+  // Restart the fade from the present base
+  TickType_t now = xTaskGetTickCount();
+  Intensity::intensity_t present[LED_CHANNEL_COUNT];
+  base_at(now, present);
+
+  for (auto pair : state)
+    effects.from[pair.first] = effects.target.contains(pair.first) ? present[pair.first] : pair.second;
+
+  effects.target = state;
+  effects.fade_start = now;
+  effects.fade_ticks = pdMS_TO_TICKS(fade_ms);
+
+  tick(0);
+  return true;
+}
+
+/**
+  @brief  Get the tick statistics. Safe to call from other tasks
+
+  @param  none
+  @retval Effects::stats_t
+*/
+Effects::stats_t Effects::get_stats()
+{
+  xSemaphoreTake(effects.mutex, portMAX_DELAY);
+  stats_t stats = effects.stats;
+  stats.rate_Hz = effects.active && effects.period_ms != 0 ? 1000 / effects.period_ms : 0;
+  xSemaphoreGive(effects.mutex);
+
+  return stats;
+}
\ No newline at end of file
@@ -0,0 +1,84 @@
+#ifndef __EFFECTS_H__
+#define __EFFECTS_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "main.h"
+#include "schedule.h"
+#include "intensity.h"
+
+/**
+  @brief  Procedural clouds and storms modulating the channels during
+          windows of the day. The effect at a moment is a pure function of
+          the seed and the UTC time, so runs are reproducible. While an
+          effect is configured it takes over the compositor output and fades
+          it in software beneath the modulation, stepping the LEDC at the
+          tick rate
+*/
+namespace Effects
+{
+  // Main loop events handled by the effects
+  constexpr uint32_t EVENTS = MAIN_EVENT_CONFIG_UPDATE | MAIN_EVENT_EFFECTS_TICK;
+
+  typedef struct
+  {
+    Schedule::time_of_day_t start; // Local time the window opens
+    Schedule::time_of_day_t end;   // Local time the window closes. Equal to start for never
+  } window_t;
+
+  typedef struct
+  {
+    uint32_t seed;
+    uint32_t channels;                // Bit mask of the modulated channels
+    window_t clouds;
+    Intensity::intensity_t cover;     // Fraction of the time a cloud is overhead
+    Intensity::intensity_t depth;     // Fraction a cloud dims the channels by
+    uint32_t period_s;                // Typical time a cloud takes to pass
+    window_t storm;
+    Intensity::intensity_t darkening; // Fraction the storm dims the channels by
+    uint32_t flashes_per_hour;        // Mean rate of lightning strikes
+    Intensity::intensity_t flash;     // Intensity of a lightning flash
+  } config_t;
+
+  typedef struct
+  {
+    uint32_t rate_Hz;        // Current tick rate. Drops to idle between windows, zero while disabled
+    uint32_t ticks;
+    uint32_t mean_us;        // Mean CPU time of a tick, LEDC writes included
+    uint32_t max_us;
+    uint32_t writes;         // Ticks which changed a duty
+    uint32_t max_latency_ms; // Longest a tick waited behind other work of the main loop
+    uint32_t late;           // Ticks which waited longer than the tick period
+  } stats_t;
+
+  constexpr uint32_t TICK_HZ = CONFIG_EFFECTS_TICK_HZ;
+  constexpr uint32_t IDLE_MS = 1000; // Tick period while no window is open
+  constexpr uint32_t RAMP_S = 60;    // Time the effects take to fade in and out at the window edges
+
+  // No channels or windows, with moderate clouds and storms once they are set
+  constexpr config_t DEFAULT_CONFIG = {
+    .seed = 0,
+    .channels = 0,
+    .clouds = {0, 0},
+    .cover = Intensity::from_percent(50),
+    .depth = Intensity::from_percent(60),
+    .period_s = 120,
+    .storm = {0, 0},
+    .darkening = Intensity::from_percent(70),
+    .flashes_per_hour = 60,
+    .flash = Intensity::FULL_SCALE,
+  };
+
+  void init(void);
+  void handle_events(uint32_t events);
+
+  bool running(void);
+  bool set_base(const Schedule::entry_t& state, uint32_t fade_ms);
+
+  bool evaluate(const config_t& config, int64_t utc_ms, int32_t utc_offset_s, Intensity::intensity_t* intensities);
+
+  stats_t get_stats(void);
+}
+
+#endif
\ No newline at end of file
@@ -1,5 +1,9 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "lwip/sockets.h"
 
 #include <string>
 #include <vector>
@@ -10,9 +14,24 @@
 #include "mongoose.h"
 #include "json.h"
 #include "ota_interface.h"
+#include "ota_pull.h"
+#include "scheduler.h"
+#include "compositor.h"
+#include "ledc_interface.h"
 
 #define TAG "HTTP"
 
+static struct
+{
+  SemaphoreHandle_t mutex;            // Guards task, manager and messages
+  TaskHandle_t task;
+  struct mg_mgr* manager;
+  std::queue<HTTP::message_t> messages;
+  std::unordered_set<mg_connection*> ws_clients;
+  OTA::ResumableHandle* upload;       // Resumable upload. Kept after a disconnect
+  struct mg_connection* upload_owner; // Connection feeding the upload, nullptr if interrupted
+} http;
+
 /**
   @brief  Sends HTTP responses on the provided connection
   
@@ -28,6 +47,83 @@ static void httpSendResponse(struct mg_connection* nc, uint16_t code, const char
   nc->flags |= MG_F_SEND_AND_CLOSE;
 }
 
+/**
+  @brief  Send the current system status to all connected websocket clients
+  
+  @param  none
+  @retval none
+*/
+static void sendStatus()
+{
+  std::string status = JSON::get_status();
+
+  for (const auto &c : http.ws_clients)
+  {
+    if ((c->flags & MG_F_IS_WEBSOCKET) && (c->send_mbuf.len == 0))   
+      mg_send_websocket_frame(c, WEBSOCKET_OP_TEXT, status.c_str(), status.length());
+  }
+}
+
+/**
+  @brief  Format the channel usage totals in the Prometheus text format
+  
+  @param  none
+  @retval std::string
+*/
+static std::string get_metrics()
+{
+  std::array<channel_usage_t, LED_CHANNEL_COUNT> usage = LEDC::get_usage();
+
+  std::string metrics;
+  char line[96];
+
+  metrics += "# HELP esp_pwm_channel_energy_wh Estimated energy used by the channel.\n";
+  metrics += "# TYPE esp_pwm_channel_energy_wh counter\n";
+  for (size_t c = 0; c < usage.size(); c++)
+  {
+    snprintf(line, sizeof(line), "esp_pwm_channel_energy_wh{channel=\"%d\"} %.4f\n", (int) c, usage[c].energy_uJ / 3.6e9);
+    metrics += line;
+  }
+
+  metrics += "# HELP esp_pwm_channel_on_hours Time the channel spent at a non-zero duty.\n";
+  metrics += "# TYPE esp_pwm_channel_on_hours counter\n";
+  for (size_t c = 0; c < usage.size(); c++)
+  {
+    snprintf(line, sizeof(line), "esp_pwm_channel_on_hours{channel=\"%d\"} %.4f\n", (int) c, usage[c].on_ms / 3.6e6);
+    metrics += line;
+  }
+
+  return metrics;
+}
+
+/**
+  @brief  Run the messages posted from other tasks. The mutex is released 
+          while each message runs so it may post again
+  
+  @param  none
+  @retval none
+*/
+static void runMessages()
+{
+  while (true)
+  {
+    HTTP::message_t message;
+
+    xSemaphoreTake(http.mutex, portMAX_DELAY);
+    if (!http.messages.empty())
+    {
+      message = std::move(http.messages.front());
+      http.messages.pop();
+    }
+    xSemaphoreGive(http.mutex);
+
+    if (!message)
+      return;
+
+    message();
+  }
+}
+
 /**
   @brief  Generic Mongoose event handler for the HTTP server
   
@@ -38,7 +134,6 @@ static void httpSendResponse(struct mg_connection* nc, uint16_t code, const char
 */
 static void httpEventHandler(struct mg_connection* nc, int ev, void* ev_data)
 {
-  static std::unordered_set<mg_connection*> ws_clients;
   constexpr double ws_interval = .5f; // 500 ms
 
   switch(ev)
@@ -47,7 +142,7 @@ static void httpEventHandler(struct mg_connection* nc, int ev, void* ev_data)
     {
       struct http_message *hm = (struct http_message *) ev_data;
       
-      char action[4];
+      char action[8];
       if (mg_get_http_var(&hm->query_string, "action", action, sizeof(action)) == -1)
       {
         struct mg_serve_http_opts opts;
@@ -86,6 +181,63 @@ static void httpEventHandler(struct mg_connection* nc, int ev, void* ev_data)
 
         httpSendResponse(nc, return_code, error_string);
       }
+      else if (strcmp(action, "edit") == 0) // Edit individual schedule entries
+      {
+        std::string buffer(hm->body.p, hm->body.p + hm->body.len);
+
+        ESP_LOGI(TAG, "Edit = %s", buffer.c_str());
+
+        Scheduler::edit_t edit;
+        bool success = JSON::parse_schedule_edit(buffer, edit);
+        if (success)
+          Scheduler::post_edit(edit);
+
+        httpSendResponse(nc, success ? 200 : 400, success ? "Update successful." : "Invalid schedule edit.");
+      }
+      else if (strcmp(action, "layer") == 0) // Add or remove an override layer
+      {
+        std::string buffer(hm->body.p, hm->body.p + hm->body.len);
+
+        ESP_LOGI(TAG, "Layer = %s", buffer.c_str());
+
+        Compositor::layer_t layer;
+        bool remove = false;
+        if (!JSON::parse_layer(buffer, layer, remove))
+          httpSendResponse(nc, 400, "Invalid layer.");
+        else if (remove)
+        {
+          bool found = Compositor::remove_layer(layer.name);
+          httpSendResponse(nc, found ? 200 : 404, found ? "Layer removed." : "Layer not found.");
+        }
+        else
+        {
+          bool success = Compositor::set_layer(layer);
+          httpSendResponse(nc, success ? 200 : 409, success ? "Layer set." : "Too many layers.");
+        }
+      }
+      else if (strcmp(action, "metrics") == 0) // Usage totals for scrapers
+      {
+        std::string metrics = get_metrics();
+
+        mg_send_head(nc, 200, metrics.length(), "Content-Type: text/plain; version=0.0.4");
+        mg_send(nc, metrics.c_str(), metrics.length());
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+      }
+      else if (strcmp(action, "pull") == 0) // Pull OTA images from a server
+      {
+        std::string buffer(hm->body.p, hm->body.p + hm->body.len);
+
+        ESP_LOGI(TAG, "Pull = %s", buffer.c_str());
+
+        esp_err_t result = OTA::pull(buffer);
+
+        if (result == ESP_OK)
+          httpSendResponse(nc, 202, "Update started.");
+        else if (result == ESP_ERR_INVALID_STATE)
+          httpSendResponse(nc, 409, "Update already in progress.");
+        else
+          httpSendResponse(nc, 400, "Invalid pull request.");
+      }
       else
       {
         mg_http_send_redirect(nc, 302, hm->uri, mg_mk_str(NULL));
@@ -100,10 +252,10 @@ static void httpEventHandler(struct mg_connection* nc, int ev, void* ev_data)
       mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
       ESP_LOGI(TAG, "Websocket connect from %s", addr);
 
-      if (ws_clients.empty())
+      if (http.ws_clients.empty())
         mg_set_timer(nc, mg_time() + ws_interval);
       
-      ws_clients.insert(nc);
+      http.ws_clients.insert(nc);
 
       break;
     }
@@ -116,12 +268,12 @@ static void httpEventHandler(struct mg_connection* nc, int ev, void* ev_data)
         mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
         ESP_LOGI(TAG, "Websocket disconnect from %s", addr);
 
-        ws_clients.erase(nc);
+        http.ws_clients.erase(nc);
 
-        if (!ws_clients.empty() && nc->ev_timer_time != 0)
+        if (!http.ws_clients.empty() && nc->ev_timer_time != 0)
         {
           // Move the event timer to another connection if this connection was handling interval timing
-          mg_set_timer(*ws_clients.begin(), nc->ev_timer_time);
+          mg_set_timer(*http.ws_clients.begin(), nc->ev_timer_time);
         }
       }
       break;
@@ -133,14 +285,7 @@ static void httpEventHandler(struct mg_connection* nc, int ev, void* ev_data)
       double event_time = *((double*) ev_data);
       mg_set_timer(nc, event_time + ws_interval);
 
-      std::string status = JSON::get_status();
-
-      for (const auto &c : ws_clients)
-      {
-        if ((c->flags & MG_F_IS_WEBSOCKET) && (c->send_mbuf.len == 0))   
-          mg_send_websocket_frame(c, WEBSOCKET_OP_TEXT, status.c_str(), status.length());
-      }
-
+      sendStatus();
       break;
     }
 
@@ -149,6 +294,11 @@ static void httpEventHandler(struct mg_connection* nc, int ev, void* ev_data)
   }
 }
 
+static constexpr uint32_t MG_F_OTA_FAILED = MG_F_USER_1;
+static constexpr uint32_t MG_F_OTA_COMPLETE = MG_F_USER_2;
+static constexpr uint32_t MG_F_OTA_WRITING = MG_F_USER_3; // Connection is feeding an OTA handle
+static constexpr uint32_t MG_F_OTA_DETACHED = MG_F_USER_4; // Upload was taken over by another connection
+
 /**
   @brief  Mongoose event handler for the OTA firmware update
   
@@ -159,16 +309,38 @@ static void httpEventHandler(struct mg_connection* nc, int ev, void* ev_data)
 */
 static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data)
 {
-  constexpr uint32_t MG_F_OTA_FAILED = MG_F_USER_1;
-  constexpr uint32_t MG_F_OTA_COMPLETE = MG_F_USER_2;
+  constexpr size_t MAX_FIELD_LENGTH = 128;
 
   static std::queue<OTA::end_callback_t> callbacks;
   static std::string response;
+  static OTA::options_t options;
+  static std::string field; // Name of the form field being received
 
   switch(ev)
   {
     case MG_EV_HTTP_REQUEST:
     {
+      struct http_message *hm = (struct http_message *) ev_data;
+
+      // Report the offset an interrupted upload may be resumed from
+      char target[32];
+      char id[80] = {0};
+      if (mg_get_http_var(&hm->query_string, "target", target, sizeof(target)) > 0)
+      {
+        mg_get_http_var(&hm->query_string, "id", id, sizeof(id));
+
+        size_t offset = 0;
+        if (http.upload != nullptr && http.upload->matches(target, id) && !OTA::timed_out())
+          offset = http.upload->committed();
+
+        std::string resume = "{\"offset\":" + std::to_string(offset) + "}";
+
+        mg_send_head(nc, 200, resume.length(), "Content-Type: application/json");
+        mg_send(nc, resume.c_str(), resume.length());
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+        break;
+      }
+
       // Serve the page from the SPIFFS
       mg_http_serve_file(nc, (struct http_message *) ev_data, "/spiffs/ota.html", mg_mk_str("text/html"), mg_mk_str(""));
       break;
@@ -176,8 +348,10 @@ static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data)
 
     case MG_EV_HTTP_MULTIPART_REQUEST:
     {
-      // Reset response string
+      // Reset response string and form fields
       response.clear();
+      options.clear();
+      field.clear();
       break;
     }
 
@@ -186,6 +360,15 @@ static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data)
       struct mg_http_multipart_part* multipart = (struct mg_http_multipart_part*) ev_data;
 
       //ESP_LOGI(TAG, "Filename %s, Varname %s", multipart->file_name, multipart->var_name);
+
+      // Parts without a file are form fields which apply to the following files
+      if (multipart->file_name == nullptr || multipart->file_name[0] == '\0')
+      {
+        field = std::string(multipart->var_name);
+        options[field].clear();
+        return;
+      }
+
       if (multipart->user_data != nullptr)
       {
         ESP_LOGE(TAG, "Non-null OTA handle. OTA already in progress?");
@@ -196,9 +379,52 @@ static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data)
         return;
       }
 
-      // Construct an OTA object based on the incoming file "target"
+      // Images with an identity may be resumed after a disconnect
       std::string ota_target = std::string(multipart->var_name);
-      OTA::Handle* ota = OTA::construct_handle(ota_target);
+      std::string base = ota_target.substr(0, ota_target.find('.'));
+      std::string id = options[base + "_id"];
+      size_t offset = strtoul(options[base + "_offset"].c_str(), nullptr, 10);
+
+      if (offset != 0)
+      {
+        OTA::ResumableHandle* upload = http.upload;
+        if (upload == nullptr || !upload->matches(ota_target, id) || !upload->resume(offset))
+        {
+          ESP_LOGE(TAG, "No %s OTA to resume at offset %u.", ota_target.c_str(), offset);
+
+          // Mark OTA as failed and append reason
+          response += "OTA resume failed.";
+          nc->flags |= MG_F_OTA_FAILED;
+          return;
+        }
+
+        // Take over from the previous connection in case it hasn't closed yet
+        if (http.upload_owner != nullptr)
+          http.upload_owner->flags |= MG_F_OTA_DETACHED;
+
+        ESP_LOGI(TAG, "Resuming %s OTA at offset %u...", ota_target.c_str(), offset);
+        http.upload_owner = nc;
+        multipart->user_data = (void*) upload;
+        nc->flags |= MG_F_OTA_WRITING;
+        break;
+      }
+
+      // A new upload abandons any interrupted one
+      if (http.upload != nullptr)
+      {
+        ESP_LOGW(TAG, "Abandoning interrupted OTA at offset %u.", http.upload->committed());
+
+        if (http.upload_owner != nullptr)
+          http.upload_owner->flags |= MG_F_OTA_DETACHED;
+
+        http.upload->cleanup();
+        delete http.upload;
+        http.upload = nullptr;
+        http.upload_owner = nullptr;
+      }
+
+      // Construct an OTA object based on the incoming file "target"
+      OTA::Handle* ota = OTA::construct_handle(ota_target, options);
       if (ota == nullptr)
       {
         ESP_LOGE(TAG, "Failed to construct OTA handle for target '%s'.", ota_target.c_str());
@@ -225,8 +451,17 @@ static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data)
         return;
       }
 
+      if (!id.empty())
+      {
+        OTA::ResumableHandle* upload = new OTA::ResumableHandle(ota, ota_target, id);
+        http.upload = upload;
+        http.upload_owner = nc;
+        ota = upload;
+      }
+
       // Save the handle for reference in future calls
       multipart->user_data = (void*) ota;
+      nc->flags |= MG_F_OTA_WRITING;
       break;
     }
 
@@ -234,8 +469,17 @@ static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data)
     {
       struct mg_http_multipart_part* multipart = (struct mg_http_multipart_part*) ev_data;
 
-      // Something went wrong so ignore the data
-      if (nc->flags & MG_F_OTA_FAILED)
+      // Accumulate form field values. Only short values like hashes are expected
+      if (!field.empty())
+      {
+        std::string& value = options[field];
+        if (value.length() + multipart->data.len <= MAX_FIELD_LENGTH)
+          value.append(multipart->data.p, multipart->data.len);
+        return;
+      }
+
+      // Something went wrong or another connection resumed the upload so ignore the data
+      if (nc->flags & (MG_F_OTA_FAILED | MG_F_OTA_DETACHED))
         return;
 
       // Fetch handle from user_data
@@ -255,12 +499,30 @@ static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data)
     case MG_EV_HTTP_PART_END:
     {
       struct mg_http_multipart_part* multipart = (struct mg_http_multipart_part*) ev_data;
+
+      // End of a form field
+      if (!field.empty())
+      {
+        field.clear();
+        return;
+      }
+
+      nc->flags &= ~MG_F_OTA_WRITING;
       
       // Fetch handle from user_data
       OTA::Handle* ota = (OTA::Handle*) multipart->user_data;
-      if (ota == nullptr)
+      if (ota == nullptr || (nc->flags & MG_F_OTA_DETACHED))
         return;
 
+      // Keep an interrupted resumable upload for a later request
+      if (multipart->status < 0 && ota == http.upload && !(nc->flags & MG_F_OTA_FAILED))
+      {
+        ESP_LOGW(TAG, "OTA interrupted at offset %u. Waiting for resume...", http.upload->committed());
+        http.upload_owner = nullptr;
+        multipart->user_data = nullptr;
+        break;
+      }
+
       // Even if MG_F_OTA_FAILED is set we should let the OTA try to clean up
 
       ESP_LOGI(TAG, "Ending OTA...");
@@ -277,6 +539,12 @@ static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data)
       }
 
       // Free the handle object and reference
+      if (ota == http.upload)
+      {
+        http.upload = nullptr;
+        http.upload_owner = nullptr;
+      }
+
       delete ota;
       multipart->user_data = nullptr;
       break;
@@ -299,6 +567,10 @@ static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data)
 
     case MG_EV_CLOSE:
     {
+      // Interrupted uploads are no longer fed by this connection
+      if (nc == http.upload_owner)
+        http.upload_owner = nullptr;
+
       // Ignore close events that aren't after an OTA
       if ((nc->flags & MG_F_OTA_COMPLETE) != MG_F_OTA_COMPLETE)
        return;
@@ -318,6 +590,37 @@ static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data)
   }
 }
 
+/**
+  @brief  Fail an update the OTA timeout has stalled. Connections still 
+          feeding it are closed, which ends their part and cleans up the 
+          handle on this task. An interrupted upload is dropped so it is no
+          longer offered for resume
+  
+  @param  manager Mongoose event manager
+  @retval none
+*/
+static void expireUploads(struct mg_mgr* manager)
+{
+  if (!OTA::timed_out())
+    return;
+
+  // Nothing else would end an interrupted upload, so its handle goes here
+  if (http.upload != nullptr && http.upload_owner == nullptr)
+  {
+    ESP_LOGW(TAG, "Interrupted OTA timed out at offset %u.", http.upload->committed());
+
+    http.upload->cleanup();
+    delete http.upload;
+    http.upload = nullptr;
+  }
+
+  for (struct mg_connection* c = mg_next(manager, nullptr); c != nullptr; c = mg_next(manager, c))
+  {
+    if (c->flags & MG_F_OTA_WRITING)
+      c->flags |= MG_F_OTA_FAILED | MG_F_CLOSE_IMMEDIATELY;
+  }
+}
+
 /**
   @brief  Main task function of the HTTP server
   
@@ -348,12 +651,95 @@ void HTTP::task(void* pvParameters)
   // Special handler for OTA page
   mg_register_http_endpoint(connection, "/ota", otaEventHandler);
 
-  // Loop waiting for events
+  // Publish the manager so other tasks can post messages
+  xSemaphoreTake(http.mutex, portMAX_DELAY);
+  http.task = xTaskGetCurrentTaskHandle();
+  http.manager = &manager;
+  xSemaphoreGive(http.mutex);
+
+  // Loop waiting for events. Posted messages and mongoose timers wake the poll
+  // early so the timeout is only an idle sleep. Messages whose wake up was lost
+  // run after the next poll. Stalled updates are cleaned up within a poll of 
+  // their timeout
   while(1)
-    mg_mgr_poll(&manager, 1000);
+  {
+    mg_mgr_poll(&manager, IDLE_POLL_MS);
+    runMessages();
+    expireUploads(&manager);
+  }
 
-  // Free the manager if we ever exit
+  // Stop accepting messages and free the manager if we ever exit
+  xSemaphoreTake(http.mutex, portMAX_DELAY);
+  http.manager = nullptr;
+  http.messages = {};
+  xSemaphoreGive(http.mutex);
   mg_mgr_free(&manager);
 
   vTaskDelete(NULL);
+}
+
+/**
+  @brief  Create the mutex guarding the HTTP task's state. Must be called 
+          before the HTTP task is started
+  
+  @param  none
+  @retval none
+*/
+void HTTP::init()
+{
+  http.mutex = xSemaphoreCreateMutex();
+  if (http.mutex == NULL)
+    ESP_LOGE(TAG, "Failed to create HTTP mutex.");
+}
+
+/**
+  @brief  Post a message to be executed by the HTTP task. Wakes the HTTP task
+          immediately without waiting for it. Messages posted before the HTTP 
+          task has started are dropped.
+  
+  @param  message Function to execute on the HTTP task
+  @retval none
+*/
+void HTTP::post(const message_t& message)
+{
+  if (!message || http.mutex == NULL)
+    return;
+
+  xSemaphoreTake(http.mutex, portMAX_DELAY);
+  struct mg_mgr* manager = http.manager;
+  bool local = xTaskGetCurrentTaskHandle() == http.task;
+  if (manager != nullptr && !local)
+  {
+    http.messages.push(message);
+
+    // mg_broadcast would wait for the poll to acknowledge. Instead send a wake
+    // byte too short to carry a callback, and discard the acknowledgements of
+    // earlier wake ups. The poll runs the queued messages after waking. A wake
+    // up dropped on a full socket only delays the message until the next poll
+    uint8_t wake = 0;
+    while (recv(manager->ctl[0], &wake, sizeof(wake), MSG_DONTWAIT) > 0);
+    send(manager->ctl[0], &wake, sizeof(wake), MSG_DONTWAIT);
+  }
+  xSemaphoreGive(http.mutex);
+
+  // Already on the HTTP task, run it in place
+  if (local)
+  {
+    message();
+    return;
+  }
+
+  if (manager == nullptr)
+    ESP_LOGW(TAG, "HTTP task not running. Dropping message.");
+}
+
+/**
+  @brief  Push the current system status to all websocket clients immediately
+  
+  @param  none
+  @retval none
+*/
+void HTTP::push_status()
+{
+  post(sendStatus);
 }
\ No newline at end of file
@@ -1,9 +1,19 @@
 #ifndef __HTTP_H__
 #define __HTTP_H__
 
+#include <functional>
+
 namespace HTTP
 {
+  typedef std::function<void(void)> message_t;
+
+  constexpr int IDLE_POLL_MS = 10000;
+
+  void init(void);
   void task(void* pvParameters);
+
+  void post(const message_t& message);
+  void push_status(void);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,51 @@
+#ifndef __INTENSITY_H__
+#define __INTENSITY_H__
+
+#include <stdint.h>
+
+/**
+  @brief  LED intensity as a 16 bit fixed point fraction of full scale. Used 
+          from JSON parse through the schedule to LEDC duty so the hot path 
+          needs no float or double math
+*/
+namespace Intensity
+{
+  typedef uint16_t intensity_t;
+
+  constexpr intensity_t OFF = 0;
+  constexpr intensity_t FULL_SCALE = UINT16_MAX;
+
+  /**
+    @brief  Convert a whole percentage, clamped to 0 - 100, rounding to nearest. 
+            to_percent recovers it exactly
+  */
+  constexpr intensity_t from_percent(int32_t percent)
+  {
+    return percent <= 0 ? OFF : percent >= 100 ? FULL_SCALE : (intensity_t) ((percent * (uint32_t) FULL_SCALE + 50) / 100);
+  }
+
+  /**
+    @brief  Convert a fractional percentage. Only needed for values the web 
+            interface doesn't produce
+  */
+  constexpr intensity_t from_percent(double percent)
+  {
+    return percent <= 0 ? OFF : percent >= 100 ? FULL_SCALE : (intensity_t) (percent * FULL_SCALE / 100 + 0.5);
+  }
+
+  constexpr uint32_t to_percent(intensity_t intensity)
+  {
+    return (intensity * 100u + FULL_SCALE / 2) / FULL_SCALE;
+  }
+
+  /**
+    @brief  Scale to a duty cycle. Truncates like the previous floating point 
+            conversion so duties are unchanged
+  */
+  constexpr uint32_t to_duty(intensity_t intensity, uint32_t max_duty)
+  {
+    return ((uint64_t) intensity * max_duty) / FULL_SCALE;
+  }
+}
+
+#endif
\ No newline at end of file
@@ -1,9 +1,20 @@
 #include "esp_log.h"
 
+#include <algorithm>
+#include <cctype>
+
 #include "json.h"
 #include "schedule.h"
 #include "nvs_interface.h"
 #include "main.h"
+#include "ota_pull.h"
+#include "local_time.h"
+#include "clock.h"
+#include "compositor.h"
+#include "ledc_interface.h"
+#include "solar.h"
+#include "lunar.h"
+#include "effects.h"
 #include "nlohmann/json.hpp"
 
 #define TAG "JSON"
@@ -55,12 +66,142 @@ static void parse_channel_json(const nlohmann::json& channels)
     config.enabled = channel["enabled"].get<bool>();
     config.timer = JSON::get_or_default<ledc_timer_t>(channel, "timer", LEDC_TIMER_MAX);
     config.gpio = JSON::get_or_default<gpio_num_t>(channel, "gpio", GPIO_NUM_NC);
+    config.watts = JSON::get_or_default<float>(channel, "watts", 0);
     std::string name = JSON::get_or_default<std::string>(channel, "name");
 
     NVS::save_channel_config(name, config);
   }
 }
 
+/**
+  @brief  Parse the provided JSON object for the power budget
+  
+  @param  power JSON object for power
+  @retval none
+*/
+static void parse_power_json(const nlohmann::json& power)
+{
+  ESP_LOGD(TAG, "Power: %s", power.dump().c_str());
+
+  NVS::save_power_budget(JSON::get_or_default<float>(power, "budget", 0));
+}
+
+/**
+  @brief  Parse the provided JSON object for the location of the solar 
+          schedule. A location is required for keys relative to the sun
+  
+  @param  solar JSON object for solar
+  @retval none
+*/
+static void parse_solar_json(const nlohmann::json& solar)
+{
+  ESP_LOGD(TAG, "Solar: %s", solar.dump().c_str());
+
+  Solar::config_t config;
+  config.enabled = solar.contains("latitude") && solar["latitude"].is_number() && 
+                   solar.contains("longitude") && solar["longitude"].is_number();
+  config.latitude = config.enabled ? std::min(std::max(solar["latitude"].get<float>(), -90.0f), 90.0f) : 0;
+  config.longitude = config.enabled ? std::min(std::max(solar["longitude"].get<float>(), -180.0f), 180.0f) : 0;
+  config.channel = JSON::get_or_default<int32_t>(solar, "channel", -1);
+  config.intensity = Intensity::from_percent(JSON::get_or_default<double>(solar, "intensity", 100));
+
+  NVS::save_solar_config(config);
+
+  // Solar keys resolve differently at a new location
+  signal_event(MAIN_EVENT_SCHEDULE_UPDATE);
+}
+
+static const char* moon_blends[] = {"max", "add"};
+
+/**
+  @brief  Parse the provided JSON object for the moonlight channel
+  
+  @param  moon JSON object for moon
+  @retval none
+*/
+static void parse_moon_json(const nlohmann::json& moon)
+{
+  ESP_LOGD(TAG, "Moon: %s", moon.dump().c_str());
+
+  Lunar::config_t config;
+  config.channel = JSON::get_or_default<int32_t>(moon, "channel", -1);
+  config.intensity = Intensity::from_percent(JSON::get_or_default<double>(moon, "intensity", 10));
+  config.blend = JSON::get_or_default<std::string>(moon, "blend") == moon_blends[Lunar::BLEND_ADD] ? Lunar::BLEND_ADD : Lunar::BLEND_MAX;
+
+  NVS::save_moon_config(config);
+
+  signal_event(MAIN_EVENT_SCHEDULE_UPDATE);
+}
+
+/**
+  @brief  Parse a window of the day from HH:MM start and end times. Missing 
+          or invalid times close the window
+  
+  @param  window JSON object for the window
+  @retval Effects::window_t
+*/
+static Effects::window_t parse_window_json(const nlohmann::json& window)
+{
+  Effects::window_t result = {0, 0};
+
+  struct tm start = {};
+  struct tm end = {};
+  std::string start_str = JSON::get_or_default<std::string>(window, "start");
+  std::string end_str = JSON::get_or_default<std::string>(window, "end");
+  if (strptime(start_str.c_str(), "%H:%M", &start) == nullptr || strptime(end_str.c_str(), "%H:%M", &end) == nullptr)
+    return result;
+
+  result.start = start.tm_hour * 3600 + start.tm_min * 60;
+  result.end = end.tm_hour * 3600 + end.tm_min * 60;
+  return result;
+}
+
+/**
+  @brief  Parse the provided JSON object for the cloud and storm effects
+  
+  @param  effects JSON object for effects
+  @retval none
+*/
+static void parse_effects_json(const nlohmann::json& effects)
+{
+  ESP_LOGD(TAG, "Effects: %s", effects.dump().c_str());
+
+  Effects::config_t config = Effects::DEFAULT_CONFIG;
+  config.seed = JSON::get_or_default<uint32_t>(effects, "seed", 0);
+
+  config.channels = 0;
+  if (effects.contains("channels"))
+  {
+    for (auto& channel : effects.at("channels"))
+    {
+      if (channel.is_number_integer() && channel.get<int32_t>() >= 0 && (size_t) channel.get<int32_t>() < LED_CHANNEL_COUNT)
+        config.channels |= 1 << channel.get<int32_t>();
+    }
+  }
+
+  if (effects.contains("clouds"))
+  {
+    const nlohmann::json& clouds = effects.at("clouds");
+    config.clouds = parse_window_json(clouds);
+    config.cover = Intensity::from_percent(JSON::get_or_default<double>(clouds, "cover", 50));
+    config.depth = Intensity::from_percent(JSON::get_or_default<double>(clouds, "depth", 60));
+    config.period_s = std::max(JSON::get_or_default<int32_t>(clouds, "period", 120), 1);
+  }
+
+  if (effects.contains("storm"))
+  {
+    const nlohmann::json& storm = effects.at("storm");
+    config.storm = parse_window_json(storm);
+    config.darkening = Intensity::from_percent(JSON::get_or_default<double>(storm, "darkening", 70));
+    config.flashes_per_hour = std::max(JSON::get_or_default<int32_t>(storm, "flashes", 60), 0);
+    config.flash = Intensity::from_percent(JSON::get_or_default<double>(storm, "flash", 100));
+  }
+
+  NVS::save_effects_config(config);
+
+  signal_event(MAIN_EVENT_CONFIG_UPDATE);
+}
+
 /**
   @brief  Parse the provided JSON object for schedule data
   
@@ -135,10 +276,23 @@ bool JSON::parse_settings(const std::string& jString)
   if (root.contains("channels"))
     parse_channel_json(root.at("channels"));
 
-  // If timers or channels object was present we want to notify of config change
-  if (root.contains("timers") || root.contains("channels"))
+  // Parse power object
+  if (root.contains("power"))
+    parse_power_json(root.at("power"));
+
+  // If timers, channels or power object was present we want to notify of config change
+  if (root.contains("timers") || root.contains("channels") || root.contains("power"))
     signal_event(MAIN_EVENT_CONFIG_UPDATE);
 
+  if (root.contains("solar"))
+    parse_solar_json(root.at("solar"));
+
+  if (root.contains("moon"))
+    parse_moon_json(root.at("moon"));
+
+  if (root.contains("effects"))
+    parse_effects_json(root.at("effects"));
+
   // Parse schedule object
   if (root.contains("schedule"))
     parse_schedule_json(root.at("schedule"));
@@ -182,7 +336,7 @@ static nlohmann::json get_channel_json()
 {
   // Create & populate channel object
   nlohmann::json channels = nlohmann::json::object();
-  for (uint8_t i = 0; i < LEDC_CHANNEL_MAX; i++)
+  for (uint8_t i = 0; i < LED_CHANNEL_COUNT; i++)
   {
     auto data = NVS::get_channel_config(i);
 
@@ -193,6 +347,7 @@ static nlohmann::json get_channel_json()
     channel["id"] = config.id;
     channel["enabled"] = config.enabled;
     channel["timer"] = config.timer;
+    channel["watts"] = config.watts;
     
     // Special handling for GPIO and name
     JSON::set_if_valid<gpio_num_t>(channel, "gpio", config.gpio, [](gpio_num_t g) { return g != GPIO_NUM_NC; });
@@ -202,6 +357,170 @@ static nlohmann::json get_channel_json()
   return channels;
 }
 
+/**
+  @brief  Build JSON object containing the power budget
+  
+  @param  none
+  @retval nlohmann::json
+*/
+static nlohmann::json get_power_json()
+{
+  nlohmann::json power = nlohmann::json::object();
+  power["budget"] = NVS::get_power_budget();
+
+  return power;
+}
+
+/**
+  @brief  Build JSON object containing the solar location and today's 
+          solar events in local time
+  
+  @param  none
+  @retval nlohmann::json
+*/
+static nlohmann::json get_solar_json()
+{
+  Solar::config_t config = NVS::get_solar_config();
+
+  nlohmann::json solar = nlohmann::json::object();
+  JSON::set_if_valid<float>(solar, "latitude", config.latitude, [&](float) { return config.enabled; });
+  JSON::set_if_valid<float>(solar, "longitude", config.longitude, [&](float) { return config.enabled; });
+  solar["channel"] = config.channel;
+  solar["intensity"] = Intensity::to_percent(config.intensity);
+
+  if (!config.enabled)
+    return solar;
+
+  time_t wall = LocalTime::get_wall_time(time(nullptr));
+  Solar::day_t day = Solar::get_day(config, wall - ((wall % 86400) + 86400) % 86400);
+
+  static const char* names[] = {"sunrise", "noon", "sunset"};
+  for (int a = 0; a < Solar::ANCHOR_MAX; a++)
+  {
+    if (day.events[a] == Solar::INVALID_TIME)
+    {
+      solar["today"][names[a]] = nullptr;
+      continue;
+    }
+
+    struct tm local_tm;
+    LocalTime::get_local_tm(day.events[a], &local_tm);
+
+    char tod[8];
+    strftime(tod, sizeof(tod), "%H:%M", &local_tm);
+    solar["today"][names[a]] = tod;
+  }
+
+  return solar;
+}
+
+/**
+  @brief  Build JSON object containing the moonlight channel and today's 
+          phase, moonrise and moonset in local time
+  
+  @param  none
+  @retval nlohmann::json
+*/
+static nlohmann::json get_moon_json()
+{
+  Lunar::config_t config = NVS::get_moon_config();
+
+  nlohmann::json moon = nlohmann::json::object();
+  moon["channel"] = config.channel;
+  moon["intensity"] = Intensity::to_percent(config.intensity);
+  moon["blend"] = moon_blends[config.blend];
+
+  Solar::config_t location = NVS::get_solar_config();
+  if (!location.enabled)
+    return moon;
+
+  time_t wall = LocalTime::get_wall_time(time(nullptr));
+  Lunar::day_t day = Lunar::get_day(location, Schedule::get_event_time(wall - ((wall % 86400) + 86400) % 86400));
+
+  nlohmann::json& today = moon["today"];
+  today["age"] = day.age_days;
+  today["illumination"] = day.illumination * 100;
+
+  time_t events[] = {day.rise, day.set};
+  const char* names[] = {"rise", "set"};
+  for (int e = 0; e < 2; e++)
+  {
+    if (events[e] == Lunar::INVALID_TIME)
+    {
+      today[names[e]] = nullptr;
+      continue;
+    }
+
+    struct tm local_tm;
+    LocalTime::get_local_tm(events[e], &local_tm);
+
+    char tod[8];
+    strftime(tod, sizeof(tod), "%H:%M", &local_tm);
+    today[names[e]] = tod;
+  }
+
+  return moon;
+}
+
+/**
+  @brief  Build JSON object of a window of the day. Closed windows have null 
+          times
+  
+  @param  window Window of an effect
+  @retval nlohmann::json
+*/
+static nlohmann::json get_window_json(const Effects::window_t& window)
+{
+  nlohmann::json result = nlohmann::json::object();
+  if (window.start == window.end)
+  {
+    result["start"] = nullptr;
+    result["end"] = nullptr;
+    return result;
+  }
+
+  char tod[8];
+  snprintf(tod, sizeof(tod), "%02d:%02d", (int) (window.start / 3600), (int) (window.start / 60 % 60));
+  result["start"] = tod;
+  snprintf(tod, sizeof(tod), "%02d:%02d", (int) (window.end / 3600), (int) (window.end / 60 % 60));
+  result["end"] = tod;
+
+  return result;
+}
+
+/**
+  @brief  Build JSON object containing the cloud and storm effects
+  
+  @param  none
+  @retval nlohmann::json
+*/
+static nlohmann::json get_effects_json()
+{
+  Effects::config_t config = NVS::get_effects_config();
+
+  nlohmann::json effects = nlohmann::json::object();
+  effects["seed"] = config.seed;
+
+  nlohmann::json& channels = effects["channels"] = nlohmann::json::array();
+  for (uint32_t c = 0; c < LED_CHANNEL_COUNT; c++)
+  {
+    if (config.channels & (1 << c))
+      channels.push_back(c);
+  }
+
+  nlohmann::json& clouds = effects["clouds"] = get_window_json(config.clouds);
+  clouds["cover"] = Intensity::to_percent(config.cover);
+  clouds["depth"] = Intensity::to_percent(config.depth);
+  clouds["period"] = config.period_s;
+
+  nlohmann::json& storm = effects["storm"] = get_window_json(config.storm);
+  storm["darkening"] = Intensity::to_percent(config.darkening);
+  storm["flashes"] = config.flashes_per_hour;
+  storm["flash"] = Intensity::to_percent(config.flash);
+
+  return effects;
+}
+
 /**
   @brief  Build JSON object containing schedule data
   
@@ -255,12 +574,62 @@ std::string JSON::get_settings()
   nlohmann::json root;
   root["timers"] = get_timer_json();
   root["channels"] = get_channel_json();
+  root["power"] = get_power_json();
+  root["solar"] = get_solar_json();
+  root["moon"] = get_moon_json();
+  root["effects"] = get_effects_json();
   root["schedule"] = get_schedule_json();
   root["system"] = get_system_json();
 
   return root.dump();
 }
 
+/**
+  @brief  Parse an object of channel intensities in percent into an entry. 
+          Empty cells leave the channel unset
+  
+  @param  root JSON object keyed by channel
+  @param  entry Parsed intensities
+  @retval bool - Keys were channels and values were percentages
+*/
+static bool parse_intensities(const nlohmann::json& root, Schedule::entry_t& entry)
+{
+  if (!root.is_object())
+    return false;
+
+  for (auto& kv : root.items())
+  {
+    // Skip the duplicate TOD entry within the object
+    const std::string& key = kv.key();
+    if (key == "tod")
+      continue;
+
+    // Checked here as the firmware is built without exceptions for std::stoi to throw
+    const nlohmann::json& value = kv.value();
+    bool empty = value.is_null() || (value.is_string() && value.get_ref<const std::string&>().empty());
+    if (key.empty() || key.length() > 3 || !std::all_of(key.begin(), key.end(), ::isdigit) || !(value.is_number() || empty))
+    {
+      ESP_LOGE(TAG, "Invalid intensity '%s': %s", key.c_str(), value.dump().c_str());
+      return false;
+    }
+
+    ledc_channel_t channel = (ledc_channel_t) std::stoi(key);
+    if (channel >= LED_CHANNEL_COUNT)
+    {
+      ESP_LOGW(TAG, "Ignoring intensity for channel %d. Built for %d channels.", channel, (int) LED_CHANNEL_COUNT);
+      continue;
+    }
+
+    // The web interface only sends whole percentages
+    if (value.is_number_integer())
+      entry.set(channel, Intensity::from_percent(value.get<int32_t>()));
+    else if (value.is_number())
+      entry.set(channel, Intensity::from_percent(value.get<double>()));
+  }
+
+  return true;
+}
+
 /**
   @brief  Parse JSON representing a single entry of the schedule into a C++ type
   
@@ -269,8 +638,10 @@ std::string JSON::get_settings()
 */
 Schedule::entry_t JSON::parse_schedule_entry(const std::string& jEntry)
 {
+  Schedule::entry_t entry;
+
   nlohmann::json root = nlohmann::json::parse(jEntry, nullptr, false);
-  if (root.is_discarded())
+  if (root.is_discarded() || !parse_intensities(root, entry))
   {
     ESP_LOGE(TAG, "Invalid schedule entry JSON '%s'", jEntry.c_str());
 
@@ -278,20 +649,240 @@ Schedule::entry_t JSON::parse_schedule_entry(const std::string& jEntry)
     return empty;
   }
 
-  Schedule::entry_t entry;
+  return entry;
+}
 
-  for (auto& kv : root.items())
+/**
+  @brief  Parse a schedule key. Only the HH:MM form the web interface stores 
+          is accepted so one time of day can't exist under multiple keys
+  
+  @param  key Key of the schedule entry
+  @param  tod Parsed time of day
+  @retval bool - Key was valid
+*/
+static bool parse_schedule_key(const std::string& key, Schedule::time_of_day_t& tod)
+{
+  struct tm timeinfo = {};
+  const char* end = strptime(key.c_str(), "%H:%M", &timeinfo);
+  if (key.length() != 5 || end == nullptr || *end != '\0')
+    return false;
+
+  tod = timeinfo.tm_hour * 3600 + timeinfo.tm_min * 60;
+  return true;
+}
+
+/**
+  @brief  Check a schedule key is relative to a solar event
+  
+  @param  key Schedule key
+  @retval bool
+*/
+static bool is_solar_key(const std::string& key)
+{
+  Solar::anchor_t anchor;
+  int32_t offset_s;
+
+  return Solar::parse_key(key, anchor, offset_s);
+}
+
+/**
+  @brief  Parse an edit of individual schedule entries and store only the 
+          changed keys to the NVS. Expects the form
+          {"upsert": {"HH:MM": {...}}, "delete": ["HH:MM", ["HH:MM", "HH:MM"]]}
+          where a pair deletes an inclusive range that may wrap midnight. 
+          Keys relative to the sun, e.g. "sunset+00:30", may be upserted or 
+          deleted individually
+  
+  @param  jString JSON string received from web interface
+  @param  edit Changes to apply to the running schedule
+  @retval bool - JSON was valid and processed
+*/
+bool JSON::parse_schedule_edit(const std::string& jString, Scheduler::edit_t& edit)
+{
+  nlohmann::json root = nlohmann::json::parse(jString, nullptr, false);
+  if (root.is_discarded() || !root.is_object())
   {
-    // Skip the duplicate TOD entry within the object
-    if (kv.key() == "tod")
+    ESP_LOGE(TAG, "Invalid JSON received: %s", jString.c_str());
+    return false;
+  }
+
+  // Validate everything before touching the NVS
+  std::vector<std::string> solar_deletes;
+  if (root.contains("delete"))
+  {
+    const nlohmann::json& deletes = root.at("delete");
+    if (!deletes.is_array())
+      return false;
+
+    for (auto& d : deletes)
+    {
+      Schedule::time_of_day_t first, last;
+      if (d.is_string() && is_solar_key(d.get<std::string>()))
+      {
+        solar_deletes.push_back(d.get<std::string>());
+        continue;
+      }
+
+      if (d.is_string() && parse_schedule_key(d.get<std::string>(), first))
+        last = first;
+      else if (!(d.is_array() && d.size() == 2 && d[0].is_string() && d[1].is_string() &&
+                 parse_schedule_key(d[0].get<std::string>(), first) && parse_schedule_key(d[1].get<std::string>(), last)))
+      {
+        ESP_LOGE(TAG, "Invalid schedule delete '%s'", d.dump().c_str());
+        return false;
+      }
+
+      edit.erases.emplace_back(first, last);
+    }
+  }
+
+  std::map<std::string, nlohmann::json> upserts;
+  if (root.contains("upsert"))
+  {
+    const nlohmann::json& upsert = root.at("upsert");
+    if (!upsert.is_object())
+      return false;
+
+    for (auto& kv : upsert.items())
+    {
+      Schedule::time_of_day_t tod;
+      Schedule::entry_t intensities;
+      if (!(parse_schedule_key(kv.key(), tod) || is_solar_key(kv.key())) || !parse_intensities(kv.value(), intensities))
+      {
+        ESP_LOGE(TAG, "Invalid schedule upsert '%s'", kv.key().c_str());
+        return false;
+      }
+
+      // Keep the stored entry consistent with its key
+      nlohmann::json entry = kv.value();
+      entry["tod"] = kv.key();
+
+      upserts[kv.key()] = entry;
+    }
+  }
+
+  // Erase stored keys covered by deletes. Keys about to be upserted are simply overwritten
+  if (!edit.erases.empty())
+  {
+    for (auto& key : NVS::get_schedule_keys())
+    {
+      Schedule::time_of_day_t tod;
+      if (upserts.count(key) || !parse_schedule_key(key, tod))
+        continue;
+
+      for (auto& range : edit.erases)
+      {
+        if (Schedule::in_range(tod, range.first, range.second))
+        {
+          NVS::erase_schedule_entry(key);
+          break;
+        }
+      }
+    }
+  }
+
+  // Solar keys are passed by name, as they resolve against the day
+  for (auto& key : solar_deletes)
+  {
+    if (upserts.count(key))
       continue;
 
-    ledc_channel_t channel = (ledc_channel_t) std::stoi(kv.key());
-    if (kv.value().is_number())
-      entry[channel] = kv.value().get<float>();
+    NVS::erase_schedule_entry(key);
+    edit.solar_erases.push_back(key);
   }
 
-  return entry;
+  for (auto& kv : upserts)
+  {
+    std::string jEntry = kv.second.dump();
+    NVS::save_schedule_entry_json(kv.first, jEntry);
+
+    if (is_solar_key(kv.first))
+      edit.solar_upserts[kv.first] = JSON::parse_schedule_entry(jEntry);
+    else
+      edit.upserts[Schedule::get_time_of_day(kv.first)] = JSON::parse_schedule_entry(jEntry);
+  }
+
+  NVS::commit_schedule();
+
+  return true;
+}
+
+static const char* layer_priorities[] = {"schedule", "scene", "manual", "limit"};
+static const char* layer_modes[] = {"override", "limit"};
+
+/**
+  @brief  Parse a layer to add to or remove from the compositor. Expects the form
+          {"name": "feeding", "priority": "scene", "mode": "override", 
+           "intensities": {"0": 20}, "duration": 1800, "blend": 2000}
+          Priority defaults to manual and mode to limit for the limit 
+          priority, override otherwise. A duration of 0 never expires. 
+          {"name": "feeding", "remove": true} removes the layer
+  
+  @param  jString JSON string received from web interface
+  @param  layer Parsed layer
+  @param  remove Layer should be removed
+  @retval bool - JSON was valid
+*/
+bool JSON::parse_layer(const std::string& jString, Compositor::layer_t& layer, bool& remove)
+{
+  nlohmann::json root = nlohmann::json::parse(jString, nullptr, false);
+  if (root.is_discarded() || !root.is_object() || !root.contains("name") || !root.at("name").is_string())
+  {
+    ESP_LOGE(TAG, "Invalid layer JSON '%s'", jString.c_str());
+    return false;
+  }
+
+  // Optional fields must have the right type for root.value(), which would throw otherwise
+  auto valid = [&root](const char* key, bool (nlohmann::json::*is_type)() const noexcept) 
+  {
+    return !root.contains(key) || (root.at(key).*is_type)();
+  };
+
+  if (!valid("remove", &nlohmann::json::is_boolean) || !valid("priority", &nlohmann::json::is_string) || 
+      !valid("mode", &nlohmann::json::is_string) || !valid("duration", &nlohmann::json::is_number_unsigned) ||
+      !valid("blend", &nlohmann::json::is_number_unsigned))
+  {
+    ESP_LOGE(TAG, "Invalid layer JSON '%s'", jString.c_str());
+    return false;
+  }
+
+  layer.name = root.at("name").get<std::string>();
+
+  remove = root.value("remove", false);
+  if (remove)
+    return true;
+
+  auto find = [](const char* const names[], size_t count, const std::string& name) -> int
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      if (name == names[i])
+        return i;
+    }
+    
+    return -1;
+  };
+
+  int priority = find(layer_priorities, Compositor::PRIORITY_MAX, root.value("priority", "manual"));
+  if (priority <= Compositor::PRIORITY_SCHEDULE)
+    return false;
+
+  int mode = find(layer_modes, 2, root.value("mode", priority == Compositor::PRIORITY_LIMIT ? "limit" : "override"));
+  if (mode < 0 || !root.contains("intensities") || !root.at("intensities").is_object())
+    return false;
+
+  uint32_t duration = root.value("duration", 0u);
+
+  layer.priority = (Compositor::priority_t) priority;
+  layer.mode = (Compositor::mode_t) mode;
+  layer.intensities = Schedule::entry_t();
+  if (!parse_intensities(root.at("intensities"), layer.intensities))
+    return false;
+
+  layer.expires = duration ? time(nullptr) + duration : 0;
+  layer.blend_ms = root.value("blend", 2000u);
+
+  return true;
 }
 
 /**
@@ -306,11 +897,97 @@ std::string JSON::get_status()
   nlohmann::json root;
 
   time_t utc = time(nullptr);
-  
+
+  struct tm local_tm;
+  LocalTime::get_local_tm(utc, &local_tm);
+
   char datetime[32] = {0};
-  strftime(datetime, 32, "%FT%T%z", localtime(&utc));
+  size_t length = strftime(datetime, 32, "%FT%T", &local_tm);
+
+  // Format the offset ourselves since the broken down time doesn't carry it
+  int32_t offset = LocalTime::get_offset(utc);
+  snprintf(datetime + length, sizeof(datetime) - length, "%c%02d%02d", offset < 0 ? '-' : '+', abs(offset) / 3600, (abs(offset) / 60) % 60);
 
   root["time"] = std::string(datetime);
+
+  Clock::stats_t stats = Clock::get_stats();
+  if (stats.syncs > 0)
+  {
+    nlohmann::json& clock = root["clock"];
+    clock["offset_ms"] = stats.offset_us / 1000.0;
+    clock["drift_ppm"] = stats.drift_ppm;
+    clock["jitter_ms"] = stats.jitter_us / 1000.0;
+    clock["syncs"] = stats.syncs;
+    clock["steps"] = stats.steps;
+    clock["last_sync"] = stats.last_sync;
+  }
+
+  LEDC::power_t power = LEDC::get_power();
+  if (power.budget_W > 0)
+  {
+    nlohmann::json& budget = root["power"];
+    budget["budget_W"] = power.budget_W;
+    budget["requested_W"] = power.requested_W;
+    budget["scale"] = power.scale;
+  }
+
+  std::array<channel_usage_t, LED_CHANNEL_COUNT> usage = LEDC::get_usage();
+  nlohmann::json& channels = root["usage"] = nlohmann::json::array();
+  for (auto& channel : usage)
+  {
+    channels.push_back({
+      {"energy_Wh", channel.energy_uJ / 3.6e9},
+      {"on_hours", channel.on_ms / 3.6e6},
+    });
+  }
+
+  std::vector<Compositor::layer_t> layers = Compositor::get_layers();
+  if (!layers.empty())
+  {
+    nlohmann::json& list = root["layers"] = nlohmann::json::array();
+    for (auto& layer : layers)
+    {
+      nlohmann::json intensities = nlohmann::json::object();
+      for (auto pair : layer.intensities)
+        intensities[std::to_string(pair.first)] = Intensity::to_percent(pair.second);
+
+      list.push_back({
+        {"name", layer.name},
+        {"priority", layer_priorities[layer.priority]},
+        {"mode", layer_modes[layer.mode]},
+        {"intensities", intensities},
+        {"expires", layer.expires},
+      });
+    }
+  }
+
+  // Report the CPU time of the effects
+  Effects::stats_t effects = Effects::get_stats();
+  if (effects.ticks > 0)
+  {
+    nlohmann::json& stats = root["effects"];
+    stats["rate_Hz"] = effects.rate_Hz;
+    stats["ticks"] = effects.ticks;
+    stats["mean_us"] = effects.mean_us;
+    stats["max_us"] = effects.max_us;
+    stats["writes"] = effects.writes;
+    stats["max_latency_ms"] = effects.max_latency_ms;
+    stats["late"] = effects.late;
+  }
+
+  // Report progress of pull updates
+  OTA::pull_status_t pull = OTA::get_pull_status();
+  if (pull.state != OTA::PULL_IDLE)
+  {
+    static const char* states[] = {"idle", "in_progress", "complete", "failed"};
+
+    nlohmann::json& ota = root["ota"];
+    ota["state"] = states[pull.state];
+    ota["target"] = pull.target;
+    ota["received"] = pull.received;
+    ota["total"] = pull.total;
+    ota["message"] = pull.message;
+  }
   
   return root.dump();
 }
@@ -5,6 +5,8 @@
 
 #include "nlohmann/json.hpp"
 #include "schedule.h"
+#include "scheduler.h"
+#include "compositor.h"
 
 namespace JSON
 {
@@ -33,6 +35,9 @@ namespace JSON
   std::string get_settings(void);
 
   Schedule::entry_t parse_schedule_entry(const std::string& jEntry);
+  bool parse_schedule_edit(const std::string& jString, Scheduler::edit_t& edit);
+
+  bool parse_layer(const std::string& jString, Compositor::layer_t& layer, bool& remove);
 
   std::string get_status(void);
 }
@@ -1,5 +1,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
 #include "driver/ledc.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
@@ -10,15 +12,126 @@
 #include "ledc_interface.h"
 #include "nvs_interface.h"
 #include "schedule.h"
+#include "main.h"
 
 #define TAG "LED"
 
 static struct
 {
   timer_config_t timer[LEDC_TIMER_MAX];
-  channel_config_t channel[LEDC_CHANNEL_MAX];
+  channel_config_t channel[LED_CHANNEL_COUNT];
 } active_configs;
 
+static constexpr uint32_t SCALE_ONE = 1 << 16; // Power scale of 1.0 in Q16
+static constexpr uint32_t MAX_DUTY = (1 << LEDC::LED_RESOLUTION) - 1;
+static constexpr uint32_t USAGE_PERIOD_S = 60;  // Accounting runs at least this often
+
+static struct
+{
+  Intensity::intensity_t requested[LED_CHANNEL_COUNT]; // Intensities before the power budget
+  uint32_t duty[LED_CHANNEL_COUNT];                    // Duty last commanded, which a fade may still be approaching
+  uint32_t fade_from[LED_CHANNEL_COUNT];               // Duty the last commanded fade started at
+  TickType_t fade_start[LED_CHANNEL_COUNT];            // Tick the last commanded fade started
+  TickType_t fade_end[LED_CHANNEL_COUNT];              // Tick the last commanded fade finishes
+  uint32_t milliwatts[LED_CHANNEL_COUNT];              // Draw at full intensity. 0 when disabled
+  uint32_t budget_mW;                                  // 0 disables the budget
+  uint64_t load;                                       // Requested draw in mW at full scale intensity
+  uint32_t scale;                                      // Q16 factor applied to keep the load in budget
+  SemaphoreHandle_t mutex;                             // Guards the budget, load and scale read by other tasks
+} output;
+
+static struct
+{
+  SemaphoreHandle_t mutex;                  // Guards totals read by other tasks
+  TimerHandle_t timer;
+  std::array<channel_usage_t, LED_CHANNEL_COUNT> totals;
+  TickType_t accounted;                     // Tick the totals are integrated up to
+  TickType_t saved;                         // Tick the totals were last saved
+  uint64_t saved_uJ;                        // Energy of all channels when last saved
+  bool dirty;                               // Totals changed since saved
+} usage;
+
+/**
+  @brief  Modelled duty of a channel at a tick, interpolating the fade in 
+          progress the way the hardware does
+  
+  @param  channel Target channel
+  @param  tick Tick at or after the last command of the channel
+  @retval uint32_t
+*/
+static uint32_t duty_at(size_t channel, TickType_t tick)
+{
+  TickType_t length = output.fade_end[channel] - output.fade_start[channel];
+  TickType_t elapsed = tick - output.fade_start[channel];
+  if (length == 0 || elapsed >= length)
+    return output.duty[channel];
+
+  int64_t from = output.fade_from[channel];
+  int64_t to = output.duty[channel];
+
+  return from + (to - from) * elapsed / length;
+}
+
+/**
+  @brief  Integrate the duty of every channel since the last accounting. 
+          Each span is linear so the trapezoid rule is exact. Must be 
+          called before any fade or wattage is changed
+  
+  @param  now Current tick
+  @retval none
+*/
+static void account(TickType_t now)
+{
+  if (now == usage.accounted)
+    return;
+
+  xSemaphoreTake(usage.mutex, portMAX_DELAY);
+
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+  {
+    // Split at the end of a fade so each span is linear
+    TickType_t from = usage.accounted;
+    TickType_t end = output.fade_end[c];
+    TickType_t spans[] = {(end - from) < (now - from) ? end : now, now};
+
+    for (TickType_t to : spans)
+    {
+      if (to == from)
+        continue;
+
+      uint32_t a = duty_at(c, from);
+      uint32_t b = duty_at(c, to);
+      uint64_t ms = (uint64_t) (to - from) * 1000 / configTICK_RATE_HZ;
+
+      usage.totals[c].energy_uJ += (uint64_t) output.milliwatts[c] * (a + b) * ms / (2 * MAX_DUTY);
+      if (a != 0 || b != 0)
+        usage.totals[c].on_ms += ms;
+
+      usage.dirty |= (a != 0 || b != 0);
+      from = to;
+    }
+  }
+
+  usage.accounted = now;
+
+  xSemaphoreGive(usage.mutex);
+}
+
+/**
+  @brief  Sum the energy of every channel
+
+  @param  totals Usage totals
+  @retval uint64_t - Energy in uJ
+*/
+static uint64_t total_energy(const std::array<channel_usage_t, LED_CHANNEL_COUNT>& totals)
+{
+  uint64_t energy_uJ = 0;
+  for (auto& total : totals)
+    energy_uJ += total.energy_uJ;
+
+  return energy_uJ;
+}
+
 /**
   @brief  Initialize the LEDC peripheral and enable fade function
   
@@ -32,6 +145,27 @@ void LEDC::init()
 
   // Reset active configs
   memset(&active_configs, 0, sizeof(active_configs));
+  memset(&output, 0, sizeof(output));
+  output.scale = SCALE_ONE;
+
+  output.mutex = xSemaphoreCreateMutex();
+  if (output.mutex == NULL)
+    ESP_LOGE(TAG, "Failed to create output mutex.");
+
+  // Continue the totals from the last save
+  usage.mutex = xSemaphoreCreateMutex();
+  usage.totals = NVS::get_channel_usage();
+  usage.accounted = usage.saved = xTaskGetTickCount();
+  usage.saved_uJ = total_energy(usage.totals);
+  usage.dirty = false;
+
+  usage.timer = xTimerCreate("UsageTimer", pdMS_TO_TICKS(USAGE_PERIOD_S * 1000), true, nullptr, 
+    [](TimerHandle_t /* t */) {
+      signal_event(MAIN_EVENT_USAGE_UPDATE);
+    });
+
+  if (usage.timer == NULL || xTimerStart(usage.timer, 0) != pdPASS)
+    ESP_LOGE(TAG, "Failed to start usage timer.");
 
   reconfigure();
 }
@@ -44,6 +178,9 @@ void LEDC::init()
 */
 void LEDC::reconfigure()
 {
+  // Reconfiguring may stop channels and change wattage
+  account(xTaskGetTickCount());
+
   // Configure all timers
   for (uint8_t i = 0; i < LEDC_TIMER_MAX; i++)
   {
@@ -56,7 +193,7 @@ void LEDC::reconfigure()
     active_configs.timer[i] = timer;
   }
 
-  for (uint8_t i = 0; i < LEDC_CHANNEL_MAX; i++)
+  for (uint8_t i = 0; i < LED_CHANNEL_COUNT; i++)
   {
     // Configure all channels
     channel_config_t channel = NVS::get_channel_config(i).second;
@@ -66,7 +203,18 @@ void LEDC::reconfigure()
       configure_channel(channel);
 
     active_configs.channel[i] = channel;
+
+    output.milliwatts[i] = channel.enabled && channel.watts > 0 ? channel.watts * 1000 : 0;
   }
+
+  float budget = NVS::get_power_budget();
+
+  xSemaphoreTake(output.mutex, portMAX_DELAY);
+  output.budget_mW = budget > 0 ? budget * 1000 : 0;
+  xSemaphoreGive(output.mutex);
+
+  // Restore reconfigured channels and apply the new budget
+  set_intensities(Schedule::entry_t(), 5000);
 }
 
 /**
@@ -105,12 +253,16 @@ void LEDC::configure_timer(const timer_config_t& config)
 */
 void LEDC::configure_channel(const channel_config_t& config)
 {
-  if (config.id >= LEDC_CHANNEL_MAX)
+  if (config.id >= LED_CHANNEL_COUNT)
   {
     ESP_LOGW(TAG, "Invalid channel '%d'", config.id);
     return;
   }
 
+  // Configuring or stopping a channel drops its duty to zero
+  output.duty[config.id] = 0;
+  output.fade_from[config.id] = 0;
+
   if (config.enabled == false)
   {
     ESP_LOGI(TAG, "Channel %d: disabled", config.id);
@@ -151,29 +303,236 @@ void LEDC::configure_channel(const channel_config_t& config)
   ledc_channel_config(&channel_config);
 }
 
+/**
+  @brief  Convert an intensity to a duty at the LED resolution
+  
+  @param  intensity Intensity as a fraction of full scale
+  @retval uint32_t
+*/
+uint32_t LEDC::to_duty(Intensity::intensity_t intensity)
+{
+  return Intensity::to_duty(intensity, (1 << LED_RESOLUTION) - 1);
+}
+
+/**
+  @brief  Get the duty a channel was last set to. Reads back the target 
+          rather than the hardware so a fade in progress isn't mistaken for 
+          a change
+  
+  @param  channel Target channel
+  @retval uint32_t
+*/
+uint32_t LEDC::get_target_duty(ledc_channel_t channel)
+{
+  if (channel >= LED_CHANNEL_COUNT)
+    return 0;
+
+  return output.duty[channel];
+}
+
+/**
+  @brief  Get the intensity a channel was last set to, before the power 
+          budget
+  
+  @param  channel Target channel
+  @retval Intensity::intensity_t
+*/
+Intensity::intensity_t LEDC::get_intensity(ledc_channel_t channel)
+{
+  if (channel >= LED_CHANNEL_COUNT)
+    return Intensity::OFF;
+
+  return output.requested[channel];
+}
+
 /**
   @brief  Set the relative intensity of the target channel with a fade
   
   @param  channel Target channel
-  @param  intensity Desired intensity from 0 - 100 %
+  @param  intensity Desired intensity as a fraction of full scale
   @param  fade_ms Fade time in milliseconds. Defaults to 5 seconds.
   @retval none
 */
-void LEDC::set_intensity(ledc_channel_t channel, double intensity, uint32_t fade_ms)
+void LEDC::set_intensity(ledc_channel_t channel, Intensity::intensity_t intensity, uint32_t fade_ms)
+{
+  Schedule::entry_t intensities;
+  intensities.set(channel, intensity);
+
+  set_intensities(intensities, fade_ms);
+}
+
+/**
+  @brief  Set the intensities of several channels at once, scaled so the 
+          estimated draw stays within the power budget. Only channels whose 
+          duty differs from their target are commanded so unchanged channels 
+          don't restart their fade. 
+          
+          With a budget, channels still fading are commanded along with 
+          them. All channels then move linearly from their present duties 
+          to their targets in lockstep, and since both ends are in budget 
+          every point of the fade is too
+  
+  @param  intensities Intensities of the channels to set
+  @param  fade_ms Fade time in milliseconds
+  @param  verbose Log each channel commanded
+  @retval uint32_t - Number of channels commanded
+*/
+static uint32_t command(const Schedule::entry_t& intensities, uint32_t fade_ms, bool verbose)
+{
+  for (auto pair : intensities)
+    output.requested[pair.first] = pair.second;
+
+  // Estimate the requested draw and scale it into the budget
+  uint64_t load = 0;
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+    load += (uint64_t) output.milliwatts[c] * output.requested[c];
+
+  uint64_t budget = (uint64_t) output.budget_mW * Intensity::FULL_SCALE;
+
+  xSemaphoreTake(output.mutex, portMAX_DELAY);
+  output.load = load;
+  output.scale = (budget == 0 || load <= budget) ? SCALE_ONE : (budget << 16) / load;
+  xSemaphoreGive(output.mutex);
+
+  uint32_t duty[LED_CHANNEL_COUNT];
+  bool changed = false;
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+  {
+    duty[c] = LEDC::to_duty(((uint64_t) output.requested[c] * output.scale) >> 16);
+    changed |= duty[c] != output.duty[c];
+  }
+
+  if (!changed)
+    return 0;
+
+  TickType_t now = xTaskGetTickCount();
+  account(now);
+
+  uint32_t commanded = 0;
+  for (size_t c = 0; c < LED_CHANNEL_COUNT; c++)
+  {
+    bool fading = (int32_t) (output.fade_end[c] - now) > 0;
+    if (duty[c] == output.duty[c] && !(budget && fading))
+      continue;
+
+    if (verbose)
+      ESP_LOGI(TAG, "Setting channel %d to duty %u over %u ms", (int) c, duty[c], fade_ms);
+
+    ledc_set_fade_with_time(LEDC::LED_MODE, (ledc_channel_t) c, duty[c], fade_ms);
+    ledc_fade_start(LEDC::LED_MODE, (ledc_channel_t) c, LEDC_FADE_NO_WAIT);
+
+    // The new fade starts from wherever the previous one had reached
+    output.fade_from[c] = duty_at(c, now);
+    output.fade_start[c] = now;
+    output.duty[c] = duty[c];
+    output.fade_end[c] = now + pdMS_TO_TICKS(fade_ms);
+    commanded++;
+  }
+
+  if (verbose && output.scale != SCALE_ONE)
+    ESP_LOGI(TAG, "Power budget scaled intensities to %.1f%%.", output.scale * 100.0 / SCALE_ONE);
+
+  return commanded;
+}
+
+/**
+  @brief  Set the intensities of several channels at once within the power 
+          budget. See command()
+  
+  @param  intensities Intensities of the channels to set
+  @param  fade_ms Fade time in milliseconds
+  @retval uint32_t - Number of channels commanded
+*/
+uint32_t LEDC::set_intensities(const Schedule::entry_t& intensities, uint32_t fade_ms)
 {
-  // Clamp from 0 - 1
-  intensity = std::max(intensity, 0.0);
-  intensity = std::min(intensity, 100.0);
+  return command(intensities, fade_ms, true);
+}
 
-  // Scale to 0 - 1
-  intensity /= 100.0;
+/**
+  @brief  Step the intensities of a software fade. Same as set_intensities 
+          but quiet, since the steps come many times a second
+  
+  @param  intensities Intensities of the channels to set
+  @param  step_ms Time until the next step in milliseconds
+  @retval uint32_t - Number of channels commanded
+*/
+uint32_t LEDC::step_intensities(const Schedule::entry_t& intensities, uint32_t step_ms)
+{
+  return command(intensities, step_ms, false);
+}
 
-  // Calculate integer intensity based on resolution
-  uint32_t range = intensity * ((1 << LED_RESOLUTION) - 1);
+/**
+  @brief  Get the estimated draw against the power budget. Safe to call from
+          other tasks
   
-  ESP_LOGD(TAG, "Channel %d: Intensity %d with fade of %d ms.", channel, range, fade_ms);
+  @param  none
+  @retval LEDC::power_t
+*/
+LEDC::power_t LEDC::get_power()
+{
+  xSemaphoreTake(output.mutex, portMAX_DELAY);
+  uint32_t budget_mW = output.budget_mW;
+  uint64_t load = output.load;
+  uint32_t scale = output.scale;
+  xSemaphoreGive(output.mutex);
+
+  power_t power;
+  power.budget_W = budget_mW / 1000.0;
+  power.requested_W = load / (1000.0 * Intensity::FULL_SCALE);
+  power.scale = (double) scale / SCALE_ONE;
+
+  return power;
+}
 
-  ledc_set_fade_with_time(LED_MODE, channel, range, fade_ms);
-  ledc_fade_start(LED_MODE, channel, LEDC_FADE_NO_WAIT);
+/**
+  @brief  Bring the usage totals up to date and save them to the NVS when 
+          the save interval has passed or enough energy was accounted since
+          the last save. Called from the main loop
+  
+  @param  force Save now if anything changed, such as before a reboot
+  @retval none
+*/
+void LEDC::update_usage(bool force)
+{
+  TickType_t now = xTaskGetTickCount();
+  account(now);
+
+  if (!usage.dirty)
+    return;
+
+  xSemaphoreTake(usage.mutex, portMAX_DELAY);
+  std::array<channel_usage_t, LED_CHANNEL_COUNT> totals = usage.totals;
+  xSemaphoreGive(usage.mutex);
+
+  // A heavy load saves early to bound what a power failure loses
+  uint64_t energy_uJ = total_energy(totals);
+  bool interval = (now - usage.saved) >= pdMS_TO_TICKS64(CONFIG_USAGE_SAVE_MINUTES * 60 * 1000);
+  bool threshold = CONFIG_USAGE_SAVE_WH > 0 && energy_uJ - usage.saved_uJ >= (uint64_t) CONFIG_USAGE_SAVE_WH * 3600 * 1000000;
+
+  if (!force && !interval && !threshold)
+    return;
+
+  xSemaphoreTake(usage.mutex, portMAX_DELAY);
+  usage.dirty = false;
+  xSemaphoreGive(usage.mutex);
+
+  NVS::save_channel_usage(totals);
+  usage.saved = now;
+  usage.saved_uJ = energy_uJ;
 }
 
+/**
+  @brief  Get the usage totals as of the last accounting, which is at most 
+          a minute old. Safe to call from other tasks
+  
+  @param  none
+  @retval std::array<channel_usage_t, LED_CHANNEL_COUNT>
+*/
+std::array<channel_usage_t, LED_CHANNEL_COUNT> LEDC::get_usage()
+{
+  xSemaphoreTake(usage.mutex, portMAX_DELAY);
+  std::array<channel_usage_t, LED_CHANNEL_COUNT> totals = usage.totals;
+  xSemaphoreGive(usage.mutex);
+
+  return totals;
+}
\ No newline at end of file
@@ -5,17 +5,26 @@
 #include <list>
 #include <string>
 #include <map>
+#include <array>
 
 #include "driver/ledc.h"
 #include "driver/gpio.h"
 
 #include "schedule.h"
+#include "intensity.h"
 
 namespace LEDC
 {
   constexpr ledc_timer_bit_t LED_RESOLUTION = LEDC_TIMER_10_BIT;
   constexpr ledc_mode_t LED_MODE = LEDC_HIGH_SPEED_MODE;
   
+  typedef struct
+  {
+    double budget_W;    // 0 when no budget is set
+    double requested_W; // Estimated draw of the intensities before scaling
+    double scale;       // Factor the intensities are scaled by to fit the budget
+  } power_t;
+
   void init(void);
 
   void reconfigure(void);
@@ -23,7 +32,17 @@ namespace LEDC
   void configure_timer(const timer_config_t& config);
   void configure_channel(const channel_config_t& config);
 
-  void set_intensity(ledc_channel_t channel, double intensity, uint32_t fade_ms = 5000);
+  uint32_t to_duty(Intensity::intensity_t intensity);
+  uint32_t get_target_duty(ledc_channel_t channel);
+  Intensity::intensity_t get_intensity(ledc_channel_t channel);
+  void set_intensity(ledc_channel_t channel, Intensity::intensity_t intensity, uint32_t fade_ms = 5000);
+  uint32_t set_intensities(const Schedule::entry_t& intensities, uint32_t fade_ms);
+  uint32_t step_intensities(const Schedule::entry_t& intensities, uint32_t step_ms);
+
+  power_t get_power(void);
+
+  void update_usage(bool force = false);
+  std::array<channel_usage_t, LED_CHANNEL_COUNT> get_usage(void);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,225 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include <time.h>
+
+#include "local_time.h"
+
+#define TAG "LocalTime"
+
+static constexpr time_t SECONDS_PER_DAY = 86400;
+static constexpr time_t HORIZON = 7 * SECONDS_PER_DAY; // Search this far each side for transitions
+
+// Intervals cached. Schedule::get_event_time() probes either side of a transition in turn
+static constexpr size_t CACHE_SIZE = 2;
+
+// UTC offset in effect over [from, until). Both ends are transitions or the search horizon
+typedef struct
+{
+  bool valid;
+  time_t from;
+  time_t until;
+  int32_t offset;
+} interval_t;
+
+static struct
+{
+  SemaphoreHandle_t mutex;
+  interval_t intervals[CACHE_SIZE];
+  size_t next; // Interval replaced on the next miss
+} cache;
+
+/**
+  @brief  Days since the epoch of a civil date. 
+          http://howardhinnant.github.io/date_algorithms.html
+  
+  @param  y Year
+  @param  m Month, 1 - 12
+  @param  d Day of month, 1 - 31
+  @retval time_t
+*/
+static time_t days_from_civil(int y, int m, int d)
+{
+  y -= m <= 2;
+  const int era = (y >= 0 ? y : y - 399) / 400;
+  const int yoe = y - era * 400;
+  const int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return (time_t) era * 146097 + doe - 719468;
+}
+
+/**
+  @brief  Evaluate the TZ rules for the UTC offset at a time
+  
+  @param  utc UTC time
+  @retval int32_t - Seconds east of UTC
+*/
+static int32_t evaluate_offset(time_t utc)
+{
+  struct tm local_tm;
+  localtime_r(&utc, &local_tm);
+
+  time_t wall = days_from_civil(local_tm.tm_year + 1900, local_tm.tm_mon + 1, local_tm.tm_mday) * SECONDS_PER_DAY +
+                local_tm.tm_hour * 3600 + local_tm.tm_min * 60 + local_tm.tm_sec;
+
+  return wall - utc;
+}
+
+/**
+  @brief  Find the first time in (lo, hi] where the offset differs from the 
+          offset at lo
+  
+  @param  lo Earlier time
+  @param  hi Later time
+  @param  offset Offset at lo
+  @retval time_t
+*/
+static time_t find_transition(time_t lo, time_t hi, int32_t offset)
+{
+  while (hi - lo > 1)
+  {
+    time_t mid = lo + (hi - lo) / 2;
+
+    if (evaluate_offset(mid) == offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return hi;
+}
+
+/**
+  @brief  Evaluate the offset at a time and the transitions either side of it
+  
+  @param  utc UTC time
+  @param  interval Interval to fill
+  @retval none
+*/
+static void evaluate_interval(time_t utc, interval_t& interval)
+{
+  int32_t offset = evaluate_offset(utc);
+
+  interval.offset = offset;
+  interval.from = utc - HORIZON;
+  interval.until = utc + HORIZON;
+
+  // Step a day at a time for the nearest transition ahead
+  for (time_t t = utc + SECONDS_PER_DAY; t < utc + HORIZON + SECONDS_PER_DAY; t += SECONDS_PER_DAY)
+  {
+    if (evaluate_offset(t) != offset)
+    {
+      interval.until = find_transition(t - SECONDS_PER_DAY, t, offset);
+      break;
+    }
+  }
+
+  // And behind
+  for (time_t t = utc - SECONDS_PER_DAY; t > utc - HORIZON - SECONDS_PER_DAY; t -= SECONDS_PER_DAY)
+  {
+    int32_t other = evaluate_offset(t);
+    if (other != offset)
+    {
+      interval.from = find_transition(t, t + SECONDS_PER_DAY, other);
+      break;
+    }
+  }
+
+  interval.valid = true;
+
+  ESP_LOGD(TAG, "Offset %d valid from %lld until %lld.", interval.offset, (long long) interval.from, (long long) interval.until);
+}
+
+/**
+  @brief  Create the cache mutex. Must be called before any other task uses local time
+  
+  @param  none
+  @retval none
+*/
+void LocalTime::init()
+{
+  cache.mutex = xSemaphoreCreateMutex();
+  if (cache.mutex == NULL)
+    ESP_LOGE(TAG, "Failed to create local time mutex.");
+}
+
+/**
+  @brief  Discard the cached offsets. Must be called after TZ changes
+  
+  @param  none
+  @retval none
+*/
+void LocalTime::invalidate()
+{
+  xSemaphoreTake(cache.mutex, portMAX_DELAY);
+
+  for (interval_t& interval : cache.intervals)
+    interval.valid = false;
+
+  xSemaphoreGive(cache.mutex);
+}
+
+/**
+  @brief  Get the UTC offset in effect at a time. TZ rules are only evaluated
+          when the time falls outside the cached intervals
+  
+  @param  utc UTC time
+  @retval int32_t - Seconds east of UTC
+*/
+int32_t LocalTime::get_offset(time_t utc)
+{
+  xSemaphoreTake(cache.mutex, portMAX_DELAY);
+
+  const interval_t* found = nullptr;
+  for (const interval_t& interval : cache.intervals)
+  {
+    if (interval.valid && utc >= interval.from && utc < interval.until)
+    {
+      found = &interval;
+      break;
+    }
+  }
+
+  // Replace the intervals in turn so the two sides of a transition stay cached together
+  if (found == nullptr)
+  {
+    interval_t& interval = cache.intervals[cache.next];
+    cache.next = (cache.next + 1) % CACHE_SIZE;
+
+    evaluate_interval(utc, interval);
+    found = &interval;
+  }
+
+  int32_t offset = found->offset;
+
+  xSemaphoreGive(cache.mutex);
+
+  return offset;
+}
+
+/**
+  @brief  Convert a UTC time to local wall clock time
+  
+  @param  utc UTC time
+  @retval time_t - Local seconds since the epoch
+*/
+time_t LocalTime::get_wall_time(time_t utc)
+{
+  return utc + get_offset(utc);
+}
+
+/**
+  @brief  Break down a UTC time into local time. Like localtime_r but 
+          tm_isdst is not set
+  
+  @param  utc UTC time
+  @param  local_tm Broken down local time
+  @retval none
+*/
+void LocalTime::get_local_tm(time_t utc, struct tm* local_tm)
+{
+  time_t wall = get_wall_time(utc);
+  gmtime_r(&wall, local_tm);
+}
\ No newline at end of file
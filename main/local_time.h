@@ -0,0 +1,16 @@
+#ifndef __LOCAL_TIME_H__
+#define __LOCAL_TIME_H__
+
+#include <time.h>
+#include <stdint.h>
+
+namespace LocalTime
+{
+  void init(void);
+  void invalidate(void);
+  int32_t get_offset(time_t utc);
+  time_t get_wall_time(time_t utc);
+  void get_local_tm(time_t utc, struct tm* local_tm);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include <math.h>
+#include <time.h>
+
+#include "lunar.h"
+
+// Altitude of the centre of the moon at rise and set, allowing for its parallax, radius and refraction
+static constexpr double RISE_ALTITUDE_DEG = 0.125;
+static constexpr double DEG_TO_RAD = M_PI / 180.0;
+static constexpr double J2000_JD = 2451545.0;
+static constexpr double NEW_MOON_JD = 2451550.26; // 2000-01-06 18:14 UTC
+static constexpr uint32_t SCAN_STEP_S = 600;      // Spacing of the altitude samples searched for rise and set
+
+/**
+  @brief  Convert a UTC time to a Julian date
+
+  @param  utc UTC time
+  @retval double
+*/
+static double get_julian_date(time_t utc)
+{
+  return utc / 86400.0 + 2440587.5;
+}
+
+/**
+  @brief  Days since the last new moon from the mean synodic month. Within
+          about half a day of the true phase, which is plenty for lighting
+
+  @param  utc UTC time
+  @retval float - 0 to SYNODIC_MONTH_DAYS
+*/
+float Lunar::get_age(time_t utc)
+{
+  double age = fmod(get_julian_date(utc) - NEW_MOON_JD, SYNODIC_MONTH_DAYS);
+
+  return age < 0 ? age + SYNODIC_MONTH_DAYS : age;
+}
+
+/**
+  @brief  Fraction of the disc lit at an age
+
+  @param  age_days Days since the new moon
+  @retval float - 0 at new moon to 1 at full moon
+*/
+float Lunar::get_illumination(float age_days)
+{
+  return (1.0f - cosf(2.0f * (float) M_PI * age_days / SYNODIC_MONTH_DAYS)) / 2.0f;
+}
+
+/**
+  @brief  Sine of the geocentric altitude of the moon, from the low precision
+          series of the Astronomical Almanac. Good to a few tenths of a
+          degree. Computed in double since the mean longitude runs to
+          hundreds of thousands of degrees
+
+  @param  location Latitude and longitude of the solar configuration
+  @param  utc UTC time
+  @retval float
+*/
+float Lunar::get_sin_altitude(const Solar::config_t& location, time_t utc)
+{
+  double days = get_julian_date(utc) - J2000_JD;
+  double t = days / 36525.0;
+
+  // Ecliptic longitude and latitude
+  double lambda = 218.32 + 481267.881 * t + 6.29 * sin((134.9 + 477198.85 * t) * DEG_TO_RAD) -
+                  1.27 * sin((259.2 - 413335.38 * t) * DEG_TO_RAD) + 0.66 * sin((235.7 + 890534.23 * t) * DEG_TO_RAD) +
+                  0.21 * sin((269.9 + 954397.70 * t) * DEG_TO_RAD) - 0.19 * sin((357.5 + 35999.05 * t) * DEG_TO_RAD) -
+                  0.11 * sin((186.6 + 966404.05 * t) * DEG_TO_RAD);
+  double beta = 5.13 * sin((93.3 + 483202.03 * t) * DEG_TO_RAD) + 0.28 * sin((228.2 + 960400.87 * t) * DEG_TO_RAD) -
+                0.28 * sin((318.3 + 6003.18 * t) * DEG_TO_RAD) - 0.17 * sin((217.6 - 407332.20 * t) * DEG_TO_RAD);
+
+  lambda = fmod(lambda, 360.0) * DEG_TO_RAD;
+  beta *= DEG_TO_RAD;
+
+  // Equatorial coordinates with the obliquity of J2000
+  double l = cos(beta) * cos(lambda);
+  double m = 0.9175 * cos(beta) * sin(lambda) - 0.3978 * sin(beta);
+  double n = 0.3978 * cos(beta) * sin(lambda) + 0.9175 * sin(beta);
+
+  double ascension = atan2(m, l);
+  double declination = asin(n);
+
+  // Local hour angle from the sidereal time
+  double sidereal = fmod(280.46061837 + 360.98564736629 * days + location.longitude, 360.0) * DEG_TO_RAD;
+  double hour_angle = sidereal - ascension;
+
+  double latitude = location.latitude * DEG_TO_RAD;
+
+  return sin(latitude) * sin(declination) + cos(latitude) * cos(declination) * cos(hour_angle);
+}
+
+/**
+  @brief  Compute the phase of the moon and find its rise and set over a day
+
+  @param  location Latitude and longitude of the solar configuration
+  @param  start UTC time of local midnight
+  @retval Lunar::day_t
+*/
+Lunar::day_t Lunar::get_day(const Solar::config_t& location, time_t start)
+{
+  day_t day;
+  day.age_days = get_age(start + 43200);
+  day.illumination = get_illumination(day.age_days);
+  day.rise = INVALID_TIME;
+  day.set = INVALID_TIME;
+
+  // Interpolate crossings of the rise altitude between samples
+  const float threshold = sin(RISE_ALTITUDE_DEG * DEG_TO_RAD);
+
+  float previous = get_sin_altitude(location, start) - threshold;
+  for (time_t t = start + SCAN_STEP_S; t <= start + 86400; t += SCAN_STEP_S)
+  {
+    float current = get_sin_altitude(location, t) - threshold;
+
+    if ((previous < 0) != (current < 0))
+    {
+      time_t crossing = t - SCAN_STEP_S + (time_t) (SCAN_STEP_S * previous / (previous - current));
+
+      if (current >= 0 && day.rise == INVALID_TIME)
+        day.rise = crossing;
+      else if (current < 0 && day.set == INVALID_TIME)
+        day.set = crossing;
+    }
+
+    previous = current;
+  }
+
+  return day;
+}
\ No newline at end of file
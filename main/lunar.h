@@ -0,0 +1,47 @@
+#ifndef __LUNAR_H__
+#define __LUNAR_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "intensity.h"
+#include "solar.h"
+
+/**
+  @brief  Phase and position of the moon for the solar location. The
+          scheduler turns them into moonlight keyframes once a day
+*/
+namespace Lunar
+{
+  typedef enum
+  {
+    BLEND_MAX, // Moonlight replaces dimmer schedule intensities
+    BLEND_ADD, // Moonlight adds to the schedule
+  } blend_t;
+
+  typedef struct
+  {
+    int32_t channel;                  // Moonlight channel, -1 for none
+    Intensity::intensity_t intensity; // Intensity of a full moon well above the horizon
+    blend_t blend;
+  } config_t;
+
+  typedef struct
+  {
+    float age_days;     // Days since the new moon, at midday
+    float illumination; // Fraction of the disc lit, at midday
+    time_t rise;        // UTC of the first moonrise of the day. INVALID_TIME if none
+    time_t set;         // UTC of the first moonset of the day. INVALID_TIME if none
+  } day_t;
+
+  constexpr time_t INVALID_TIME = (time_t) -1;
+  constexpr float SYNODIC_MONTH_DAYS = 29.530588853f;
+
+  float get_age(time_t utc);
+  float get_illumination(float age_days);
+  float get_sin_altitude(const Solar::config_t& location, time_t utc);
+
+  day_t get_day(const Solar::config_t& location, time_t start);
+}
+
+#endif
\ No newline at end of file
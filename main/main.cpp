@@ -12,10 +12,15 @@
 #include "http.h"
 #include "spiffs.h"
 #include "sntp_interface.h"
-#include "schedule.h"
+#include "clock.h"
+#include "scheduler.h"
+#include "compositor.h"
+#include "effects.h"
 #include "ledc_interface.h"
 #include "nvs_interface.h"
 #include "json.h"
+#include "local_time.h"
+#include "ota_pull.h"
 
 #define TAG "Main"
 
@@ -35,28 +40,39 @@ extern "C" void app_main()
   // Initialize our own NVS interface
   NVS::init();
 
+  // Local time is used from the main, HTTP and SNTP tasks
+  LocalTime::init();
+
   // Initialize WiFi and connect to configured network
   WiFi::init_station();
 
   // Init filesystem
   SPIFFS::init();
 
-  // Start the HTTP task
-  xTaskCreate(HTTP::task, "HTTPTask", 8192, NULL, 1, NULL);
-
   // Create an event group to run the main loop from
   event_group = xEventGroupCreate();
   if (event_group == NULL)
     ESP_LOGE(TAG, "Failed to create main event group.");
 
-  // Construct a timer to handle the scheduled events
-  TimerHandle_t schedule_timer = xTimerCreate("ScheduleTimer", 1, false, (void*) Schedule::INVALID_TOD, 
-    [](TimerHandle_t t) {
-      signal_event(MAIN_EVENT_LED_TIMER_EXPIRED);
-    });
+  // Create the schedule timer
+  Compositor::init();
+  Scheduler::init();
+
+  // Init LED peripherals
+  LEDC::init();
 
-  if (schedule_timer == NULL)
-    ESP_LOGE(TAG, "Failed to create schedule timer.");
+  // Start any configured effects over the compositor output
+  Effects::init();
+
+  // Pull status is read from the HTTP task and updated by the pull task
+  OTA::init_pull();
+
+  // Start the HTTP task once its requests can be handled
+  HTTP::init();
+  xTaskCreate(HTTP::task, "HTTPTask", 8192, NULL, 1, NULL);
+
+  // Start disciplining the clock before the first sync
+  Clock::init();
 
   // Construct server list
   SNTP::server_list_t ntp_servers = {
@@ -69,11 +85,6 @@ extern "C" void app_main()
     signal_event(MAIN_EVENT_SYSTEM_TIME_UPDATED);
   });
 
-  Schedule schedule;
-
-  // Init LED peripherals
-  LEDC::init();
-
   // Wait for initial time sync
   xEventGroupWaitBits(event_group, MAIN_EVENT_SYSTEM_TIME_UPDATED, pdTRUE, pdFALSE, portMAX_DELAY);
 
@@ -84,99 +95,22 @@ extern "C" void app_main()
   {
     EventBits_t events = xEventGroupWaitBits(event_group, MAIN_EVENT_ALL, pdTRUE, pdFALSE, portMAX_DELAY);
 
-    if (events & MAIN_EVENT_CONFIG_UPDATE)
-      LEDC::reconfigure();
-
-    if (events & MAIN_EVENT_SCHEDULE_UPDATE)
-    {
-      ESP_LOGI(TAG, "Loading schedule...");
-
-      std::map<std::string, std::string> schedule_json = NVS::get_schedule_json();
-
-      schedule.reset();
-
-      for (auto& kv : schedule_json)
-      {
-        Schedule::time_of_day_t tod = Schedule::get_time_of_day(kv.first);
-        Schedule::entry_t entry = JSON::parse_schedule_entry(kv.second);
+    // Keep the LEDs following the schedule
+    Scheduler::handle_events(events & Scheduler::EVENTS);
 
-        schedule.set(tod, entry);
-      }
+    // Step the cloud and storm effects
+    Effects::handle_events(events & Effects::EVENTS);
 
-      Schedule::time_of_day_t prev = schedule.prev(Schedule::get_time_of_day());
-
-      // Reset event ID to previous and trigger timer update
-      vTimerSetTimerID(schedule_timer, (void*) prev);
-      xEventGroupSetBits(event_group, MAIN_EVENT_LED_TIMER_EXPIRED);
-    }
-
-    if (events & MAIN_EVENT_SYSTEM_TIME_UPDATED)
-    {
-      // Calculate time of day, and delta to next scheduled event
-      Schedule::time_of_day_t tod = Schedule::get_time_of_day();
-      Schedule::time_of_day_t delta = Schedule::delta(schedule.next(tod), tod);
-
-      // If invalid TOD don't do anything
-      if (delta == Schedule::INVALID_TOD)
-        continue;
-
-      // Calculate the error between the timer's expiration and expected time delta
-      TickType_t remaining_ticks = xTimerGetExpiryTime(schedule_timer) - xTaskGetTickCount();
-      double error = delta - (remaining_ticks / (double) pdMS_TO_TICKS(1000));
-
-      ESP_LOGD(TAG, "System time updated. Timer error: %f", error);
-
-      if (abs(error) > Schedule::MAX_SCHEDULE_ERROR)
-      {
-        ESP_LOGW(TAG, "Timer delta and actual delta differ by more than %d seconds. Updating timer.", Schedule::MAX_SCHEDULE_ERROR);
-
-        // Reset event ID and trigger timer update
-        vTimerSetTimerID(schedule_timer, (void*) Schedule::INVALID_TOD);
-        xEventGroupSetBits(event_group, MAIN_EVENT_LED_TIMER_EXPIRED);
-      }
-    }
-
-    if (events & MAIN_EVENT_LED_TIMER_EXPIRED)
-    {
-      // Calculate time of day, next TOD and delta to next scheduled event
-      Schedule::time_of_day_t tod = Schedule::get_time_of_day();
-      Schedule::time_of_day_t next = schedule.next(tod);
-
-      // If invalid TOD don't do anything
-      if (next == Schedule::INVALID_TOD)
-      {
-        ESP_LOGW(TAG, "Invalid TOD. Empty schedule?");
-        continue;
-      }
-
-      Schedule::time_of_day_t delta = Schedule::delta(next, tod);
-
-      ESP_LOGI(TAG, "Timer update. TOD: %ld, Next: %ld, Delta: %ld", tod, next, delta);
-
-      // Reset timer for next schedule event
-      if (xTimerChangePeriod(schedule_timer, pdMS_TO_TICKS64(delta * 1000), pdMS_TO_TICKS(1000)) != pdPASS)
-        ESP_LOGE(TAG, "Failed to update schedule timer for next event.");
-
-      // Pull the expected TOD from the timer ID
-      Schedule::time_of_day_t expected_tod = (Schedule::time_of_day_t) pvTimerGetTimerID(schedule_timer);
-
-      // Save the "event ID" of the next event
-      vTimerSetTimerID(schedule_timer, (void*) next);
-
-      if (abs(tod - expected_tod) > Schedule::MAX_SCHEDULE_ERROR && expected_tod != Schedule::INVALID_TOD) // Ignore init conditions
-        ESP_LOGW(TAG, "Expected TOD and actual TOD differ by more than %d seconds.", Schedule::MAX_SCHEDULE_ERROR);
-
-      // Execute state changes for TOD
-      for (auto pair : schedule[expected_tod])
-      {
-        ESP_LOGI(TAG, "Setting channel %d to %g", pair.first, pair.second);
-        LEDC::set_intensity((ledc_channel_t) pair.first, pair.second);
-      }
-    }
+    // Keep the usage totals current and save them occasionally
+    if (events & MAIN_EVENT_USAGE_UPDATE)
+      LEDC::update_usage();
 
     if (events & MAIN_EVENT_REBOOT)
     {
       ESP_LOGI(TAG, "Rebooting...");
+
+      // Save usage since the last save before it is lost
+      LEDC::update_usage(true);
       esp_restart();
     }
 
@@ -11,6 +11,10 @@ typedef enum
   // Events fired when configs changed
   MAIN_EVENT_CONFIG_UPDATE    = 1 << 2,
   MAIN_EVENT_SCHEDULE_UPDATE  = 1 << 3,
+  MAIN_EVENT_SCHEDULE_EDIT    = 1 << 7,
+  MAIN_EVENT_LAYER_UPDATE     = 1 << 8,
+  MAIN_EVENT_USAGE_UPDATE     = 1 << 9,
+  MAIN_EVENT_EFFECTS_TICK     = 1 << 10,
   // System events
   MAIN_EVENT_REBOOT           = 1 << 4,
   MAIN_EVENT_REMOUNT_SPIFFS   = 1 << 5,
@@ -98,13 +98,24 @@ void NVS::check_required_configuration()
 */
 void NVS::reset_configuration()
 {
+  // The active SPIFFS slot describes the flash contents, not configuration
+  uint8_t spiffs_slot = get_spiffs_slot();
+
+  // Usage describes the LEDs, not configuration
+  std::array<channel_usage_t, LED_CHANNEL_COUNT> usage = get_channel_usage();
+
   parameters.erase_all();
   
   for (uint8_t i = 0; i < LEDC_TIMER_MAX; i++)
     save_timer_config((timer_config_t){.id = (ledc_timer_t)i, .frequency_Hz = 500});
  
-  for (uint8_t i = 0; i < LEDC_CHANNEL_MAX; i++)
-    save_channel_config("", (channel_config_t){.id = (ledc_channel_t)i, .timer = LEDC_TIMER_0, .gpio = GPIO_NUM_NC, .enabled = false});
+  for (uint8_t i = 0; i < LED_CHANNEL_COUNT; i++)
+    save_channel_config("", (channel_config_t){.id = (ledc_channel_t)i, .timer = LEDC_TIMER_0, .gpio = GPIO_NUM_NC, .enabled = false, .watts = 0});
+
+  save_power_budget(0);
+  save_solar_config((Solar::config_t){.enabled = false, .latitude = 0, .longitude = 0, .channel = -1, .intensity = Intensity::FULL_SCALE});
+  save_moon_config((Lunar::config_t){.channel = -1, .intensity = Intensity::from_percent(10), .blend = Lunar::BLEND_MAX});
+  save_effects_config(Effects::DEFAULT_CONFIG);
   
   // Save default hostname
   save_hostname(CONFIG_LWIP_LOCAL_HOSTNAME);
@@ -116,6 +127,9 @@ void NVS::reset_configuration()
   // Save default timezone
   save_timezone(CONFIG_LOCAL_TIMEZONE);
 
+  save_spiffs_slot(spiffs_slot);
+  save_channel_usage(usage);
+
   // Save the version too
   parameters.nvs_set<uint8_t>("version", NVS_VERSION);
   parameters.commit();
@@ -186,7 +200,8 @@ std::pair<std::string, channel_config_t> NVS::get_channel_config(uint32_t id)
   char key[16] = {0};
   snprintf(key, 16, "channel%d", id);
   
-  channel_config_t config;
+  // Configs saved before fields were added read back shorter
+  channel_config_t config = {};
   parameters.nvs_get<channel_config_t>(std::string(key), config);
 
   std::string name;
@@ -195,6 +210,136 @@ std::pair<std::string, channel_config_t> NVS::get_channel_config(uint32_t id)
   return std::make_pair(name, config);
 }
 
+/**
+  @brief  Save the total power budget of the channels to the NVS
+  
+  @param  watts Budget in watts. 0 disables the budget
+  @retval none
+*/
+void NVS::save_power_budget(float watts)
+{
+  parameters.nvs_set<float>("power_budget", watts);
+  parameters.commit();
+}
+
+/**
+  @brief  Fetch the total power budget of the channels from the NVS
+  
+  @param  none
+  @retval float - Budget in watts. 0 when not set
+*/
+float NVS::get_power_budget()
+{
+  float watts = 0;
+  parameters.nvs_get<float>("power_budget", watts);
+
+  return watts;
+}
+
+/**
+  @brief  Save the location and elevation channel of the solar schedule
+  
+  @param  config Solar::config_t
+  @retval none
+*/
+void NVS::save_solar_config(const Solar::config_t& config)
+{
+  parameters.nvs_set<Solar::config_t>("solar", config);
+  parameters.commit();
+}
+
+/**
+  @brief  Fetch the location and elevation channel of the solar schedule
+  
+  @param  none
+  @retval Solar::config_t - Disabled when not set
+*/
+Solar::config_t NVS::get_solar_config()
+{
+  Solar::config_t config = {.enabled = false, .latitude = 0, .longitude = 0, .channel = -1, .intensity = Intensity::FULL_SCALE};
+  parameters.nvs_get<Solar::config_t>("solar", config);
+
+  return config;
+}
+
+/**
+  @brief  Save the moonlight channel
+  
+  @param  config Lunar::config_t
+  @retval none
+*/
+void NVS::save_moon_config(const Lunar::config_t& config)
+{
+  parameters.nvs_set<Lunar::config_t>("moon", config);
+  parameters.commit();
+}
+
+/**
+  @brief  Fetch the moonlight channel
+  
+  @param  none
+  @retval Lunar::config_t - No channel when not set
+*/
+Lunar::config_t NVS::get_moon_config()
+{
+  Lunar::config_t config = {.channel = -1, .intensity = Intensity::from_percent(10), .blend = Lunar::BLEND_MAX};
+  parameters.nvs_get<Lunar::config_t>("moon", config);
+
+  return config;
+}
+
+/**
+  @brief  Save the cloud and storm effects
+  
+  @param  config Effects::config_t
+  @retval none
+*/
+void NVS::save_effects_config(const Effects::config_t& config)
+{
+  parameters.nvs_set<Effects::config_t>("effects", config);
+  parameters.commit();
+}
+
+/**
+  @brief  Fetch the cloud and storm effects
+  
+  @param  none
+  @retval Effects::config_t - No channels when not set
+*/
+Effects::config_t NVS::get_effects_config()
+{
+  Effects::config_t config = Effects::DEFAULT_CONFIG;
+  parameters.nvs_get<Effects::config_t>("effects", config);
+
+  return config;
+}
+
+/**
+  @brief  Save the usage totals of all channels to the NVS as one blob
+  
+  @param  usage Totals of each channel
+  @retval none
+*/
+void NVS::save_channel_usage(const std::array<channel_usage_t, LED_CHANNEL_COUNT>& usage)
+{
+  parameters.nvs_set<std::array<channel_usage_t, LED_CHANNEL_COUNT>>("usage", usage);
+  parameters.commit();
+}
+
+/**
+  @brief  Fetch the usage totals of all channels from the NVS
+  
+  @param  none
+  @retval std::array<channel_usage_t, LED_CHANNEL_COUNT> - Zeros when not saved yet
+*/
+std::array<channel_usage_t, LED_CHANNEL_COUNT> NVS::get_channel_usage()
+{
+  std::array<channel_usage_t, LED_CHANNEL_COUNT> usage = {};
+  parameters.nvs_get<std::array<channel_usage_t, LED_CHANNEL_COUNT>>("usage", usage);
+
+  return usage;
+}
+
 /**
   @brief  Erase all data in the schedule NVS. Does not commit!
   
@@ -237,6 +382,28 @@ void NVS::save_schedule_entry_json(const std::string& tod, const std::string& js
   schedule.nvs_set<std::string>(tod, json);
 }
 
+/**
+  @brief  Erase a schedule entry. Does not commit!
+  
+  @param  tod Time Of Day key for the schedule entry
+  @retval none
+*/
+void NVS::erase_schedule_entry(const std::string& tod)
+{
+  schedule.erase_key(tod);
+}
+
+/**
+  @brief  Fetch the keys of all schedule entries in NVS
+  
+  @param  none
+  @retval std::vector<std::string>
+*/
+std::vector<std::string> NVS::get_schedule_keys()
+{
+  return schedule.nvs_find(NVS_TYPE_STR);
+}
+
 /**
   @brief  Fetch all schedule entry JSON from NVS
   
@@ -246,7 +413,7 @@ void NVS::save_schedule_entry_json(const std::string& tod, const std::string& js
 std::map<std::string, std::string> NVS::get_schedule_json()
 { 
   // Find all keys in the schedule NVS
-  const std::vector<std::string> keys = schedule.nvs_find(NVS_TYPE_STR);
+  const std::vector<std::string> keys = get_schedule_keys();
 
   std::map<std::string, std::string> schedule_json;
   for (auto& k : keys)
@@ -370,4 +537,31 @@ std::string NVS::get_timezone()
   parameters.nvs_get<std::string>("timezone", tz);
   
   return tz;
+}
+
+/**
+  @brief  Save the active SPIFFS slot to NVS
+  
+  @param  slot Index of the slot to mount
+  @retval none
+*/
+void NVS::save_spiffs_slot(uint8_t slot)
+{
+  parameters.nvs_set<uint8_t>("spiffs_slot", slot);
+
+  parameters.commit();
+}
+
+/**
+  @brief  Fetch the active SPIFFS slot from NVS
+  
+  @param  none
+  @retval uint8_t
+*/
+uint8_t NVS::get_spiffs_slot()
+{
+  uint8_t slot = 0;
+  parameters.nvs_get<uint8_t>("spiffs_slot", slot);
+  
+  return slot;
 }
\ No newline at end of file
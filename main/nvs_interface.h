@@ -4,8 +4,12 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <array>
 
 #include "schedule.h"
+#include "solar.h"
+#include "lunar.h"
+#include "effects.h"
 
 namespace NVS
 {
@@ -25,9 +29,26 @@ namespace NVS
   void save_channel_config(const std::string& name, const channel_config_t& config);
   std::pair<std::string, channel_config_t> get_channel_config(uint32_t id);
 
+  void save_power_budget(float watts);
+  float get_power_budget(void);
+
+  void save_solar_config(const Solar::config_t& config);
+  Solar::config_t get_solar_config(void);
+
+  void save_moon_config(const Lunar::config_t& config);
+  Lunar::config_t get_moon_config(void);
+
+  void save_effects_config(const Effects::config_t& config);
+  Effects::config_t get_effects_config(void);
+
+  void save_channel_usage(const std::array<channel_usage_t, LED_CHANNEL_COUNT>& usage);
+  std::array<channel_usage_t, LED_CHANNEL_COUNT> get_channel_usage(void);
+
   void erase_schedule(void);
   void commit_schedule(void);
   void save_schedule_entry_json(const std::string& tod, const std::string& json);
+  void erase_schedule_entry(const std::string& tod);
+  std::vector<std::string> get_schedule_keys(void);
   std::map<std::string, std::string> get_schedule_json(void);
   time_t get_schedule_timestamp(void);
 
@@ -39,6 +60,9 @@ namespace NVS
 
   void save_timezone(const std::string& tz);
   std::string get_timezone(void);
+
+  void save_spiffs_slot(uint8_t slot);
+  uint8_t get_spiffs_slot(void);
 }
 
 #endif
\ No newline at end of file
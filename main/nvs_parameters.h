@@ -48,6 +48,17 @@ class NvsHelper
       return result;
     }
 
+    esp_err_t erase_key(const std::string& key)
+    {
+      assert(handle);
+
+      result = nvs_erase_key(handle, key.c_str());
+      if (result != ESP_OK && callback != NULL)
+        callback(this->_namespace, key, result);
+
+      return result;
+    }
+
     std::vector<std::string> nvs_find(nvs_type_t type, const std::string& search_key = "")
     {
       nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, this->_namespace.c_str(), type);
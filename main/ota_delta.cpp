@@ -0,0 +1,441 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "mbedtls/sha256.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "ota_interface.h"
+
+#define TAG "OTA"
+
+/**
+  @brief  Read a little endian uint32_t from a buffer
+*/
+static uint32_t read_u32(const uint8_t* data)
+{
+  return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+OTA::DeltaHandle::~DeltaHandle()
+{
+  if (this->patch.running())
+  {
+    this->aborted = true;
+    this->patch.abort();
+  }
+
+  heap_caps_free(this->buffer);
+
+  if (this->mutex != NULL)
+    vSemaphoreDelete(this->mutex);
+
+  delete this->inner;
+}
+
+/**
+  @brief  Allocate the copy buffer, start the wrapped handle and the writer
+          task which applies the patch
+  
+  @param  none
+  @retval esp_err_t
+*/
+esp_err_t OTA::DeltaHandle::start()
+{
+  if (this->base == nullptr)
+  {
+    ESP_LOGE(TAG, "No base partition for delta update.");
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  this->buffer = (uint8_t*) heap_caps_malloc(COPY_CHUNK_SIZE, MALLOC_CAP_8BIT);
+  if (this->buffer == nullptr)
+  {
+    ESP_LOGE(TAG, "Failed to allocate delta copy buffer.");
+    return ESP_ERR_NO_MEM;
+  }
+
+  this->mutex = xSemaphoreCreateMutex();
+  if (this->mutex == NULL)
+  {
+    ESP_LOGE(TAG, "Failed to create delta mutex.");
+    return ESP_ERR_NO_MEM;
+  }
+
+  this->start_us = esp_timer_get_time();
+  this->state = PARSE_HEADER;
+
+  esp_err_t result = this->inner->start();
+  if (result != ESP_OK)
+    return result;
+
+  // Base reads, hashing and copies run on the writer task, so the receiver
+  // only waits when every patch block is still being applied. A copy may
+  // take a while but always progresses through the wrapped handle, whose
+  // writer fails on a stall, so the receiver waits for blocks without timeout
+  result = this->patch.start([this](const uint8_t* data, size_t length, size_t offset) {
+    return this->apply(data, length, offset);
+  }, portMAX_DELAY);
+
+  if (result != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to start delta writer, error=0x%x.", result);
+    this->inner->cleanup();
+  }
+
+  return result;
+}
+
+/**
+  @brief  Queue patch data to be applied by the writer task
+  
+  @param  data Patch data buffer
+  @param  length Length of data buffer
+  @retval esp_err_t - First error applying the patch
+*/
+esp_err_t OTA::DeltaHandle::write(uint8_t* data, uint16_t length)
+{
+  if (this->buffer == nullptr)
+    return ESP_ERR_INVALID_STATE;
+
+  return this->patch.write(data, length);
+}
+
+/**
+  @brief  Parse a block of patch data and pass the reconstructed image to the
+          wrapped handle. Called from the writer task
+
+  @param  data Patch data buffer
+  @param  length Length of data buffer
+  @param  offset Offset of the data into the patch
+  @retval esp_err_t
+*/
+esp_err_t OTA::DeltaHandle::apply(const uint8_t* data, size_t length, size_t offset)
+{
+  size_t end = offset + length;
+
+  while (length > 0)
+  {
+    esp_err_t result = ESP_OK;
+
+    switch (this->state)
+    {
+      case PARSE_HEADER:
+      case PARSE_OP:
+      {
+        // Accumulate fixed size headers which may be split across blocks
+        size_t size = (this->state == PARSE_HEADER) ? HEADER_SIZE : OP_SIZE;
+        size_t count = std::min<size_t>(length, size - this->header_length);
+        memcpy(this->header + this->header_length, data, count);
+
+        this->header_length += count;
+        data += count;
+        length -= count;
+
+        if (this->header_length < size)
+          break;
+
+        result = (this->state == PARSE_HEADER) ? parse_header() : parse_op();
+        this->header_length = 0;
+        break;
+      }
+
+      case PARSE_INSERT:
+      {
+        size_t count = std::min<size_t>(length, this->insert_remaining);
+        result = emit((uint8_t*) data, count);
+
+        this->insert_remaining -= count;
+        data += count;
+        length -= count;
+
+        if (this->insert_remaining == 0)
+          this->state = PARSE_OP;
+        break;
+      }
+    }
+
+    if (result != ESP_OK)
+      return result;
+  }
+
+  // The patch up to here is committed once its output is programmed
+  xSemaphoreTake(this->mutex, portMAX_DELAY);
+  this->checkpoints.push_back({end, this->inner->written_bytes()});
+  xSemaphoreGive(this->mutex);
+
+  return ESP_OK;
+}
+
+/**
+  @brief  Get the offset into the patch whose output is programmed to flash
+
+  @param  none
+  @retval size_t
+*/
+size_t OTA::DeltaHandle::programmed_bytes() const
+{
+  if (this->mutex == NULL)
+    return 0;
+
+  size_t programmed = this->inner->programmed_bytes();
+
+  xSemaphoreTake(this->mutex, portMAX_DELAY);
+  while (!this->checkpoints.empty() && this->checkpoints.front().written <= programmed)
+  {
+    this->offset = this->checkpoints.front().offset;
+    this->checkpoints.pop_front();
+  }
+
+  size_t offset = this->offset;
+  xSemaphoreGive(this->mutex);
+
+  return offset;
+}
+
+/**
+  @brief  Parse the patch header and verify the base partition matches
+  
+  @param  none
+  @retval esp_err_t
+*/
+esp_err_t OTA::DeltaHandle::parse_header()
+{
+  if (read_u32(this->header) != MAGIC)
+  {
+    ESP_LOGE(TAG, "Invalid delta patch header.");
+    return ESP_ERR_INVALID_VERSION;
+  }
+
+  this->base_size = read_u32(this->header + 4);
+  this->target_size = read_u32(this->header + 8);
+  memcpy(this->target_sha256, this->header + 44, sizeof(this->target_sha256));
+
+  if (this->base_size > this->base->size)
+  {
+    ESP_LOGE(TAG, "Delta base size %u exceeds partition size.", this->base_size);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  esp_err_t result = verify_base(this->header + 12);
+  if (result != ESP_OK)
+    return result;
+
+  ESP_LOGI(TAG, "Delta patch verified against base. Target size %u.", this->target_size);
+
+  // The reconstructed image must match the target the patch was built for
+  this->inner->expect_sha256(this->target_sha256);
+
+  this->state = PARSE_OP;
+  return ESP_OK;
+}
+
+/**
+  @brief  Parse and execute a patch operation
+  
+  @param  none
+  @retval esp_err_t
+*/
+esp_err_t OTA::DeltaHandle::parse_op()
+{
+  uint8_t op = this->header[0];
+  uint32_t offset = read_u32(this->header + 1);
+  uint32_t length = read_u32(this->header + 5);
+
+  switch (op)
+  {
+    case OP_COPY:
+      return copy(offset, length);
+
+    case OP_INSERT:
+      this->insert_remaining = length;
+      if (length > 0)
+        this->state = PARSE_INSERT;
+      return ESP_OK;
+
+    default:
+      ESP_LOGE(TAG, "Invalid delta op 0x%02x.", op);
+      return ESP_ERR_INVALID_RESPONSE;
+  }
+}
+
+/**
+  @brief  Hash the base partition and compare against the expected hash
+  
+  @param  expected_sha256 Expected SHA-256 of the base image
+  @retval esp_err_t
+*/
+esp_err_t OTA::DeltaHandle::verify_base(const uint8_t* expected_sha256)
+{
+  mbedtls_sha256_context context;
+  mbedtls_sha256_init(&context);
+  mbedtls_sha256_starts_ret(&context, 0);
+
+  esp_err_t result = ESP_OK;
+  for (uint32_t offset = 0; offset < this->base_size; offset += COPY_CHUNK_SIZE)
+  {
+    if (this->aborted)
+    {
+      result = ESP_ERR_INVALID_STATE;
+      break;
+    }
+
+    size_t count = std::min<size_t>(COPY_CHUNK_SIZE, this->base_size - offset);
+    result = esp_partition_read(this->base, offset, this->buffer, count);
+    if (result != ESP_OK)
+      break;
+
+    mbedtls_sha256_update_ret(&context, this->buffer, count);
+  }
+
+  uint8_t sha256[32];
+  mbedtls_sha256_finish_ret(&context, sha256);
+  mbedtls_sha256_free(&context);
+
+  if (result != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to read base partition, err=0x%x.", result);
+    return result;
+  }
+
+  if (memcmp(sha256, expected_sha256, sizeof(sha256)) != 0)
+  {
+    ESP_LOGE(TAG, "Delta base hash mismatch. Patch was not generated against the running firmware.");
+    return ESP_ERR_INVALID_VERSION;
+  }
+
+  return ESP_OK;
+}
+
+/**
+  @brief  Copy a range of the base partition to the output
+  
+  @param  offset Offset into the base image
+  @param  length Number of bytes to copy
+  @retval esp_err_t
+*/
+esp_err_t OTA::DeltaHandle::copy(uint32_t offset, uint32_t length)
+{
+  if (offset > this->base_size || length > this->base_size - offset)
+  {
+    ESP_LOGE(TAG, "Delta copy outside of base image.");
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  while (length > 0)
+  {
+    // Don't keep copying a large range once the update is cleaned up
+    if (this->aborted)
+      return ESP_ERR_INVALID_STATE;
+
+    size_t count = std::min<size_t>(COPY_CHUNK_SIZE, length);
+    esp_err_t result = esp_partition_read(this->base, offset, this->buffer, count);
+    if (result != ESP_OK)
+    {
+      ESP_LOGE(TAG, "Failed to read base partition, err=0x%x.", result);
+      return result;
+    }
+
+    result = emit(this->buffer, count);
+    if (result != ESP_OK)
+      return result;
+
+    this->copied_bytes += count;
+    offset += count;
+    length -= count;
+  }
+
+  return ESP_OK;
+}
+
+/**
+  @brief  Pass reconstructed data to the wrapped handle
+  
+  @param  data Data buffer
+  @param  length Length of data buffer
+  @retval esp_err_t
+*/
+esp_err_t OTA::DeltaHandle::emit(uint8_t* data, size_t length)
+{
+  if (length > this->target_size - this->written)
+  {
+    ESP_LOGE(TAG, "Delta output exceeds target size.");
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  this->written += length;
+
+  return this->inner->write(data, length);
+}
+
+/**
+  @brief  Wait for the writer task to apply the rest of the patch, check it
+          was fully applied and finalize the wrapped handle
+  
+  @param  none
+  @retval OTA::end_result_t
+*/
+OTA::end_result_t OTA::DeltaHandle::end()
+{
+  esp_err_t status = this->patch.finish();
+  if (status == ESP_OK && (this->state != PARSE_OP || this->header_length != 0 || this->written != this->target_size))
+  {
+    ESP_LOGE(TAG, "Delta patch incomplete. Wrote %u of %u bytes.", (unsigned) this->written, this->target_size);
+    status = ESP_ERR_INVALID_SIZE;
+  }
+
+  if (status != ESP_OK)
+  {
+    OTA::end_result_t result;
+    this->inner->cleanup();
+    result.status = status;
+    result.callback = nullptr;
+    return result;
+  }
+
+  OTA::end_result_t result = this->inner->end();
+
+  ESP_LOGI(TAG, "Delta applied in %lld ms. Patch %u bytes, image %u bytes (%u copied from base).",
+            (long long) (esp_timer_get_time() - this->start_us) / 1000, (unsigned) this->patch.written(), (unsigned) this->written, (unsigned) this->copied_bytes);
+
+  return result;
+}
+
+/**
+  @brief  Stop applying the patch and cleanup the wrapped handle
+  
+  @param  none
+  @retval esp_err_t
+*/
+esp_err_t OTA::DeltaHandle::cleanup()
+{
+  this->aborted = true;
+  this->patch.abort();
+
+  return this->inner->cleanup();
+}
+
+/**
+  @brief  Pass the expected hash of the decoded image to the wrapped handle
+  
+  @param  sha256 Expected SHA-256 digest
+  @retval none
+*/
+void OTA::DeltaHandle::expect_sha256(const uint8_t* sha256)
+{
+  this->inner->expect_sha256(sha256);
+}
+
+/**
+  @brief  Pass the stall timeout to the wrapped handle
+  
+  @param  timeout_ms Timeout in milliseconds
+  @retval none
+*/
+void OTA::DeltaHandle::set_timeout(uint32_t timeout_ms)
+{
+  this->inner->set_timeout(timeout_ms);
+}
\ No newline at end of file
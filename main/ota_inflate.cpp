@@ -0,0 +1,158 @@
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp32/rom/miniz.h"
+
+#include "ota_interface.h"
+
+#define TAG "OTA"
+
+OTA::InflateHandle::~InflateHandle()
+{
+  heap_caps_free(this->inflator);
+  heap_caps_free(this->window);
+
+  delete this->inner;
+}
+
+/**
+  @brief  Allocate the decompressor and start the wrapped handle
+  
+  @param  none
+  @retval esp_err_t
+*/
+esp_err_t OTA::InflateHandle::start()
+{
+  // Decompressor state is several KB so keep it off the HTTP task stack
+  this->inflator = (tinfl_decompressor*) heap_caps_malloc(sizeof(tinfl_decompressor), MALLOC_CAP_8BIT);
+  this->window = (uint8_t*) heap_caps_malloc(WINDOW_SIZE, MALLOC_CAP_8BIT);
+  if (this->inflator == nullptr || this->window == nullptr)
+  {
+    ESP_LOGE(TAG, "Failed to allocate decompressor.");
+    return ESP_ERR_NO_MEM;
+  }
+
+  tinfl_init(this->inflator);
+  this->window_offset = 0;
+  this->finished = false;
+
+  return this->inner->start();
+}
+
+/**
+  @brief  Inflate compressed data and pass it to the wrapped handle
+  
+  @param  data Compressed data buffer
+  @param  length Length of data buffer
+  @retval esp_err_t
+*/
+esp_err_t OTA::InflateHandle::write(uint8_t* data, uint16_t length)
+{
+  if (this->inflator == nullptr)
+    return ESP_ERR_INVALID_STATE;
+
+  this->bytes_in += length;
+
+  if (this->finished)
+  {
+    ESP_LOGE(TAG, "Unexpected data after end of compressed stream.");
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  while (true)
+  {
+    // The window is used as a circular buffer, output never crosses the end
+    size_t in_bytes = length;
+    size_t out_bytes = WINDOW_SIZE - this->window_offset;
+    tinfl_status status = tinfl_decompress(this->inflator, data, &in_bytes, this->window, 
+                                           this->window + this->window_offset, &out_bytes, TINFL_FLAG_HAS_MORE_INPUT);
+
+    data += in_bytes;
+    length -= in_bytes;
+
+    if (status < TINFL_STATUS_DONE)
+    {
+      ESP_LOGE(TAG, "Failed to inflate OTA data. Status: %d", status);
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    if (out_bytes > 0)
+    {
+      esp_err_t result = this->inner->write(this->window + this->window_offset, out_bytes);
+      if (result != ESP_OK)
+        return result;
+
+      this->bytes_out += out_bytes;
+      this->window_offset = (this->window_offset + out_bytes) & (WINDOW_SIZE - 1);
+    }
+
+    if (status == TINFL_STATUS_DONE)
+    {
+      this->finished = true;
+      break;
+    }
+
+    // Everything consumed and no pending output
+    if (status == TINFL_STATUS_NEEDS_MORE_INPUT)
+      break;
+  }
+
+  return ESP_OK;
+}
+
+/**
+  @brief  Check the compressed stream was complete and finalize the wrapped handle
+  
+  @param  none
+  @retval OTA::end_result_t
+*/
+OTA::end_result_t OTA::InflateHandle::end()
+{
+  if (!this->finished)
+  {
+    ESP_LOGE(TAG, "Compressed stream ended early.");
+
+    OTA::end_result_t result;
+    this->inner->cleanup();
+    result.status = ESP_ERR_INVALID_SIZE;
+    result.callback = nullptr;
+    return result;
+  }
+
+  ESP_LOGI(TAG, "Inflated %u bytes to %u bytes (%.1f%%).", this->bytes_in, this->bytes_out, 
+            (this->bytes_out > 0) ? (100.0 * this->bytes_in) / this->bytes_out : 0.0);
+
+  return this->inner->end();
+}
+
+/**
+  @brief  Cleanup the wrapped handle
+  
+  @param  none
+  @retval esp_err_t
+*/
+esp_err_t OTA::InflateHandle::cleanup()
+{
+  return this->inner->cleanup();
+}
+
+/**
+  @brief  Pass the expected hash of the decoded image to the wrapped handle
+  
+  @param  sha256 Expected SHA-256 digest
+  @retval none
+*/
+void OTA::InflateHandle::expect_sha256(const uint8_t* sha256)
+{
+  this->inner->expect_sha256(sha256);
+}
+
+/**
+  @brief  Pass the stall timeout to the wrapped handle
+  
+  @param  timeout_ms Timeout in milliseconds
+  @retval none
+*/
+void OTA::InflateHandle::set_timeout(uint32_t timeout_ms)
+{
+  this->inner->set_timeout(timeout_ms);
+}
\ No newline at end of file
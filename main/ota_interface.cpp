@@ -5,35 +5,193 @@
 #include "esp_log.h"
 #include "esp_ota_ops.h"
 #include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_spi_flash.h"
 
 #include <string>
 
 #include "ota_interface.h"
 #include "main.h"
+#include "spiffs.h"
 
 #define TAG "OTA"
 
 static struct
 {
   // This state is a very bad and lazy way of cordinating multiple OTA handles.
+  // The timeout callback, the HTTP task and the pull task all change it, so 
+  // it is only accessed under the lock
   OTA::STATE state;
-} ota;
+  portMUX_TYPE lock;
+} ota = {OTA::STATE_IDLE, portMUX_INITIALIZER_UNLOCKED};
 
 /**
-  @brief  Factory function to construct a OTA::Handle object from a string type
+  @brief  Get the state of the OTA update
+  
+  @param  none
+  @retval OTA::STATE
+*/
+static OTA::STATE get_state()
+{
+  portENTER_CRITICAL(&ota.lock);
+  OTA::STATE state = ota.state;
+  portEXIT_CRITICAL(&ota.lock);
+
+  return state;
+}
+
+/**
+  @brief  Set the state of the OTA update
+  
+  @param  state New state
+  @retval none
+*/
+static void set_state(OTA::STATE state)
+{
+  portENTER_CRITICAL(&ota.lock);
+  ota.state = state;
+  portEXIT_CRITICAL(&ota.lock);
+}
+
+/**
+  @brief  Change the state of the OTA update only if it is in the expected 
+          state, so two tasks can't both make the same transition
+  
+  @param  expected State required for the change
+  @param  state New state
+  @retval bool - State was changed
+*/
+static bool set_state(OTA::STATE expected, OTA::STATE state)
+{
+  portENTER_CRITICAL(&ota.lock);
+  bool changed = ota.state == expected;
+  if (changed)
+    ota.state = state;
+  portEXIT_CRITICAL(&ota.lock);
+
+  return changed;
+}
+
+/**
+  @brief  Release an update claimed by start() that failed to start
+  
+  @param  result Error that stopped the start
+  @retval esp_err_t - The error passed in
+*/
+static esp_err_t release(esp_err_t result)
+{
+  set_state(OTA::STATE_IDLE);
+  return result;
+}
+
+/**
+  @brief  Timer callback for a stalled update. Cleanup waits on the writer task
+          so it can't run on the timer service task. Fail the update instead 
+          and let the HTTP task clean it up
+  
+  @param  timer Timeout timer
+  @retval none
+*/
+static void timeout(TimerHandle_t timer)
+{
+  ESP_LOGW(TAG, "Timeout during update. Waiting for cleanup...");
+
+  set_state(OTA::STATE_IN_PROGRESS, OTA::STATE_TIMEOUT);
+}
+
+/**
+  @brief  Check if the update in progress has timed out and needs cleanup
+  
+  @param  none
+  @retval bool
+*/
+bool OTA::timed_out()
+{
+  return get_state() == OTA::STATE_TIMEOUT;
+}
+
+/**
+  @brief  Parse a hex string into a SHA-256 digest
+  
+  @param  hex Hex string of 64 characters
+  @param  sha256 Output digest buffer
+  @retval bool - String was valid
+*/
+static bool parse_sha256(const std::string& hex, uint8_t* sha256)
+{
+  if (hex.length() != 64)
+    return false;
+
+  for (size_t i = 0; i < 32; i++)
+  {
+    char byte[3] = {hex[2 * i], hex[2 * i + 1], 0};
+    char* end = nullptr;
+
+    sha256[i] = strtoul(byte, &end, 16);
+    if (end != byte + 2)
+      return false;
+  }
+
+  return true;
+}
+
+/**
+  @brief  Factory function to construct a OTA::Handle object from a string type.
+          Encodings may be appended to the target name and are decoded right to
+          left. e.g. "firmware.delta.deflate"
   
   @param  target Name of OTA target
+  @param  options Additional form fields. "<target>_sha256" sets the expected image hash
   @retval esp_err_t
 */
-OTA::Handle* OTA::construct_handle(const std::string& target)
+OTA::Handle* OTA::construct_handle(const std::string& target, const options_t& options)
 {
+  // Wrap the handle of the base target with a decoder for each encoding
+  size_t separator = target.rfind('.');
+  if (separator != std::string::npos)
+  {
+    std::string encoding = target.substr(separator + 1);
+
+    OTA::Handle* inner = construct_handle(target.substr(0, separator), options);
+    if (inner == nullptr)
+      return nullptr;
+
+    if (encoding.compare("deflate") == 0)
+      return new OTA::InflateHandle(inner);
+
+    // Delta updates patch against the running firmware
+    if (encoding.compare("delta") == 0 && target.compare(0, separator, "firmware") == 0)
+      return new OTA::DeltaHandle(inner, esp_ota_get_running_partition());
+
+    ESP_LOGE(TAG, "Unsupported OTA encoding '%s'.", encoding.c_str());
+    delete inner;
+    return nullptr;
+  }
+
+  OTA::Handle* handle = nullptr;
   if (target.compare("spiffs") == 0)
-    return new OTA::SpiffsHandle();
-  
-  if (target.compare("firmware") == 0)
-    return new OTA::AppHandle();
+    handle = new OTA::SpiffsHandle();
+  else if (target.compare("firmware") == 0)
+    handle = new OTA::AppHandle();
+  else
+    return nullptr;
+
+  // Apply expected hash if provided
+  auto it = options.find(target + "_sha256");
+  if (it != options.end())
+  {
+    uint8_t sha256[32];
+    if (!parse_sha256(it->second, sha256))
+    {
+      ESP_LOGE(TAG, "Invalid SHA-256 '%s' for target '%s'.", it->second.c_str(), target.c_str());
+      delete handle;
+      return nullptr;
+    }
+
+    handle->expect_sha256(sha256);
+  }
 
-  return nullptr;
+  return handle;
 }
 
 /**
@@ -54,21 +212,32 @@ esp_err_t OTA::AppHandle::cleanup()
   }
 
   // Check for non-initalized or error state 
-  if (ota.state != OTA::STATE_IN_PROGRESS)
+  if (get_state() != OTA::STATE_IN_PROGRESS)
   {
-    ota.state = STATE_IDLE;
+    this->writer.abort();
+    set_state(STATE_IDLE);
     return ESP_ERR_INVALID_STATE;
   }
 
-  esp_err_t result = esp_ota_end(this->handle);
+  // Wait for all buffered data to be written
+  esp_err_t result = this->writer.finish();
+  if (result != ESP_OK)
+  {
+    ESP_LOGE(TAG, "OTA writer failed, err=0x%x.", result);
+    esp_ota_end(this->handle);
+    set_state(STATE_IDLE);
+    return result;
+  }
+
+  result = esp_ota_end(this->handle);
   if (result != ESP_OK) 
   {
     ESP_LOGE(TAG, "esp_ota_end failed, err=0x%x.", result);
-    ota.state = STATE_IDLE;
+    set_state(STATE_IDLE);
     return result;
   }
 
-  ota.state = STATE_IDLE;
+  set_state(STATE_IDLE);
 
   return ESP_OK;
 }
@@ -81,15 +250,15 @@ esp_err_t OTA::AppHandle::cleanup()
 */
 esp_err_t OTA::AppHandle::start()
 {
-  // Don't attempt to re-init an ongoing OTA
-  if (ota.state != OTA::STATE_IDLE)
+  // Claim the update so no other upload or pull can start alongside it
+  if (!set_state(OTA::STATE_IDLE, OTA::STATE_IN_PROGRESS))
     return ESP_ERR_INVALID_STATE;
 
   // Check that the active and boot partition are the same otherwise we might be trying to double update
   const esp_partition_t* boot = esp_ota_get_boot_partition();
   const esp_partition_t* active = esp_ota_get_running_partition();
   if (boot != active)
-    return ESP_ERR_INVALID_STATE;
+    return release(ESP_ERR_INVALID_STATE);
 
   ESP_LOGI(TAG, "Boot partition type %d subtype %d at offset 0x%x.", boot->type, boot->subtype, boot->address);
   ESP_LOGI(TAG, "Active partition type %d subtype %d at offset 0x%x.", active->type, active->subtype, active->address);
@@ -97,7 +266,7 @@ esp_err_t OTA::AppHandle::start()
   // Grab next update target
   const esp_partition_t* target = esp_ota_get_next_update_partition(NULL);
   if (target == NULL)
-    return ESP_ERR_NOT_FOUND;
+    return release(ESP_ERR_NOT_FOUND);
 
   ESP_LOGI(TAG, "Target partition type %d subtype %d at offset 0x%x.", target->type, target->subtype, target->address);
 
@@ -105,22 +274,28 @@ esp_err_t OTA::AppHandle::start()
   if (result != ESP_OK)
   {
     ESP_LOGE(TAG, "esp_ota_begin failed, error=0x%x.", result);
-    return result;
+    return release(result);
   }
 
-  // Create a timer that will handle timeout events
-  this->timeout_timer = xTimerCreate("OTATimeout", pdMS_TO_TICKS(5000), false, (void*)this, [](TimerHandle_t t){
-    ESP_LOGW(TAG, "Timeout during update. Performing cleanup...");
-    OTA::Handle* handle = (OTA::Handle*) pvTimerGetTimerID(t);
-    if (handle != nullptr)
-      handle->cleanup();
+  // Start the writer task to program the partition in the background
+  result = this->writer.start([this](const uint8_t* data, size_t length, size_t offset) {
+    return esp_ota_write(this->handle, data, length);
   });
 
+  if (result != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to start OTA writer, error=0x%x.", result);
+    esp_ota_end(this->handle);
+    return release(result);
+  }
+
+  // Create a timer that will handle timeout events
+  this->timeout_timer = xTimerCreate("OTATimeout", pdMS_TO_TICKS(this->timeout_ms), false, (void*)this, timeout);
+
   // Start the timer
   if (xTimerStart(this->timeout_timer, pdMS_TO_TICKS(100)) != pdPASS)
     ESP_LOGE(TAG, "Failed to start timeout timer.");
 
-  ota.state = OTA::STATE_IN_PROGRESS;
   return ESP_OK;
 }
 
@@ -134,14 +309,14 @@ esp_err_t OTA::AppHandle::start()
 esp_err_t OTA::AppHandle::write(uint8_t* data, uint16_t length)
 {
   // Check for non-initialize or error state
-  if (ota.state != OTA::STATE_IN_PROGRESS)
+  if (get_state() != OTA::STATE_IN_PROGRESS)
     return ESP_ERR_INVALID_STATE;
 
-  esp_err_t result = esp_ota_write(this->handle, data, length);
+  esp_err_t result = this->writer.write(data, length);
   if (result != ESP_OK) 
   {
-    ESP_LOGE(TAG, "esp_ota_write failed, err=0x%x.", result);
-    ota.state = OTA::STATE_ERROR;
+    ESP_LOGE(TAG, "OTA write failed, err=0x%x.", result);
+    set_state(OTA::STATE_ERROR);
     return result;
   }
   
@@ -152,6 +327,32 @@ esp_err_t OTA::AppHandle::write(uint8_t* data, uint16_t length)
   return ESP_OK;
 }
 
+/**
+  @brief  Set the SHA-256 the written firmware must match
+  
+  @param  sha256 Expected SHA-256 digest
+  @retval none
+*/
+void OTA::AppHandle::expect_sha256(const uint8_t* sha256)
+{
+  this->writer.expect_sha256(sha256);
+}
+
+/**
+  @brief  Set how long the update may stall before it is cleaned up
+  
+  @param  timeout_ms Timeout in milliseconds
+  @retval none
+*/
+void OTA::AppHandle::set_timeout(uint32_t timeout_ms)
+{
+  this->timeout_ms = timeout_ms;
+
+  // Adjust the running timer. Changing the period also restarts it
+  if (this->timeout_timer != NULL)
+    xTimerChangePeriod(this->timeout_timer, pdMS_TO_TICKS(timeout_ms), pdMS_TO_TICKS(10));
+}
+
 /**
   @brief  Finalize an OTA update. Sets boot partitions and returns callback to reboot
   
@@ -169,12 +370,17 @@ OTA::end_result_t OTA::AppHandle::end()
   if (result.status != ESP_OK) 
     return result;
 
+  // Don't switch partitions unless the image matches the expected hash
+  result.status = this->writer.verify_sha256();
+  if (result.status != ESP_OK) 
+    return result;
+
   const esp_partition_t* target = esp_ota_get_next_update_partition(NULL);
   result.status = esp_ota_set_boot_partition(target);
   if (result.status != ESP_OK) 
   {
     ESP_LOGE(TAG, "esp_ota_set_boot_partition failed, err=0x%x.", result.status);
-    ota.state = STATE_IDLE;
+    set_state(STATE_IDLE);
     return result;
   }
 
@@ -184,7 +390,7 @@ OTA::end_result_t OTA::AppHandle::end()
   // Success. Update status and set reboot callback
   result.status = ESP_OK;
   result.callback = []() {
-    ota.state = OTA::STATE_REBOOT;
+    set_state(OTA::STATE_REBOOT);
     signal_event(MAIN_EVENT_REBOOT);
   };
   
@@ -209,16 +415,20 @@ esp_err_t OTA::SpiffsHandle::cleanup()
   }
 
   // Check for non-initalized or error state 
-  if (ota.state != OTA::STATE_IN_PROGRESS)
+  if (get_state() != OTA::STATE_IN_PROGRESS)
   {
-    ota.state = STATE_IDLE;
+    this->writer.abort();
+    set_state(STATE_IDLE);
     return ESP_ERR_INVALID_STATE;
   }
 
+  // Wait for all buffered data to be written
+  esp_err_t result = this->writer.finish();
+
   // Reset state
-  ota.state = STATE_IDLE;
+  set_state(STATE_IDLE);
 
-  return ESP_OK;
+  return result;
 }
 
 /**
@@ -229,16 +439,18 @@ esp_err_t OTA::SpiffsHandle::cleanup()
 */
 esp_err_t OTA::SpiffsHandle::start()
 {
-  // Don't attempt to re-init an ongoing OTA
-  if (ota.state != OTA::STATE_IDLE)
+  // Claim the update so no other upload or pull can start alongside it
+  if (!set_state(OTA::STATE_IDLE, OTA::STATE_IN_PROGRESS))
     return ESP_ERR_INVALID_STATE;
+
+  this->start_us = esp_timer_get_time();
   
-  // Locate target SPIFFS partition
-  const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+  // Locate target SPIFFS partition. The mounted slot is left untouched
+  const esp_partition_t* part = SPIFFS::get_update_partition();
   if (part == nullptr)
   {
     ESP_LOGE(TAG, "Failed to find SPIFFS partition for update.");
-    return ESP_ERR_NOT_FOUND;
+    return release(ESP_ERR_NOT_FOUND);
   }
 
   ESP_LOGI(TAG, "SPIFFS partition type %d subtype %d at offset 0x%x.", part->type, part->subtype, part->address);
@@ -248,36 +460,63 @@ esp_err_t OTA::SpiffsHandle::start()
   if (part == nullptr)
   {
     ESP_LOGE(TAG, "SPIFFS partition failed verify check.");
-    return ESP_ERR_NOT_FOUND;
+    return release(ESP_ERR_NOT_FOUND);
   }
 
-  // Erase SPIFFS partition
-  esp_err_t result = esp_partition_erase_range(part, 0, part->size);
+  // Save the target partition
+  this->partition = part;
+
+  // Start the writer task to erase and program the partition in the background
+  esp_err_t result = this->writer.start([this](const uint8_t* data, size_t length, size_t offset) {
+    return this->program(data, length, offset);
+  });
+
   if (result != ESP_OK)
   {
-    ESP_LOGE(TAG, "esp_partition_erase_range failed, err=0x%x.", result);
-    return result;
+    ESP_LOGE(TAG, "Failed to start OTA writer, error=0x%x.", result);
+    return release(result);
   }
 
-  // Save the target partition
-  this->partition = part;
-
   // Create a timer that will handle timeout events
-  this->timeout_timer = xTimerCreate("OTATimeout", pdMS_TO_TICKS(5000), false, (void*)this, [](TimerHandle_t t){
-    ESP_LOGW(TAG, "Timeout during update. Performing cleanup...");
-    OTA::Handle* handle = (OTA::Handle*) pvTimerGetTimerID(t);
-    if (handle != nullptr)
-      handle->cleanup();
-  });
+  this->timeout_timer = xTimerCreate("OTATimeout", pdMS_TO_TICKS(this->timeout_ms), false, (void*)this, timeout);
 
   // Start the timer
   if (xTimerStart(this->timeout_timer, pdMS_TO_TICKS(100)) != pdPASS)
     ESP_LOGE(TAG, "Failed to start timeout timer.");
 
-  ota.state = OTA::STATE_IN_PROGRESS;
   return ESP_OK;
 }
 
+/**
+  @brief  Erase and program a block of the SPIFFS partition. Called from the
+          writer task so erase overlaps with network receive. Sectors past
+          the end of the image are never erased.
+  
+  @param  data Data buffer to program
+  @param  length Length of data buffer
+  @param  offset Sector aligned offset into the partition
+  @retval esp_err_t
+*/
+esp_err_t OTA::SpiffsHandle::program(const uint8_t* data, size_t length, size_t offset)
+{
+  assert(offset % SPI_FLASH_SEC_SIZE == 0);
+
+  // Round up to erase the whole sector(s) covered by this block
+  size_t erase_length = ((length + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE) * SPI_FLASH_SEC_SIZE;
+  esp_err_t result = esp_partition_erase_range(this->partition, offset, erase_length);
+  if (result != ESP_OK)
+  {
+    ESP_LOGE(TAG, "esp_partition_erase_range failed, err=0x%x.", result);
+    return result;
+  }
+
+  result = esp_partition_write(this->partition, offset, data, length);
+  if (result != ESP_OK)
+    ESP_LOGE(TAG, "esp_partition_write failed, err=0x%x.", result);
+
+  return result;
+}
+
 /**
   @brief  Write data to the SPIFFS partition during OTA
   
@@ -288,20 +527,18 @@ esp_err_t OTA::SpiffsHandle::start()
 esp_err_t OTA::SpiffsHandle::write(uint8_t* data, uint16_t length)
 {
   // Check for non-initialize or error state
-  if (ota.state != OTA::STATE_IN_PROGRESS)
+  if (get_state() != OTA::STATE_IN_PROGRESS)
     return ESP_ERR_INVALID_STATE;
 
   assert(this->partition);
-  esp_err_t result = esp_partition_write(this->partition, this->written, data, length);
+  esp_err_t result = this->writer.write(data, length);
   if (result != ESP_OK) 
   {
-    ESP_LOGE(TAG, "esp_partition_write failed, err=0x%x.", result);
-    ota.state = OTA::STATE_ERROR;
+    ESP_LOGE(TAG, "OTA write failed, err=0x%x.", result);
+    set_state(OTA::STATE_ERROR);
     return result;
   }
   
-  this->written += length;
-  
   // Reset timeout timer
   if (this->timeout_timer != NULL)
     xTimerReset(this->timeout_timer, pdMS_TO_TICKS(10));
@@ -309,6 +546,32 @@ esp_err_t OTA::SpiffsHandle::write(uint8_t* data, uint16_t length)
   return ESP_OK;
 }
 
+/**
+  @brief  Set the SHA-256 the written SPIFFS image must match
+  
+  @param  sha256 Expected SHA-256 digest
+  @retval none
+*/
+void OTA::SpiffsHandle::expect_sha256(const uint8_t* sha256)
+{
+  this->writer.expect_sha256(sha256);
+}
+
+/**
+  @brief  Set how long the update may stall before it is cleaned up
+  
+  @param  timeout_ms Timeout in milliseconds
+  @retval none
+*/
+void OTA::SpiffsHandle::set_timeout(uint32_t timeout_ms)
+{
+  this->timeout_ms = timeout_ms;
+
+  // Adjust the running timer. Changing the period also restarts it
+  if (this->timeout_timer != NULL)
+    xTimerChangePeriod(this->timeout_timer, pdMS_TO_TICKS(timeout_ms), pdMS_TO_TICKS(10));
+}
+
 /**
   @brief  Finalize an update of the SPIFFS
   
@@ -318,7 +581,29 @@ esp_err_t OTA::SpiffsHandle::write(uint8_t* data, uint16_t length)
 OTA::end_result_t OTA::SpiffsHandle::end()
 {
   OTA::end_result_t result;
+  result.callback = nullptr;
   result.status = cleanup();
+
+  const OTA::Writer::stats_t& stats = this->writer.stats();
+  if (stats.first_write_us != 0)
+  {
+    ESP_LOGI(TAG, "SPIFFS update: first byte accepted after %lld ms, total %lld ms.", 
+              (stats.first_write_us - this->start_us) / 1000, (esp_timer_get_time() - this->start_us) / 1000);
+  }
+
+  if (result.status != ESP_OK)
+    return result;
+
+  // Don't remount unless the image matches the expected hash
+  result.status = this->writer.verify_sha256();
+  if (result.status != ESP_OK)
+    return result;
+
+  // Switch slots only once the image is verified
+  result.status = SPIFFS::set_active_partition(this->partition);
+  if (result.status != ESP_OK)
+    return result;
+
   result.callback =  []() {
     signal_event(MAIN_EVENT_REMOUNT_SPIFFS);
   };
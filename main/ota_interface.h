@@ -6,11 +6,18 @@
 #include "freertos/timers.h"
 
 #include <string>
+#include <map>
+#include <deque>
 #include <functional>
 
+#include "ota_writer.h"
+
 namespace OTA
 {
   typedef std::function<void(void)> end_callback_t;
+
+  // Additional form fields supplied with an update. e.g. firmware_sha256
+  typedef std::map<std::string, std::string> options_t;
   
   struct end_result_t 
   {
@@ -18,6 +25,8 @@ namespace OTA
     end_callback_t callback;
   };
 
+  constexpr uint32_t TIMEOUT_MS = 5000;
+
   class Handle
   {
     public:
@@ -26,6 +35,16 @@ namespace OTA
       virtual end_result_t end(void) = 0;
       virtual esp_err_t cleanup(void) = 0;
 
+      // Set the SHA-256 the final decoded image must match
+      virtual void expect_sha256(const uint8_t* sha256) = 0;
+
+      // Set how long the update may stall before it is cleaned up
+      virtual void set_timeout(uint32_t timeout_ms) = 0;
+
+      // Bytes of the final image passed to the writer, and how many of those are programmed to flash
+      virtual size_t written_bytes(void) const = 0;
+      virtual size_t programmed_bytes(void) const = 0;
+
       virtual ~Handle () {}
   };
 
@@ -38,10 +57,16 @@ namespace OTA
       esp_err_t write(uint8_t* data, uint16_t length);
       end_result_t end(void);
       esp_err_t cleanup(void);
+      void expect_sha256(const uint8_t* sha256);
+      void set_timeout(uint32_t timeout_ms);
+      size_t written_bytes(void) const { return this->writer.written(); }
+      size_t programmed_bytes(void) const { return this->writer.programmed(); }
 
     private:
       TimerHandle_t timeout_timer;
+      uint32_t timeout_ms = TIMEOUT_MS;
       esp_ota_handle_t handle;
+      OTA::Writer writer;
   };
 
   class SpiffsHandle : public Handle
@@ -53,11 +78,174 @@ namespace OTA
       esp_err_t write(uint8_t* data, uint16_t length);
       end_result_t end(void);
       esp_err_t cleanup(void);
+      void expect_sha256(const uint8_t* sha256);
+      void set_timeout(uint32_t timeout_ms);
+      size_t written_bytes(void) const { return this->writer.written(); }
+      size_t programmed_bytes(void) const { return this->writer.programmed(); }
 
     private:
       TimerHandle_t timeout_timer;
-      uint32_t written = 0;
+      uint32_t timeout_ms = TIMEOUT_MS;
       const esp_partition_t* partition = nullptr;
+      OTA::Writer writer;
+      int64_t start_us = 0;
+
+      esp_err_t program(const uint8_t* data, size_t length, size_t offset);
+  };
+
+  /**
+    @brief  Decorator which inflates a raw deflate stream before passing it to
+            the wrapped handle. Uses a small fixed window to bound RAM usage
+  */
+  class InflateHandle : public Handle
+  {
+    public:
+      static constexpr uint32_t WINDOW_BITS = 12; // Must match tools/ota_image.py
+      static constexpr size_t WINDOW_SIZE = 1 << WINDOW_BITS;
+
+      InflateHandle(Handle* inner) : inner(inner) {}
+      ~InflateHandle();
+
+      esp_err_t start(void);
+      esp_err_t write(uint8_t* data, uint16_t length);
+      end_result_t end(void);
+      esp_err_t cleanup(void);
+      void expect_sha256(const uint8_t* sha256);
+      void set_timeout(uint32_t timeout_ms);
+      size_t written_bytes(void) const { return this->inner->written_bytes(); }
+      size_t programmed_bytes(void) const { return this->inner->programmed_bytes(); }
+
+    private:
+      Handle* inner;
+      struct tinfl_decompressor_tag* inflator = nullptr;
+      uint8_t* window = nullptr;
+      size_t window_offset = 0;
+      bool finished = false;
+      size_t bytes_in = 0;
+      size_t bytes_out = 0;
+  };
+
+  /**
+    @brief  Decorator which reconstructs an image from a binary patch against
+            a base partition and passes it to the wrapped handle. The patch is
+            applied on a writer task, since a single op may read, hash or copy
+            the whole base partition
+  */
+  class DeltaHandle : public Handle
+  {
+    public:
+      static constexpr uint32_t MAGIC = 0x31445045; // "EPD1"
+      static constexpr size_t HEADER_SIZE = 76;
+      static constexpr size_t OP_SIZE = 9;
+      static constexpr size_t COPY_CHUNK_SIZE = 1024;
+
+      typedef enum
+      {
+        OP_COPY = 0x01,   // Copy a range of the base image
+        OP_INSERT = 0x02, // Insert literal data following the op
+      } OP;
+
+      DeltaHandle(Handle* inner, const esp_partition_t* base) : inner(inner), base(base) {}
+      ~DeltaHandle();
+
+      esp_err_t start(void);
+      esp_err_t write(uint8_t* data, uint16_t length);
+      end_result_t end(void);
+      esp_err_t cleanup(void);
+      void expect_sha256(const uint8_t* sha256);
+      void set_timeout(uint32_t timeout_ms);
+
+      // Counted in patch bytes, as the image lags behind the patch on the writer task
+      size_t written_bytes(void) const { return this->patch.written(); }
+      size_t programmed_bytes(void) const;
+
+    private:
+      typedef enum
+      {
+        PARSE_HEADER,
+        PARSE_OP,
+        PARSE_INSERT,
+      } PARSE_STATE;
+
+      struct checkpoint_t
+      {
+        size_t offset;  // Patch offset at the end of an applied block
+        size_t written; // Image bytes written once it was applied
+      };
+
+      Handle* inner;
+      const esp_partition_t* base;
+      uint8_t* buffer = nullptr;
+
+      OTA::Writer patch;              // Applies the patch on its task
+      volatile bool aborted = false;  // Stops the op being applied
+
+      SemaphoreHandle_t mutex = NULL; // Guards the checkpoints
+      mutable std::deque<checkpoint_t> checkpoints; // Blocks not yet known to be programmed
+      mutable size_t offset = 0;      // Patch bytes programmed to flash
+
+      PARSE_STATE state = PARSE_HEADER;
+      uint8_t header[HEADER_SIZE];
+      size_t header_length = 0;
+
+      uint32_t base_size = 0;
+      uint32_t target_size = 0;
+      uint8_t target_sha256[32];
+
+      size_t insert_remaining = 0;
+      size_t written = 0;
+      size_t copied_bytes = 0;
+      int64_t start_us = 0;
+
+      esp_err_t apply(const uint8_t* data, size_t length, size_t offset);
+      esp_err_t parse_header(void);
+      esp_err_t parse_op(void);
+      esp_err_t verify_base(const uint8_t* expected_sha256);
+      esp_err_t copy(uint32_t offset, uint32_t length);
+      esp_err_t emit(uint8_t* data, size_t length);
+  };
+
+  /**
+    @brief  Decorator which tracks the image identity and the offset into the
+            upload whose data is programmed to flash. An interrupted upload 
+            can continue from this offset on a new connection without erasing 
+            anything. Data resent that was already buffered is dropped
+  */
+  class ResumableHandle : public Handle
+  {
+    public:
+      static constexpr uint32_t RESUME_TIMEOUT_MS = 60000;
+
+      ResumableHandle(Handle* inner, const std::string& target, const std::string& id);
+      ~ResumableHandle() { delete inner; }
+
+      esp_err_t start(void);
+      esp_err_t write(uint8_t* data, uint16_t length);
+      end_result_t end(void);
+      esp_err_t cleanup(void);
+      void expect_sha256(const uint8_t* sha256);
+      void set_timeout(uint32_t timeout_ms);
+      size_t written_bytes(void) const { return this->inner->written_bytes(); }
+      size_t programmed_bytes(void) const { return this->inner->programmed_bytes(); }
+
+      bool matches(const std::string& target, const std::string& id) const;
+      size_t committed(void);
+      bool resume(size_t offset);
+
+    private:
+      struct checkpoint_t
+      {
+        size_t offset;  // Upload offset at the end of a write
+        size_t written; // Image bytes written once it was accepted
+      };
+
+      Handle* inner;
+      std::string target;
+      std::string id;
+      size_t accepted = 0; // Upload bytes accepted by the wrapped handle
+      size_t offset = 0;   // Upload bytes programmed to flash
+      size_t skip = 0;     // Resent bytes to drop before accepting more
+      std::deque<checkpoint_t> checkpoints; // Writes not yet known to be programmed
   };
 
   typedef enum
@@ -66,9 +254,11 @@ namespace OTA
     STATE_IN_PROGRESS,
     STATE_REBOOT,
     STATE_ERROR,
+    STATE_TIMEOUT, // Stalled. Writes fail until the handle is cleaned up
   } STATE;
 
-  OTA::Handle* construct_handle(const std::string& target);
+  OTA::Handle* construct_handle(const std::string& target, const options_t& options = options_t());
+  bool timed_out(void);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,315 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_http_client.h"
+
+#include <string>
+#include <vector>
+
+#include "ota_interface.h"
+#include "ota_pull.h"
+#include "http.h"
+#include "nlohmann/json.hpp"
+
+#define TAG "OTA"
+
+static constexpr size_t PULL_BUFFER_SIZE = 1024;
+static constexpr uint32_t PULL_PROGRESS_INTERVAL_MS = 250;
+static constexpr uint32_t PULL_CALLBACK_DELAY_MS = 1000;
+
+struct pull_request_t
+{
+  std::vector<std::pair<std::string, std::string>> images; // Target, URL
+  OTA::options_t options;
+};
+
+static struct
+{
+  SemaphoreHandle_t mutex;
+  OTA::pull_status_t status;
+} puller = {
+  .mutex = NULL,
+  .status = { .state = OTA::PULL_IDLE, .target = "", .received = 0, .total = -1, .message = "" },
+};
+
+/**
+  @brief  Create the status mutex. Must be called before the HTTP task starts
+  
+  @param  none
+  @retval none
+*/
+void OTA::init_pull()
+{
+  puller.mutex = xSemaphoreCreateMutex();
+  if (puller.mutex == NULL)
+    ESP_LOGE(TAG, "Failed to create OTA pull mutex.");
+}
+
+/**
+  @brief  Update the shared pull status and notify websocket clients
+  
+  @param  update Function that modifies the status
+  @retval none
+*/
+template<typename F> static void update_status(F update)
+{
+  xSemaphoreTake(puller.mutex, portMAX_DELAY);
+  update(puller.status);
+  xSemaphoreGive(puller.mutex);
+
+  HTTP::push_status();
+}
+
+/**
+  @brief  Download a single image and stream it through an OTA handle
+  
+  @param  target OTA target name
+  @param  url URL to fetch image from
+  @param  options Additional options for the OTA handle
+  @param  callback Output for the callback returned by the handle
+  @retval esp_err_t
+*/
+static esp_err_t pull_image(const std::string& target, const std::string& url, const OTA::options_t& options, OTA::end_callback_t& callback)
+{
+  OTA::Handle* ota = OTA::construct_handle(target, options);
+  if (ota == nullptr)
+  {
+    ESP_LOGE(TAG, "Failed to construct OTA handle for target '%s'.", target.c_str());
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  esp_http_client_config_t config = {};
+  config.url = url.c_str();
+  config.timeout_ms = 5000;
+
+  esp_http_client_handle_t client = esp_http_client_init(&config);
+  if (client == NULL)
+  {
+    delete ota;
+    return ESP_ERR_NO_MEM;
+  }
+
+  char* buffer = new char[PULL_BUFFER_SIZE];
+  esp_err_t result = esp_http_client_open(client, 0);
+  if (result != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to connect to '%s'. Error: %s", url.c_str(), esp_err_to_name(result));
+    goto exit;
+  }
+
+  {
+    int32_t length = esp_http_client_fetch_headers(client);
+    int status_code = esp_http_client_get_status_code(client);
+    if (status_code != 200)
+    {
+      ESP_LOGE(TAG, "Failed to fetch '%s'. HTTP status %d", url.c_str(), status_code);
+      result = ESP_ERR_NOT_FOUND;
+      goto exit;
+    }
+
+    update_status([&](OTA::pull_status_t& s) { s.target = target; s.received = 0; s.total = (length > 0) ? length : -1; });
+
+    result = ota->start();
+    if (result != ESP_OK)
+    {
+      ESP_LOGE(TAG, "Failed to start OTA. Error: %s", esp_err_to_name(result));
+      goto exit;
+    }
+
+    ESP_LOGI(TAG, "Pulling %s OTA from '%s'...", target.c_str(), url.c_str());
+
+    size_t received = 0;
+    TickType_t last_update = xTaskGetTickCount();
+    while (true)
+    {
+      int count = esp_http_client_read(client, buffer, PULL_BUFFER_SIZE);
+      if (count < 0)
+      {
+        ESP_LOGE(TAG, "Failed to read from '%s'.", url.c_str());
+        result = ESP_FAIL;
+        break;
+      }
+
+      if (count == 0)
+        break;
+
+      result = ota->write((uint8_t*) buffer, count);
+      if (result != ESP_OK)
+        break;
+
+      received += count;
+
+      // Rate limit progress updates
+      if (xTaskGetTickCount() - last_update >= pdMS_TO_TICKS(PULL_PROGRESS_INTERVAL_MS))
+      {
+        last_update = xTaskGetTickCount();
+        update_status([&](OTA::pull_status_t& s) { s.received = received; });
+      }
+    }
+
+    if (result == ESP_OK && !esp_http_client_is_complete_data_received(client))
+    {
+      ESP_LOGE(TAG, "Connection closed before '%s' was received.", url.c_str());
+      result = ESP_ERR_INVALID_SIZE;
+    }
+
+    update_status([&](OTA::pull_status_t& s) { s.received = received; });
+
+    if (result != ESP_OK)
+    {
+      ota->cleanup();
+      goto exit;
+    }
+
+    // Finalize the update and save the callback to run once all images are done
+    OTA::end_result_t end = ota->end();
+    result = end.status;
+    callback = end.callback;
+  }
+
+exit:
+  delete[] buffer;
+  esp_http_client_close(client);
+  esp_http_client_cleanup(client);
+  delete ota;
+
+  return result;
+}
+
+/**
+  @brief  Task function which pulls each requested image in turn
+  
+  @param  pvParameters Pointer to pull_request_t. Task takes ownership
+  @retval none
+*/
+static void pull_task(void* pvParameters)
+{
+  pull_request_t* request = (pull_request_t*) pvParameters;
+
+  std::vector<OTA::end_callback_t> callbacks;
+  esp_err_t result = ESP_OK;
+  for (auto& image : request->images)
+  {
+    OTA::end_callback_t callback = nullptr;
+    result = pull_image(image.first, image.second, request->options, callback);
+    if (result != ESP_OK)
+    {
+      std::string message = "Failed to update " + image.first + ". Error: " + esp_err_to_name(result);
+      update_status([&](OTA::pull_status_t& s) { s.state = OTA::PULL_FAILED; s.message = message; });
+      break;
+    }
+
+    callbacks.push_back(callback);
+  }
+
+  delete request;
+
+  if (result == ESP_OK)
+  {
+    update_status([](OTA::pull_status_t& s) { s.state = OTA::PULL_COMPLETE; s.message = "Update successful."; });
+
+    // Give clients a moment to receive the final status before rebooting
+    vTaskDelay(pdMS_TO_TICKS(PULL_CALLBACK_DELAY_MS));
+  }
+
+  // Fire callbacks of the successfully updated images
+  for (auto& callback : callbacks)
+  {
+    if (callback)
+      callback();
+  }
+
+  vTaskDelete(NULL);
+}
+
+/**
+  @brief  Start pulling firmware and/or SPIFFS images from a server. 
+          Request is a JSON object mapping OTA targets to URLs and may contain 
+          additional options. e.g. 
+          {"firmware.deflate": "http://host/esp-led-control.bin.deflate", "firmware_sha256": "..."}
+  
+  @param  jRequest JSON string of the pull request
+  @retval esp_err_t
+*/
+esp_err_t OTA::pull(const std::string& jRequest)
+{
+  nlohmann::json root = nlohmann::json::parse(jRequest, nullptr, false);
+  if (root.is_discarded() || !root.is_object())
+  {
+    ESP_LOGE(TAG, "Invalid pull request JSON: %s", jRequest.c_str());
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  pull_request_t* request = new pull_request_t();
+  for (auto& kv : root.items())
+  {
+    if (!kv.value().is_string())
+      continue;
+
+    const std::string& key = kv.key();
+    std::string value = kv.value().get<std::string>();
+
+    // Strings with a URL scheme are images, anything else is an option
+    if (value.compare(0, 7, "http://") == 0 || value.compare(0, 8, "https://") == 0)
+    {
+      // Update SPIFFS first so the new UI is in place when the firmware reboots
+      if (key.compare(0, 6, "spiffs") == 0)
+        request->images.insert(request->images.begin(), std::make_pair(key, value));
+      else
+        request->images.push_back(std::make_pair(key, value));
+    }
+    else
+      request->options[key] = value;
+  }
+
+  if (request->images.empty())
+  {
+    delete request;
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  if (puller.mutex == NULL)
+  {
+    delete request;
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  // Only one pull at a time
+  xSemaphoreTake(puller.mutex, portMAX_DELAY);
+  bool busy = (puller.status.state == OTA::PULL_IN_PROGRESS);
+  if (!busy)
+    puller.status = { .state = OTA::PULL_IN_PROGRESS, .target = "", .received = 0, .total = -1, .message = "" };
+  xSemaphoreGive(puller.mutex);
+
+  if (busy)
+  {
+    delete request;
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if (xTaskCreate(pull_task, "OTAPull", 6144, request, 1, NULL) != pdPASS)
+  {
+    ESP_LOGE(TAG, "Failed to create OTA pull task.");
+    update_status([](OTA::pull_status_t& s) { s.state = OTA::PULL_FAILED; s.message = "Failed to start update."; });
+    delete request;
+    return ESP_ERR_NO_MEM;
+  }
+
+  return ESP_OK;
+}
+
+/**
+  @brief  Fetch a copy of the current pull status
+  
+  @param  none
+  @retval OTA::pull_status_t
+*/
+OTA::pull_status_t OTA::get_pull_status()
+{
+  xSemaphoreTake(puller.mutex, portMAX_DELAY);
+  OTA::pull_status_t status = puller.status;
+  xSemaphoreGive(puller.mutex);
+
+  return status;
+}
\ No newline at end of file
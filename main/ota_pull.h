@@ -0,0 +1,32 @@
+#ifndef __OTA_PULL_H__
+#define __OTA_PULL_H__
+
+#include "esp_err.h"
+
+#include <string>
+
+namespace OTA
+{
+  typedef enum
+  {
+    PULL_IDLE,
+    PULL_IN_PROGRESS,
+    PULL_COMPLETE,
+    PULL_FAILED,
+  } PULL_STATE;
+
+  struct pull_status_t
+  {
+    PULL_STATE state;
+    std::string target;
+    size_t received;
+    int32_t total; // -1 if unknown
+    std::string message;
+  };
+
+  void init_pull(void);
+  esp_err_t pull(const std::string& jRequest);
+  pull_status_t get_pull_status(void);
+};
+
+#endif
\ No newline at end of file
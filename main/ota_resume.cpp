@@ -0,0 +1,160 @@
+#include "esp_log.h"
+
+#include <algorithm>
+#include <string>
+
+#include "ota_interface.h"
+
+#define TAG "OTA"
+
+/**
+  @brief  Wrap a handle so the upload may be resumed after a disconnect. 
+          Extends the timeout of the wrapped handle to give the client time 
+          to reconnect
+  
+  @param  inner Handle to wrap. Takes ownership
+  @param  target Name of OTA target including any encodings
+  @param  id Identity of the image being uploaded. e.g. its SHA-256
+  @retval none
+*/
+OTA::ResumableHandle::ResumableHandle(Handle* inner, const std::string& target, const std::string& id) : inner(inner), target(target), id(id)
+{
+  this->inner->set_timeout(RESUME_TIMEOUT_MS);
+}
+
+/**
+  @brief  Start the wrapped handle
+  
+  @param  none
+  @retval esp_err_t
+*/
+esp_err_t OTA::ResumableHandle::start()
+{
+  this->accepted = 0;
+  this->offset = 0;
+  this->skip = 0;
+  this->checkpoints.clear();
+
+  return this->inner->start();
+}
+
+/**
+  @brief  Write data to the wrapped handle. Data resent after a resume which 
+          the handle already accepted is dropped
+  
+  @param  data Data buffer to write to handle
+  @param  length Length of data buffer
+  @retval esp_err_t
+*/
+esp_err_t OTA::ResumableHandle::write(uint8_t* data, uint16_t length)
+{
+  uint16_t skip = std::min<size_t>(this->skip, length);
+  this->skip -= skip;
+
+  data += skip;
+  length -= skip;
+  if (length == 0)
+    return ESP_OK;
+
+  esp_err_t result = this->inner->write(data, length);
+  if (result != ESP_OK)
+    return result;
+
+  // Data is only committed once the image written up to here is programmed
+  this->accepted += length;
+  this->checkpoints.push_back({this->accepted, this->inner->written_bytes()});
+
+  committed();
+  return ESP_OK;
+}
+
+/**
+  @brief  Get the offset into the upload whose data is programmed to flash
+  
+  @param  none
+  @retval size_t
+*/
+size_t OTA::ResumableHandle::committed()
+{
+  size_t programmed = this->inner->programmed_bytes();
+  while (!this->checkpoints.empty() && this->checkpoints.front().written <= programmed)
+  {
+    this->offset = this->checkpoints.front().offset;
+    this->checkpoints.pop_front();
+  }
+
+  return this->offset;
+}
+
+/**
+  @brief  Continue the upload from an offset reported by committed(). Data 
+          between the offset and what was accepted is dropped when resent
+  
+  @param  offset Offset the client resumes from
+  @retval bool - Offset can be resumed from
+*/
+bool OTA::ResumableHandle::resume(size_t offset)
+{
+  if (offset > this->accepted)
+    return false;
+
+  this->skip = this->accepted - offset;
+  return true;
+}
+
+/**
+  @brief  Finalize the wrapped handle
+  
+  @param  none
+  @retval OTA::end_result_t
+*/
+OTA::end_result_t OTA::ResumableHandle::end()
+{
+  ESP_LOGI(TAG, "Ending %s OTA at offset %u.", this->target.c_str(), (unsigned) this->accepted);
+  return this->inner->end();
+}
+
+/**
+  @brief  Clean up the wrapped handle
+  
+  @param  none
+  @retval esp_err_t
+*/
+esp_err_t OTA::ResumableHandle::cleanup()
+{
+  return this->inner->cleanup();
+}
+
+/**
+  @brief  Pass the expected hash of the decoded image to the wrapped handle
+  
+  @param  sha256 Expected SHA-256 digest
+  @retval none
+*/
+void OTA::ResumableHandle::expect_sha256(const uint8_t* sha256)
+{
+  this->inner->expect_sha256(sha256);
+}
+
+/**
+  @brief  Pass the stall timeout to the wrapped handle
+  
+  @param  timeout_ms Timeout in milliseconds
+  @retval none
+*/
+void OTA::ResumableHandle::set_timeout(uint32_t timeout_ms)
+{
+  this->inner->set_timeout(timeout_ms);
+}
+
+/**
+  @brief  Check if this handle is receiving the given image
+  
+  @param  target Name of OTA target including any encodings
+  @param  id Identity of the image
+  @retval bool
+*/
+bool OTA::ResumableHandle::matches(const std::string& target, const std::string& id) const
+{
+  return !id.empty() && this->target.compare(target) == 0 && this->id.compare(id) == 0;
+}
\ No newline at end of file
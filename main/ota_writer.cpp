@@ -0,0 +1,328 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "ota_writer.h"
+
+#define TAG "OTA"
+
+/**
+  @brief  Task function which programs queued blocks until a null block is received
+  
+  @param  pvParameters Pointer to the OTA::Writer object
+  @retval none
+*/
+void OTA::Writer::task(void* pvParameters)
+{
+  OTA::Writer* writer = (OTA::Writer*) pvParameters;
+
+  block_t* block = nullptr;
+  while (xQueueReceive(writer->full_blocks, &block, portMAX_DELAY) == pdTRUE)
+  {
+    // Null block signals the end of the stream
+    if (block == nullptr)
+      break;
+
+    // Keep draining after an error so the receiver never blocks forever
+    if (writer->error == ESP_OK)
+    {
+      int64_t begin = esp_timer_get_time();
+
+      // Hash here so it overlaps with receive instead of adding to the end
+      mbedtls_sha256_update_ret(&writer->sha256_context, block->data, block->length);
+
+      esp_err_t result = writer->program(block->data, block->length, block->offset);
+      writer->_stats.program_us += esp_timer_get_time() - begin;
+
+      if (result != ESP_OK)
+      {
+        ESP_LOGE(TAG, "Failed to program block at offset 0x%x, err=0x%x.", (unsigned) block->offset, result);
+        writer->error = result;
+      }
+      else
+        writer->_programmed += block->length;
+    }
+
+    // Return block to the pool
+    block->length = 0;
+    xQueueSend(writer->free_blocks, &block, portMAX_DELAY);
+  }
+
+  mbedtls_sha256_finish_ret(&writer->sha256_context, writer->sha256);
+  mbedtls_sha256_free(&writer->sha256_context);
+
+  xSemaphoreGive(writer->done);
+  vTaskDelete(NULL);
+}
+
+OTA::Writer::~Writer()
+{
+  if (this->task_running)
+    abort();
+
+  release();
+}
+
+/**
+  @brief  Allocate block buffers and start the writer task
+  
+  @param  program Function that programs a block to flash
+  @param  block_timeout Ticks to wait for a free block before failing a write
+  @retval esp_err_t
+*/
+esp_err_t OTA::Writer::start(program_t program, TickType_t block_timeout)
+{
+  if (this->task_running)
+    return ESP_ERR_INVALID_STATE;
+
+  this->program = program;
+  this->block_timeout = block_timeout;
+  this->current = nullptr;
+  this->offset = 0;
+  this->error = ESP_OK;
+  this->_programmed = 0;
+
+  memset(&this->_stats, 0, sizeof(this->_stats));
+  this->_stats.start_us = esp_timer_get_time();
+
+  this->free_blocks = xQueueCreate(BLOCK_COUNT, sizeof(block_t*));
+  this->full_blocks = xQueueCreate(BLOCK_COUNT + 1, sizeof(block_t*)); // Room for the null terminator
+  this->done = xSemaphoreCreateBinary();
+  if (this->free_blocks == NULL || this->full_blocks == NULL || this->done == NULL)
+  {
+    release();
+    return ESP_ERR_NO_MEM;
+  }
+
+  for (block_t& block : this->blocks)
+  {
+    block.data = (uint8_t*) heap_caps_malloc(BLOCK_SIZE, MALLOC_CAP_8BIT);
+    block.length = 0;
+    block.offset = 0;
+
+    if (block.data == nullptr)
+    {
+      ESP_LOGE(TAG, "Failed to allocate OTA block buffers.");
+      release();
+      return ESP_ERR_NO_MEM;
+    }
+
+    block_t* pointer = &block;
+    xQueueSend(this->free_blocks, &pointer, 0);
+  }
+
+  // Only set up the hash once nothing else can fail before the task owns it
+  memset(this->sha256, 0, sizeof(this->sha256));
+  mbedtls_sha256_init(&this->sha256_context);
+  mbedtls_sha256_starts_ret(&this->sha256_context, 0);
+
+  if (xTaskCreate(OTA::Writer::task, "OTAWriter", 4096, this, 2, NULL) != pdPASS)
+  {
+    ESP_LOGE(TAG, "Failed to create OTA writer task.");
+    mbedtls_sha256_free(&this->sha256_context);
+    release();
+    return ESP_ERR_NO_MEM;
+  }
+
+  this->task_running = true;
+  return ESP_OK;
+}
+
+/**
+  @brief  Copy data into the current block and queue full blocks to the writer.
+          Only blocks when every block is waiting to be programmed.
+  
+  @param  data Data buffer to write
+  @param  length Length of data buffer
+  @retval esp_err_t - First error reported by the writer task
+*/
+esp_err_t OTA::Writer::write(const uint8_t* data, size_t length)
+{
+  if (!this->task_running)
+    return ESP_ERR_INVALID_STATE;
+
+  while (length > 0)
+  {
+    if (this->error != ESP_OK)
+      return this->error;
+
+    // Grab a free block, waiting on the writer if needed
+    if (this->current == nullptr)
+    {
+      int64_t begin = esp_timer_get_time();
+      if (xQueueReceive(this->free_blocks, &this->current, this->block_timeout) != pdTRUE)
+      {
+        ESP_LOGE(TAG, "Timeout waiting for free OTA block.");
+        return ESP_ERR_TIMEOUT;
+      }
+      this->_stats.stall_us += esp_timer_get_time() - begin;
+
+      this->current->offset = this->offset;
+      this->current->length = 0;
+    }
+
+    size_t count = std::min(length, BLOCK_SIZE - this->current->length);
+    memcpy(this->current->data + this->current->length, data, count);
+
+    this->current->length += count;
+    this->offset += count;
+    this->_stats.bytes += count;
+
+    data += count;
+    length -= count;
+
+    if (this->_stats.first_write_us == 0)
+      this->_stats.first_write_us = esp_timer_get_time();
+
+    // Queue the block once a full sector is buffered
+    if (this->current->length == BLOCK_SIZE)
+    {
+      xQueueSend(this->full_blocks, &this->current, portMAX_DELAY);
+      this->current = nullptr;
+    }
+  }
+
+  return this->error;
+}
+
+/**
+  @brief  Queue any partial block, wait for all blocks to be programmed and 
+          stop the writer task
+  
+  @param  none
+  @retval esp_err_t - First error reported by the writer task
+*/
+esp_err_t OTA::Writer::finish()
+{
+  if (!this->task_running)
+    return ESP_ERR_INVALID_STATE;
+
+  // Queue the partial block
+  if (this->current != nullptr && this->current->length > 0)
+  {
+    xQueueSend(this->full_blocks, &this->current, portMAX_DELAY);
+    this->current = nullptr;
+  }
+
+  esp_err_t result = drain();
+
+  const stats_t& s = this->_stats;
+  double seconds = s.total_us / 1e6;
+  ESP_LOGI(TAG, "Wrote %u bytes in %.2f s (%.1f KB/s). Flash busy %lld ms, receive stalled %lld ms.",
+            (unsigned) s.bytes, seconds, (seconds > 0) ? (s.bytes / 1024.0) / seconds : 0.0, (long long) s.program_us / 1000, (long long) s.stall_us / 1000);
+
+  return result;
+}
+
+/**
+  @brief  Discard any buffered data and stop the writer task
+  
+  @param  none
+  @retval none
+*/
+void OTA::Writer::abort()
+{
+  if (!this->task_running)
+    return;
+
+  // Prevent any queued blocks from being programmed
+  if (this->error == ESP_OK)
+    this->error = ESP_FAIL;
+
+  this->current = nullptr;
+
+  drain();
+}
+
+/**
+  @brief  Set the expected SHA-256 of the written image
+  
+  @param  sha256 Expected SHA-256 digest
+  @retval none
+*/
+void OTA::Writer::expect_sha256(const uint8_t* sha256)
+{
+  memcpy(this->expected_sha256, sha256, sizeof(this->expected_sha256));
+  this->sha256_expected = true;
+}
+
+/**
+  @brief  Compare the hash of the written image against the expected hash.
+          Only valid after finish().
+  
+  @param  none
+  @retval esp_err_t - ESP_OK if matched or no hash was expected
+*/
+esp_err_t OTA::Writer::verify_sha256() const
+{
+  if (!this->sha256_expected)
+    return ESP_OK;
+
+  if (memcmp(this->sha256, this->expected_sha256, sizeof(this->sha256)) != 0)
+  {
+    ESP_LOGE(TAG, "Image SHA-256 mismatch.");
+    return ESP_ERR_INVALID_CRC;
+  }
+
+  ESP_LOGI(TAG, "Image SHA-256 verified.");
+  return ESP_OK;
+}
+
+/**
+  @brief  Signal the end of the stream and wait for the writer task to exit
+  
+  @param  none
+  @retval esp_err_t - First error reported by the writer task
+*/
+esp_err_t OTA::Writer::drain()
+{
+  block_t* terminator = nullptr;
+  xQueueSend(this->full_blocks, &terminator, portMAX_DELAY);
+  xSemaphoreTake(this->done, portMAX_DELAY);
+
+  this->task_running = false;
+  this->_stats.total_us = esp_timer_get_time() - this->_stats.start_us;
+
+  esp_err_t result = this->error;
+
+  release();
+
+  return result;
+}
+
+/**
+  @brief  Free block buffers and queues
+  
+  @param  none
+  @retval none
+*/
+void OTA::Writer::release()
+{
+  for (block_t& block : this->blocks)
+  {
+    if (block.data != nullptr)
+      heap_caps_free(block.data);
+
+    block.data = nullptr;
+  }
+
+  if (this->free_blocks != NULL)
+    vQueueDelete(this->free_blocks);
+
+  if (this->full_blocks != NULL)
+    vQueueDelete(this->full_blocks);
+
+  if (this->done != NULL)
+    vSemaphoreDelete(this->done);
+
+  this->free_blocks = NULL;
+  this->full_blocks = NULL;
+  this->done = NULL;
+}
\ No newline at end of file
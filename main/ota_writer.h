@@ -0,0 +1,89 @@
+#ifndef __OTA_WRITER_H__
+#define __OTA_WRITER_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+#include "mbedtls/sha256.h"
+
+#include <functional>
+
+namespace OTA
+{
+  /**
+    @brief  Coalesces incoming OTA data into sector sized blocks and programs
+            them from a dedicated task so network receive and flash writes overlap
+  */
+  class Writer
+  {
+    public:
+      // Programs a block of data at the given offset into the image
+      typedef std::function<esp_err_t(const uint8_t* data, size_t length, size_t offset)> program_t;
+
+      static constexpr size_t BLOCK_SIZE = 4096; // Flash sector size
+      static constexpr size_t BLOCK_COUNT = 4;
+      static constexpr uint32_t BLOCK_TIMEOUT_MS = 5000;
+
+      struct stats_t
+      {
+        size_t bytes;
+        int64_t start_us;
+        int64_t first_write_us; // Time the first data was accepted
+        int64_t total_us;
+        int64_t program_us; // Time the writer task spent hashing and programming flash
+        int64_t stall_us;   // Time the receiver waited for a free block
+      };
+
+      Writer() {}
+      ~Writer();
+
+      esp_err_t start(program_t program, TickType_t block_timeout = pdMS_TO_TICKS(BLOCK_TIMEOUT_MS));
+      esp_err_t write(const uint8_t* data, size_t length);
+      esp_err_t finish(void);
+      void abort(void);
+
+      void expect_sha256(const uint8_t* sha256);
+      esp_err_t verify_sha256(void) const;
+
+      bool running(void) const { return this->task_running; }
+      size_t written(void) const { return this->offset; }
+      size_t programmed(void) const { return this->_programmed; }
+      const stats_t& stats(void) const { return this->_stats; }
+
+    private:
+      struct block_t
+      {
+        uint8_t* data;
+        size_t length;
+        size_t offset;
+      };
+
+      program_t program;
+      TickType_t block_timeout;
+      block_t blocks[BLOCK_COUNT] = {};
+      block_t* current = nullptr;
+      size_t offset = 0;
+
+      QueueHandle_t free_blocks = NULL;
+      QueueHandle_t full_blocks = NULL;
+      SemaphoreHandle_t done = NULL;
+      bool task_running = false;
+      volatile esp_err_t error = ESP_OK;
+      volatile size_t _programmed = 0; // Bytes the writer task has programmed
+
+      // Running hash of all programmed data
+      mbedtls_sha256_context sha256_context;
+      uint8_t sha256[32];
+      uint8_t expected_sha256[32];
+      bool sha256_expected = false;
+
+      stats_t _stats;
+
+      static void task(void* pvParameters);
+      esp_err_t drain(void);
+      void release(void);
+  };
+};
+
+#endif
\ No newline at end of file
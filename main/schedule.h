@@ -5,10 +5,18 @@
 #include <list>
 #include <string>
 #include <map>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <time.h>
 
+#include "sdkconfig.h"
 #include "driver/ledc.h"
 #include "driver/gpio.h"
 
+#include "intensity.h"
+#include "local_time.h"
+
 typedef struct timer_config_t
 {
   ledc_timer_t id;
@@ -28,7 +36,9 @@ typedef struct channel_config_t
   ledc_timer_t timer;
   gpio_num_t gpio;
   bool enabled;
+  float watts; // Draw at full intensity for the power budget
 
+  // Compares the hardware configuration. Power doesn't require reconfiguring the channel
   bool operator==(const channel_config_t& other) const 
   {
     return (id == other.id) && (timer == other.timer) && (gpio == other.gpio) && (enabled == other.enabled);
@@ -37,25 +47,134 @@ typedef struct channel_config_t
   bool operator!=(const channel_config_t& other) const { return !(*this == other); }
 } channel_config_t;
 
-class Schedule
+typedef struct channel_usage_t
+{
+  uint64_t energy_uJ; // Estimated energy from duty and the configured wattage
+  uint64_t on_ms;     // Time with a non-zero duty
+} channel_usage_t;
+
+// Channels the schedule and LEDC state are built for
+constexpr size_t LED_CHANNEL_COUNT = CONFIG_LED_CHANNEL_COUNT;
+static_assert(LED_CHANNEL_COUNT <= LEDC_CHANNEL_MAX, "More channels than the LEDC peripheral has");
+
+/**
+  @brief  Intensities of a schedule row for a fixed number of channels, with 
+          a bit per channel marking which are set
+*/
+template <size_t CHANNELS>
+class ScheduleEntry
+{
+  static_assert(CHANNELS <= 32, "Presence mask holds 32 channels");
+
+  public:
+    typedef ledc_channel_t led_channel_t;
+    typedef Intensity::intensity_t led_intensity_t;
+
+    // Yields (channel, intensity) pairs of the channels present
+    class const_iterator
+    {
+      public:
+        const_iterator(const ScheduleEntry* entry, size_t index) : entry(entry), index(index) { skip(); }
+
+        std::pair<led_channel_t, led_intensity_t> operator*() const
+        {
+          return {(led_channel_t) index, entry->get((led_channel_t) index)};
+        }
+
+        const_iterator& operator++()
+        {
+          index++;
+          skip();
+          return *this;
+        }
+
+        bool operator!=(const const_iterator& other) const { return index != other.index; }
+
+      private:
+        const ScheduleEntry* entry;
+        size_t index;
+
+        void skip()
+        {
+          while (index < CHANNELS && !entry->contains((led_channel_t) index))
+            index++;
+        }
+    };
+
+    void set(led_channel_t channel, led_intensity_t intensity)
+    {
+      if (channel >= CHANNELS)
+        return;
+
+      intensities[channel] = intensity;
+      mask |= 1u << channel;
+    }
+
+    void clear(led_channel_t channel)
+    {
+      if (channel < CHANNELS)
+        mask &= ~(1u << channel);
+    }
+
+    led_intensity_t get(led_channel_t channel) const
+    {
+      return intensities[channel];
+    }
+
+    bool contains(led_channel_t channel) const
+    {
+      return channel < CHANNELS && (mask & (1u << channel));
+    }
+
+    size_t size() const { return __builtin_popcount(mask); }
+    bool empty() const { return mask == 0; }
+
+    // Compares the channels present and their intensities
+    bool operator==(const ScheduleEntry& other) const
+    {
+      if (mask != other.mask)
+        return false;
+
+      for (auto pair : *this)
+      {
+        if (other.get(pair.first) != pair.second)
+          return false;
+      }
+
+      return true;
+    }
+
+    bool operator!=(const ScheduleEntry& other) const { return !(*this == other); }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, CHANNELS); }
+
+  private:
+    std::array<led_intensity_t, CHANNELS> intensities = {};
+    uint32_t mask = 0;
+};
+
+template <size_t CHANNELS>
+class BasicSchedule
 {
   public:
     // Typedef some names for LED usage
     typedef ledc_channel_t led_channel_t;
-    typedef float led_intensity_t;
+    typedef typename ScheduleEntry<CHANNELS>::led_intensity_t led_intensity_t;
 
     // Create a type to help distinguish that we work with TOD
     typedef time_t time_of_day_t;
 
-    // Short-hand for channel->intensity map
-    typedef std::map<led_channel_t, led_intensity_t> entry_t;
+    // Intensities of every channel set by a row
+    typedef ScheduleEntry<CHANNELS> entry_t;
 
     static constexpr time_of_day_t INVALID_TOD = (time_of_day_t) -1;
+    static constexpr time_t INVALID_TIME = (time_t) -1;
     static constexpr int MAX_SCHEDULE_ERROR = 5; // 5 seconds
 
     void insert(time_of_day_t time, led_channel_t channel, led_intensity_t intensity)
     {
-      schedule[time][channel] = intensity;
+      schedule[time].set(channel, intensity);
     }
 
     void set(time_of_day_t time, const entry_t& entry)
@@ -63,6 +182,29 @@ class Schedule
       schedule[time] = entry;
     }
 
+    void erase(time_of_day_t time)
+    {
+      schedule.erase(time);
+    }
+
+    // Erase entries from first to last inclusive, wrapping past midnight if first is later
+    void erase(time_of_day_t first, time_of_day_t last)
+    {
+      if (first <= last)
+      {
+        schedule.erase(schedule.lower_bound(first), schedule.upper_bound(last));
+        return;
+      }
+
+      schedule.erase(schedule.lower_bound(first), schedule.end());
+      schedule.erase(schedule.begin(), schedule.upper_bound(last));
+    }
+
+    static bool in_range(time_of_day_t time, time_of_day_t first, time_of_day_t last)
+    {
+      return first <= last ? (time >= first && time <= last) : (time >= first || time <= last);
+    }
+
     time_of_day_t next(time_of_day_t now) const
     {
       if (schedule.empty())
@@ -94,11 +236,99 @@ class Schedule
       return it->first;
     }
 
+    /**
+      @brief  Find the next event after a UTC time. An event fires at the first 
+              instant the local wall clock reaches its TOD, so an event in the 
+              hour skipped by DST fires at the transition and an event in the 
+              repeated hour fires on its first occurrence
+      
+      @param  now UTC time
+      @param  tod TOD of the event found
+      @retval time_t - UTC time of the event or INVALID_TIME if empty
+    */
+    time_t next_event(time_t now, time_of_day_t& tod) const
+    {
+      if (schedule.empty())
+        return INVALID_TIME;
+
+      // Start behind the wall clock since a repeated hour can leave events ahead of it
+      time_t target = LocalTime::get_wall_time(now) - MAX_DST_SHIFT;
+
+      while (true)
+      {
+        time_t day = floor_day(target);
+
+        auto it = schedule.upper_bound(target - day);
+        if (it == schedule.end())
+        {
+          day += SECONDS_PER_DAY;
+          it = schedule.begin();
+        }
+
+        target = day + it->first;
+
+        time_t event = get_event_time(target);
+        if (event > now)
+        {
+          tod = it->first;
+          return event;
+        }
+      }
+    }
+
+    /**
+      @brief  Find the last event at or before a UTC time, i.e. the entry in effect
+      
+      @param  now UTC time
+      @param  tod TOD of the event found
+      @retval time_t - UTC time of the event or INVALID_TIME if empty
+    */
+    time_t prev_event(time_t now, time_of_day_t& tod) const
+    {
+      if (schedule.empty())
+        return INVALID_TIME;
+
+      time_t target = LocalTime::get_wall_time(now) + MAX_DST_SHIFT + 1;
+
+      while (true)
+      {
+        time_t day = floor_day(target);
+
+        auto it = schedule.lower_bound(target - day);
+        if (it == schedule.begin())
+        {
+          day -= SECONDS_PER_DAY;
+          it = schedule.end();
+        }
+
+        it--;
+
+        target = day + it->first;
+
+        time_t event = get_event_time(target);
+        if (event <= now)
+        {
+          tod = it->first;
+          return event;
+        }
+      }
+    }
+
     void reset()
     {
       schedule.clear();
     }
 
+    // Times of day of the entries, in order
+    std::vector<time_of_day_t> times() const
+    {
+      std::vector<time_of_day_t> times;
+      for (auto& kv : schedule)
+        times.push_back(kv.first);
+
+      return times;
+    }
+
     const entry_t& operator[](time_of_day_t time) const
     {
       static entry_t empty;
@@ -109,14 +339,32 @@ class Schedule
         return empty;
     }
 
-    static time_of_day_t get_time_of_day()
+    // Intensities in effect after the entry at time, carrying forward channels it doesn't set from earlier entries
+    entry_t state(time_of_day_t time) const
     {
-      time_t utc = time(nullptr);
-      struct tm* local_tm = localtime(&utc);
-
-      time_t now = local_tm->tm_hour * 3600 + local_tm->tm_min * 60 + local_tm->tm_sec;
+      entry_t state;
+
+      auto it = schedule.upper_bound(time);
+      for (size_t i = 0; i < schedule.size() && state.size() < CHANNELS; i++)
+      {
+        // Walk backwards, wrapping past midnight to the end of the day
+        if (it == schedule.begin())
+          it = schedule.end();
+        --it;
+
+        for (auto pair : it->second)
+        {
+          if (!state.contains(pair.first))
+            state.set(pair.first, pair.second);
+        }
+      }
+
+      return state;
+    }
 
-      return now % SECONDS_PER_DAY;
+    static time_of_day_t get_time_of_day()
+    {
+      return floor_mod(LocalTime::get_wall_time(time(nullptr)));
     }
 
     static time_of_day_t get_time_of_day(const std::string& tod)
@@ -137,10 +385,67 @@ class Schedule
       return ((next - prev) + SECONDS_PER_DAY) % SECONDS_PER_DAY;
     }
 
+    /**
+      @brief  Find the first UTC instant the wall clock reaches a wall time
+      
+      @param  wall Local wall clock time, as seconds since the epoch
+      @retval time_t
+    */
+    static time_t get_event_time(time_t wall)
+    {
+      // UTC offsets in effect on either side of the wall time. Any offset 
+      // from -12 to +14 hours lands between the two
+      time_t early = wall - 14 * 3600;
+      time_t late = wall + 12 * 3600;
+      time_t offsets[2] = {LocalTime::get_wall_time(early) - early, LocalTime::get_wall_time(late) - late};
+
+      time_t event = INVALID_TIME;
+      for (time_t offset : offsets)
+      {
+        time_t candidate = wall - offset;
+
+        // Take the earliest time that maps back to the wall time
+        if (LocalTime::get_wall_time(candidate) == wall && (event == INVALID_TIME || candidate < event))
+          event = candidate;
+      }
+
+      if (event != INVALID_TIME)
+        return event;
+
+      // Wall time was skipped by a transition. Search for the transition
+      time_t lo = std::min(wall - offsets[0], wall - offsets[1]);
+      time_t hi = std::max(wall - offsets[0], wall - offsets[1]);
+
+      while (hi - lo > 1)
+      {
+        time_t mid = lo + (hi - lo) / 2;
+
+        if (LocalTime::get_wall_time(mid) < wall)
+          lo = mid;
+        else
+          hi = mid;
+      }
+
+      return hi;
+    }
+
   private:
     static constexpr int SECONDS_PER_DAY = 86400;
+    static constexpr int MAX_DST_SHIFT = 7200; // 2 hours
+
+    static time_t floor_mod(time_t time)
+    {
+      return ((time % SECONDS_PER_DAY) + SECONDS_PER_DAY) % SECONDS_PER_DAY;
+    }
+
+    static time_t floor_day(time_t time)
+    {
+      return time - floor_mod(time);
+    }
 
     std::map<time_of_day_t, entry_t> schedule;
 };
 
+typedef BasicSchedule<LED_CHANNEL_COUNT> Schedule;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,640 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sys/time.h>
+#include <string>
+#include <set>
+
+#include "scheduler.h"
+#include "main.h"
+#include "http.h"
+#include "schedule.h"
+#include "ledc_interface.h"
+#include "compositor.h"
+#include "nvs_interface.h"
+#include "json.h"
+#include "solar.h"
+#include "lunar.h"
+
+#define TAG "Scheduler"
+
+static constexpr uint32_t FADE_MS = 5000; // Fade between schedule entries
+static constexpr time_t SECONDS_PER_DAY = 86400;
+static constexpr float MOON_RAMP = 0.1736f; // Sine of the altitude moonlight reaches full strength at, 10 degrees
+static constexpr float TWILIGHT = 0.1045f;  // Sine of the depression of the sun moonlight is full from, 6 degrees
+
+typedef std::vector<std::pair<Schedule::time_of_day_t, Intensity::intensity_t>> keyframes_t;
+
+static struct
+{
+  TimerHandle_t timer;
+  Schedule schedule;
+  Schedule::time_of_day_t event_tod = Schedule::INVALID_TOD; // Entry applied when the timer expires
+  time_t event_time = Schedule::INVALID_TIME;                // UTC time the timer is armed for
+  SemaphoreHandle_t edit_mutex;
+  std::vector<Scheduler::edit_t> edits;                      // Posted edits awaiting the main loop
+  TimerHandle_t day_timer;                                   // Resolves the solar keys again at local midnight
+  time_t solar_date = Solar::INVALID_TIME;                   // Local date the solar keys were resolved for
+
+  // Stored entries and the keyframes generated for the day the schedule is
+  // built from, so edits only resolve the keys they change
+  Schedule fixed;                                            // Entries of fixed keys
+  std::map<std::string, std::pair<Schedule::time_of_day_t, Schedule::entry_t>> solar_keys; // Entries of solar keys by their resolved TOD
+  Solar::config_t solar;
+  Lunar::config_t moon;
+  Solar::day_t day;
+  keyframes_t elevation_keyframes;
+  keyframes_t moon_keyframes;
+  keyframes_t moon_entries;                                  // Entries of the moon channel it was blended over
+} scheduler;
+
+/**
+  @brief  Get the current UTC time in milliseconds
+  
+  @param  none
+  @retval int64_t
+*/
+static int64_t get_time_ms()
+{
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  return (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/**
+  @brief  Arm the timer to expire at the pending event
+  
+  @param  now_ms Current UTC time in milliseconds
+  @retval none
+*/
+static void arm_timer(int64_t now_ms)
+{
+  // If invalid time don't do anything
+  if (scheduler.event_time == Schedule::INVALID_TIME)
+  {
+    ESP_LOGW(TAG, "Invalid time. Empty schedule?");
+    return;
+  }
+
+  int64_t delta_ms = std::max<int64_t>(scheduler.event_time * 1000 - now_ms, 1);
+
+  ESP_LOGI(TAG, "Timer update. Now: %lld, Next: %lld (TOD %ld), Delta: %lld ms", (long long) (now_ms / 1000), (long long) scheduler.event_time, (long) scheduler.event_tod, (long long) delta_ms);
+
+  // Reset timer for next schedule event
+  if (xTimerChangePeriod(scheduler.timer, std::max<TickType_t>(pdMS_TO_TICKS64(delta_ms), 1), pdMS_TO_TICKS(1000)) != pdPASS)
+    ESP_LOGE(TAG, "Failed to update schedule timer for next event.");
+}
+
+/**
+  @brief  Hand the state the schedule holds now to the compositor
+  
+  @param  now Current UTC time
+  @retval bool - Any channel was commanded
+*/
+static bool apply_state(time_t now)
+{
+  Schedule::time_of_day_t tod = Schedule::INVALID_TOD;
+  scheduler.schedule.prev_event(now, tod);
+
+  if (tod == Schedule::INVALID_TOD)
+    return false;
+
+  return Compositor::set_base(scheduler.schedule.state(tod), FADE_MS);
+}
+
+/**
+  @brief  Apply the state in effect now and arm the timer for the next event
+  
+  @param  none
+  @retval none
+*/
+static void reset_timer()
+{
+  int64_t now_ms = get_time_ms();
+  time_t now = now_ms / 1000;
+
+  apply_state(now);
+
+  scheduler.event_time = scheduler.schedule.next_event(now, scheduler.event_tod);
+
+  arm_timer(now_ms);
+
+  HTTP::push_status();
+}
+
+/**
+  @brief  Get the local calendar date of a UTC time
+  
+  @param  now UTC time
+  @retval time_t - Local midnight as seconds since the epoch
+*/
+static time_t get_local_date(time_t now)
+{
+  time_t wall = LocalTime::get_wall_time(now);
+
+  return wall - ((wall % SECONDS_PER_DAY) + SECONDS_PER_DAY) % SECONDS_PER_DAY;
+}
+
+/**
+  @brief  Resolve a schedule key relative to a solar event to a time of day
+  
+  @param  key Schedule key
+  @param  day Solar events of the day
+  @retval Schedule::time_of_day_t - INVALID_TOD if the event doesn't occur
+*/
+static Schedule::time_of_day_t resolve_solar_key(const std::string& key, const Solar::day_t& day)
+{
+  Solar::anchor_t anchor;
+  int32_t offset_s;
+  Solar::parse_key(key, anchor, offset_s);
+
+  time_t event = Solar::get_time(day, anchor, offset_s);
+  if (event == Solar::INVALID_TIME)
+  {
+    ESP_LOGW(TAG, "Schedule key '%s' doesn't occur today.", key.c_str());
+    return Schedule::INVALID_TOD;
+  }
+
+  time_t wall = LocalTime::get_wall_time(event);
+
+  return ((wall % SECONDS_PER_DAY) + SECONDS_PER_DAY) % SECONDS_PER_DAY;
+}
+
+/**
+  @brief  Check if the configuration has a channel following the sun
+
+  @param  none
+  @retval bool
+*/
+static bool has_elevation()
+{
+  return scheduler.solar.enabled && scheduler.solar.channel >= 0 && scheduler.solar.channel < (int32_t) LED_CHANNEL_COUNT;
+}
+
+/**
+  @brief  Check if the configuration has a channel blending in moonlight,
+          which also needs the location
+
+  @param  none
+  @retval bool
+*/
+static bool has_moonlight()
+{
+  return scheduler.solar.enabled && scheduler.moon.channel >= 0 && scheduler.moon.channel < (int32_t) LED_CHANNEL_COUNT;
+}
+
+/**
+  @brief  Get keyframes of the channel following the solar elevation over
+          the local day. Repeated intensities, i.e. the night, are skipped
+  
+  @param  config Solar configuration
+  @param  day Solar events of the day
+  @retval keyframes_t
+*/
+static keyframes_t get_elevation_keyframes(const Solar::config_t& config, const Solar::day_t& day)
+{
+  keyframes_t keyframes;
+
+  Intensity::intensity_t last = Intensity::FULL_SCALE;
+  for (Schedule::time_of_day_t tod = 0; tod < SECONDS_PER_DAY; tod += Solar::ELEVATION_STEP_S)
+  {
+    float elevation = Solar::get_sin_elevation(day, Schedule::get_event_time(day.date + tod));
+    Intensity::intensity_t intensity = elevation > 0 ? (Intensity::intensity_t) lroundf(elevation * config.intensity) : Intensity::OFF;
+
+    if (tod != 0 && intensity == last)
+      continue;
+
+    keyframes.emplace_back(tod, intensity);
+    last = intensity;
+  }
+
+  return keyframes;
+}
+
+/**
+  @brief  Blend moonlight into a channel of the schedule over the local day.
+          Moonlight follows the phase of the moon, grows as the moon rises
+          and fades out through civil twilight. Keyframes are placed on the
+          elevation steps and on every entry of the channel, and repeated
+          intensities are skipped
+  
+  @param  solar Solar configuration with the location
+  @param  moon Lunar configuration
+  @param  day Solar events of the day
+  @retval keyframes_t
+*/
+static keyframes_t get_moon_keyframes(const Solar::config_t& solar, const Lunar::config_t& moon, const Solar::day_t& day)
+{
+  ledc_channel_t channel = (ledc_channel_t) moon.channel;
+
+  // Phase changes slowly enough to hold for the day
+  float full = Lunar::get_illumination(Lunar::get_age(Schedule::get_event_time(day.date) + SECONDS_PER_DAY / 2)) * moon.intensity;
+
+  std::set<Schedule::time_of_day_t> entries;
+  for (auto tod : scheduler.schedule.times())
+  {
+    if (scheduler.schedule[tod].contains(channel))
+      entries.insert(tod);
+  }
+
+  std::set<Schedule::time_of_day_t> times = entries;
+  for (Schedule::time_of_day_t tod = 0; tod < SECONDS_PER_DAY; tod += Solar::ELEVATION_STEP_S)
+    times.insert(tod);
+
+  keyframes_t keyframes;
+  uint32_t last = UINT32_MAX;
+  for (auto tod : times)
+  {
+    time_t utc = Schedule::get_event_time(day.date + tod);
+
+    float rise = std::min(std::max(Lunar::get_sin_altitude(solar, utc) / MOON_RAMP, 0.0f), 1.0f);
+    float dark = std::min(std::max(-Solar::get_sin_elevation(day, utc) / TWILIGHT, 0.0f), 1.0f);
+    uint32_t light = lroundf(full * rise * dark);
+
+    Schedule::entry_t state = scheduler.schedule.state(tod);
+    uint32_t base = state.contains(channel) ? state.get(channel) : Intensity::OFF;
+    uint32_t intensity = moon.blend == Lunar::BLEND_ADD ? std::min<uint32_t>(base + light, Intensity::FULL_SCALE) : std::max(base, light);
+
+    if (intensity != last || entries.count(tod))
+      keyframes.emplace_back(tod, intensity);
+
+    last = intensity;
+  }
+
+  return keyframes;
+}
+
+/**
+  @brief  Get the entries of a channel in the schedule
+
+  @param  channel LED channel
+  @retval keyframes_t
+*/
+static keyframes_t get_channel_entries(ledc_channel_t channel)
+{
+  keyframes_t entries;
+  for (auto tod : scheduler.schedule.times())
+  {
+    if (scheduler.schedule[tod].contains(channel))
+      entries.emplace_back(tod, scheduler.schedule[tod].get(channel));
+  }
+
+  return entries;
+}
+
+/**
+  @brief  Store the entry of a fixed key. The elevation channel is driven
+          only by the sun, so an entry of only that channel is dropped
+
+  @param  tod Time of day of the key
+  @param  entry Intensities of the entry
+  @retval none
+*/
+static void store_fixed_entry(Schedule::time_of_day_t tod, Schedule::entry_t entry)
+{
+  if (has_elevation())
+    entry.clear((ledc_channel_t) scheduler.solar.channel);
+
+  if (entry.empty())
+    scheduler.fixed.erase(tod);
+  else
+    scheduler.fixed.set(tod, entry);
+}
+
+/**
+  @brief  Store the entry of a key relative to a solar event, resolved
+          against the day
+
+  @param  key Schedule key
+  @param  entry Intensities of the entry
+  @retval bool - Key was stored
+*/
+static bool store_solar_entry(const std::string& key, Schedule::entry_t entry)
+{
+  if (!scheduler.solar.enabled)
+  {
+    ESP_LOGW(TAG, "Schedule key '%s' requires a location.", key.c_str());
+    return false;
+  }
+
+  if (has_elevation())
+    entry.clear((ledc_channel_t) scheduler.solar.channel);
+
+  scheduler.solar_keys[key] = std::make_pair(resolve_solar_key(key, scheduler.day), entry);
+  return true;
+}
+
+/**
+  @brief  Build the schedule from the stored entries and the keyframes of
+          the day. The moonlight is only blended again when the entries of
+          its channel changed
+
+  @param  blend_moon Blend the moonlight regardless
+  @retval none
+*/
+static void build_schedule(bool blend_moon)
+{
+  scheduler.schedule = scheduler.fixed;
+
+  // Fixed keys go first, so solar keys landing on the same time override their channels
+  for (auto& kv : scheduler.solar_keys)
+  {
+    Schedule::time_of_day_t tod = kv.second.first;
+    if (tod == Schedule::INVALID_TOD)
+      continue;
+
+    for (auto pair : kv.second.second)
+      scheduler.schedule.insert(tod, pair.first, pair.second);
+  }
+
+  for (auto& keyframe : scheduler.elevation_keyframes)
+    scheduler.schedule.insert(keyframe.first, (ledc_channel_t) scheduler.solar.channel, keyframe.second);
+
+  if (!has_moonlight())
+    return;
+
+  // Blended over everything else on the channel
+  ledc_channel_t channel = (ledc_channel_t) scheduler.moon.channel;
+  keyframes_t entries = get_channel_entries(channel);
+  if (blend_moon || entries != scheduler.moon_entries)
+  {
+    scheduler.moon_keyframes = get_moon_keyframes(scheduler.solar, scheduler.moon, scheduler.day);
+    scheduler.moon_entries = entries;
+  }
+
+  for (auto& keyframe : scheduler.moon_keyframes)
+    scheduler.schedule.insert(keyframe.first, channel, keyframe.second);
+}
+
+/**
+  @brief  Reload the schedule from NVS and apply the entry in effect
+  
+  @param  none
+  @retval none
+*/
+static void load_schedule()
+{
+  ESP_LOGI(TAG, "Loading schedule...");
+
+  // NVS already holds any pending edits
+  xSemaphoreTake(scheduler.edit_mutex, portMAX_DELAY);
+  scheduler.edits.clear();
+  xSemaphoreGive(scheduler.edit_mutex);
+
+  std::map<std::string, std::string> schedule_json = NVS::get_schedule_json();
+
+  time_t now = time(nullptr);
+  time_t date = get_local_date(now);
+
+  // Solar events are computed once for the day
+  scheduler.solar = NVS::get_solar_config();
+  scheduler.moon = NVS::get_moon_config();
+  scheduler.day = Solar::get_day(scheduler.solar, date);
+
+  bool resolved = has_elevation() || has_moonlight();
+
+  scheduler.fixed.reset();
+  scheduler.solar_keys.clear();
+
+  for (auto& kv : schedule_json)
+  {
+    Schedule::entry_t entry = JSON::parse_schedule_entry(kv.second);
+
+    Solar::anchor_t anchor;
+    int32_t offset_s;
+    if (Solar::parse_key(kv.first, anchor, offset_s))
+      resolved |= store_solar_entry(kv.first, entry);
+    else
+      store_fixed_entry(Schedule::get_time_of_day(kv.first), entry);
+  }
+
+  scheduler.elevation_keyframes = has_elevation() ? get_elevation_keyframes(scheduler.solar, scheduler.day) : keyframes_t();
+
+  build_schedule(true);
+
+  // Resolve again when the date changes
+  scheduler.solar_date = resolved ? date : Solar::INVALID_TIME;
+  if (!resolved)
+    xTimerStop(scheduler.day_timer, pdMS_TO_TICKS(1000));
+  else
+  {
+    time_t midnight = Schedule::get_event_time(date + SECONDS_PER_DAY);
+    if (xTimerChangePeriod(scheduler.day_timer, std::max<TickType_t>(pdMS_TO_TICKS64((midnight - now) * 1000), 1), pdMS_TO_TICKS(1000)) != pdPASS)
+      ESP_LOGE(TAG, "Failed to update day timer.");
+  }
+
+  reset_timer();
+}
+
+/**
+  @brief  Check the schedule timer against the system time after it changed
+  
+  @param  none
+  @retval none
+*/
+static void check_timer()
+{
+  // A change of date needs the solar keys resolved for the new day
+  if (scheduler.solar_date != Solar::INVALID_TIME && get_local_date(time(nullptr)) != scheduler.solar_date)
+  {
+    load_schedule();
+    return;
+  }
+
+  // If no event is pending don't do anything
+  if (scheduler.event_time == Schedule::INVALID_TIME)
+    return;
+
+  // Calculate the error between the timer's expiration and the time of the event
+  TickType_t remaining_ticks = xTimerGetExpiryTime(scheduler.timer) - xTaskGetTickCount();
+  double error = (scheduler.event_time * 1000 - get_time_ms()) / 1000.0 - (remaining_ticks / (double) pdMS_TO_TICKS(1000));
+
+  ESP_LOGD(TAG, "System time updated. Timer error: %f", error);
+
+  HTTP::push_status();
+
+  if (std::abs(error) > Schedule::MAX_SCHEDULE_ERROR)
+  {
+    ESP_LOGW(TAG, "Timer delta and actual delta differ by more than %d seconds. Updating timer.", Schedule::MAX_SCHEDULE_ERROR);
+
+    // Time may have jumped past events so apply whichever is in effect now
+    reset_timer();
+  }
+}
+
+/**
+  @brief  Apply the entry of the expired event and arm the timer for the next
+  
+  @param  none
+  @retval none
+*/
+static void timer_expired()
+{
+  int64_t now_ms = get_time_ms();
+  time_t now = now_ms / 1000;
+
+  if (scheduler.event_time != Schedule::INVALID_TIME && std::abs(now - scheduler.event_time) > Schedule::MAX_SCHEDULE_ERROR)
+    ESP_LOGW(TAG, "Expected time and actual time differ by more than %d seconds.", Schedule::MAX_SCHEDULE_ERROR);
+
+  // Execute state changes for the event
+  if (scheduler.event_tod != Schedule::INVALID_TOD)
+    Compositor::set_base(scheduler.schedule.state(scheduler.event_tod), FADE_MS);
+
+  // Search from the event just applied if the timer expired a little early so it doesn't fire twice
+  time_t from = std::max(now, scheduler.event_time);
+  scheduler.event_time = scheduler.schedule.next_event(from, scheduler.event_tod);
+
+  arm_timer(now_ms);
+
+  // Let websocket clients know immediately
+  HTTP::push_status();
+}
+
+/**
+  @brief  Apply posted edits to the stored entries and build the schedule
+          again, resolving only the solar keys edited. Channels and the
+          timer are only touched when their state changed
+  
+  @param  none
+  @retval none
+*/
+static void apply_edits()
+{
+  std::vector<Scheduler::edit_t> edits;
+
+  xSemaphoreTake(scheduler.edit_mutex, portMAX_DELAY);
+  edits.swap(scheduler.edits);
+  xSemaphoreGive(scheduler.edit_mutex);
+
+  if (edits.empty())
+    return;
+
+  bool resolved = scheduler.solar_date != Solar::INVALID_TIME;
+  bool solar = std::any_of(edits.begin(), edits.end(), [](const Scheduler::edit_t& e) { return !e.solar_erases.empty() || !e.solar_upserts.empty(); });
+
+  // The first solar key needs the day resolved and the day timer started
+  if (solar && !resolved)
+  {
+    load_schedule();
+    return;
+  }
+
+  for (auto& edit : edits)
+  {
+    for (auto& range : edit.erases)
+      scheduler.fixed.erase(range.first, range.second);
+
+    for (auto& kv : edit.upserts)
+      store_fixed_entry(kv.first, kv.second);
+
+    for (auto& key : edit.solar_erases)
+      scheduler.solar_keys.erase(key);
+
+    for (auto& kv : edit.solar_upserts)
+      store_solar_entry(kv.first, kv.second);
+  }
+
+  // Keyframes generated for the day are kept unless their channel changed
+  build_schedule(false);
+
+  int64_t now_ms = get_time_ms();
+  time_t now = now_ms / 1000;
+
+  bool changed = apply_state(now);
+
+  // Leave the timer alone unless the next event moved
+  Schedule::time_of_day_t tod = Schedule::INVALID_TOD;
+  time_t next = scheduler.schedule.next_event(now, tod);
+  if (next != scheduler.event_time || tod != scheduler.event_tod)
+  {
+    scheduler.event_tod = tod;
+    scheduler.event_time = next;
+
+    arm_timer(now_ms);
+    changed = true;
+  }
+
+  if (changed)
+    HTTP::push_status();
+}
+
+/**
+  @brief  Create the schedule timer
+  
+  @param  none
+  @retval none
+*/
+void Scheduler::init()
+{
+  // Construct a timer to handle the scheduled events
+  scheduler.timer = xTimerCreate("ScheduleTimer", 1, false, nullptr, 
+    [](TimerHandle_t /* t */) {
+      signal_event(MAIN_EVENT_LED_TIMER_EXPIRED);
+    });
+
+  if (scheduler.timer == NULL)
+    ESP_LOGE(TAG, "Failed to create schedule timer.");
+
+  scheduler.day_timer = xTimerCreate("DayTimer", 1, false, nullptr, 
+    [](TimerHandle_t /* t */) {
+      signal_event(MAIN_EVENT_SCHEDULE_UPDATE);
+    });
+
+  if (scheduler.day_timer == NULL)
+    ESP_LOGE(TAG, "Failed to create day timer.");
+
+  scheduler.edit_mutex = xSemaphoreCreateMutex();
+}
+
+/**
+  @brief  Queue an edit of the schedule for the main loop. Safe to call from 
+          other tasks
+  
+  @param  edit Changes to apply
+  @retval none
+*/
+void Scheduler::post_edit(const edit_t& edit)
+{
+  xSemaphoreTake(scheduler.edit_mutex, portMAX_DELAY);
+  scheduler.edits.push_back(edit);
+  xSemaphoreGive(scheduler.edit_mutex);
+
+  signal_event(MAIN_EVENT_SCHEDULE_EDIT);
+}
+
+/**
+  @brief  Handle scheduler events from the main loop. Follow up events are 
+          signaled to the main loop rather than handled immediately
+  
+  @param  events Bits of MAIN_EVENT
+  @retval none
+*/
+void Scheduler::handle_events(uint32_t events)
+{
+  if (events & MAIN_EVENT_CONFIG_UPDATE)
+    LEDC::reconfigure();
+
+  if (events & MAIN_EVENT_SCHEDULE_UPDATE)
+    load_schedule();
+  else if (events & MAIN_EVENT_SCHEDULE_EDIT)
+    apply_edits();
+
+  if (events & MAIN_EVENT_SYSTEM_TIME_UPDATED)
+    check_timer();
+
+  if (events & MAIN_EVENT_LED_TIMER_EXPIRED)
+    timer_expired();
+
+  // Layers changed, or expiries need rearming against the new time
+  if (events & (MAIN_EVENT_LAYER_UPDATE | MAIN_EVENT_SYSTEM_TIME_UPDATED))
+  {
+    if (Compositor::update())
+      HTTP::push_status();
+  }
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "main.h"
+#include "schedule.h"
+
+/**
+  @brief  Event logic of the main loop which keeps the LEDs following the 
+          schedule. Kept free of the rest of the system so it can also run 
+          against a virtual clock on the host
+*/
+namespace Scheduler
+{
+  // Main loop events handled by the scheduler
+  constexpr uint32_t EVENTS = MAIN_EVENT_CONFIG_UPDATE | MAIN_EVENT_SCHEDULE_UPDATE | 
+                              MAIN_EVENT_SCHEDULE_EDIT | MAIN_EVENT_SYSTEM_TIME_UPDATED | 
+                              MAIN_EVENT_LED_TIMER_EXPIRED | MAIN_EVENT_LAYER_UPDATE;
+
+  // Changes to a subset of the schedule. Erases are applied before upserts
+  typedef struct
+  {
+    std::vector<std::pair<Schedule::time_of_day_t, Schedule::time_of_day_t>> erases; // Inclusive ranges
+    std::map<Schedule::time_of_day_t, Schedule::entry_t> upserts;
+    std::vector<std::string> solar_erases;                 // Keys relative to solar events
+    std::map<std::string, Schedule::entry_t> solar_upserts; // Resolved against the day by the scheduler
+  } edit_t;
+
+  void init(void);
+  void handle_events(uint32_t events);
+  void post_edit(const edit_t& edit);
+}
+
+#endif
\ No newline at end of file
@@ -8,9 +8,33 @@
 #include <string>
 
 #include "sntp_interface.h"
+#include "local_time.h"
+#include "clock.h"
 
 #define TAG "SNTP"
 
+static SNTP::sync_callback_t sync_callback = nullptr;
+
+/**
+  @brief  Override of the weak ESP-IDF hook called with each time received 
+          from the server. Hands it to the clock discipline rather than 
+          stepping the clock
+  
+  @param  tv Time received from the server
+  @retval none
+*/
+extern "C" void sntp_sync_time(struct timeval* tv)
+{
+  Clock::sync(tv);
+  sntp_set_sync_status(SNTP_SYNC_STATUS_COMPLETED);
+
+  time_t now = time(nullptr);
+  ESP_LOGI(TAG, "System time set to %s", asctime(localtime(&now)));
+
+  if (sync_callback != nullptr)
+    sync_callback();
+}
+
 /**
   @brief  Initialize the SNTP with the given timezone and callback
   
@@ -21,24 +45,13 @@
 */
 void SNTP::init(const std::string& timezone, const server_list_t& servers, sync_callback_t callback)
 {
-  static sync_callback_t s_callback = callback;
+  sync_callback = callback;
 
   // Configure timezone and servers
   reconfigure(timezone, servers);
 
-  // Use polling, and immediately update time
+  // Use polling. Syncs are disciplined by sntp_sync_time
   sntp_setoperatingmode(SNTP_OPMODE_POLL);
-  sntp_set_sync_mode(SNTP_SYNC_MODE_IMMED);
-  
-  // Set a callback so we know it's working
-  sntp_set_time_sync_notification_cb([](struct timeval* tv)
-  {
-    struct tm* timeinfo = localtime(&tv->tv_sec);
-    ESP_LOGI(TAG, "System time set to %s", asctime(timeinfo));
-
-    if (s_callback != nullptr)
-      s_callback();
-  });
 
   sntp_init();
 }
@@ -56,6 +69,9 @@ void SNTP::reconfigure(const std::string& timezone, const server_list_t& servers
   setenv("TZ", timezone.c_str(), 1);
   tzset();
 
+  // Cached offsets are stale now
+  LocalTime::invalidate();
+
   ESP_LOGI(TAG, "TZ: '%s'", timezone.c_str());
 
   // Add servers to the list
@@ -0,0 +1,135 @@
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "solar.h"
+
+static const char* anchor_names[] = {"sunrise", "noon", "sunset"};
+
+// Zenith of rise and set, allowing for refraction and the radius of the disc
+static constexpr float ZENITH_DEG = 90.833f;
+static constexpr float DEG_TO_RAD = (float) M_PI / 180.0f;
+
+/**
+  @brief  Compute the events and declination of the sun for a day with the
+          NOAA general solar position series. Accurate to about a minute
+          away from the poles, and cheap enough in single precision to run
+          once a day
+
+  @param  config Location
+  @param  date Midnight UTC of the calendar date
+  @retval Solar::day_t
+*/
+Solar::day_t Solar::get_day(const config_t& config, time_t date)
+{
+  struct tm date_tm;
+  gmtime_r(&date, &date_tm);
+
+  // Fractional year at noon in radians
+  float g = 2.0f * (float) M_PI / 365.0f * date_tm.tm_yday;
+
+  float equation_min = 229.18f * (0.000075f + 0.001868f * cosf(g) - 0.032077f * sinf(g) - 0.014615f * cosf(2 * g) - 0.040849f * sinf(2 * g));
+  float declination = 0.006918f - 0.399912f * cosf(g) + 0.070257f * sinf(g) - 0.006758f * cosf(2 * g) + 0.000907f * sinf(2 * g) -
+                      0.002697f * cosf(3 * g) + 0.00148f * sinf(3 * g);
+
+  day_t day;
+  day.date = date;
+  day.sin_latitude = sinf(config.latitude * DEG_TO_RAD);
+  day.cos_latitude = cosf(config.latitude * DEG_TO_RAD);
+  day.sin_declination = sinf(declination);
+  day.cos_declination = cosf(declination);
+  day.solar_offset_min = equation_min + 4.0f * config.longitude;
+
+  float noon_min = 720.0f - day.solar_offset_min;
+  day.events[ANCHOR_NOON] = date + (time_t) lroundf(noon_min * 60);
+
+  // Hour angle of rise and set. Out of range when the sun stays up or down
+  float cos_hour = (cosf(ZENITH_DEG * DEG_TO_RAD) - day.sin_latitude * day.sin_declination) / (day.cos_latitude * day.cos_declination);
+  if (cos_hour < -1.0f || cos_hour > 1.0f)
+  {
+    day.events[ANCHOR_SUNRISE] = INVALID_TIME;
+    day.events[ANCHOR_SUNSET] = INVALID_TIME;
+  }
+  else
+  {
+    float hour_min = 4.0f * acosf(cos_hour) / DEG_TO_RAD;
+    day.events[ANCHOR_SUNRISE] = date + (time_t) lroundf((noon_min - hour_min) * 60);
+    day.events[ANCHOR_SUNSET] = date + (time_t) lroundf((noon_min + hour_min) * 60);
+  }
+
+  return day;
+}
+
+/**
+  @brief  Sine of the solar elevation, i.e. the fraction of overhead
+          irradiance, at a time on or near the day
+
+  @param  day Day computed by get_day
+  @param  utc UTC time
+  @retval float - Negative when the sun is below the horizon
+*/
+float Solar::get_sin_elevation(const day_t& day, time_t utc)
+{
+  float solar_min = (utc - day.date) / 60.0f + day.solar_offset_min;
+  float hour_angle = (solar_min / 4.0f - 180.0f) * DEG_TO_RAD;
+
+  return day.sin_latitude * day.sin_declination + day.cos_latitude * day.cos_declination * cosf(hour_angle);
+}
+
+/**
+  @brief  Parse a schedule key relative to a solar event, of the form
+          "sunrise", "noon-02:00" or "sunset+00:30"
+
+  @param  key Schedule key
+  @param  anchor Event the key is relative to
+  @param  offset_s Offset from the event in seconds
+  @retval bool - Key is relative to a solar event
+*/
+bool Solar::parse_key(const std::string& key, anchor_t& anchor, int32_t& offset_s)
+{
+  for (int a = 0; a < ANCHOR_MAX; a++)
+  {
+    size_t length = strlen(anchor_names[a]);
+    if (key.compare(0, length, anchor_names[a]) != 0)
+      continue;
+
+    anchor = (anchor_t) a;
+    offset_s = 0;
+
+    if (key.length() == length)
+      return true;
+
+    // Offset must be a sign and a canonical HH:MM
+    const char* offset = key.c_str() + length;
+    if (key.length() != length + 6 || (offset[0] != '+' && offset[0] != '-') || offset[3] != ':' ||
+        !isdigit(offset[1]) || !isdigit(offset[2]) || !isdigit(offset[4]) || !isdigit(offset[5]))
+      return false;
+
+    int32_t hours = (offset[1] - '0') * 10 + (offset[2] - '0');
+    int32_t minutes = (offset[4] - '0') * 10 + (offset[5] - '0');
+    if (hours > 23 || minutes > 59)
+      return false;
+
+    offset_s = (offset[0] == '-' ? -1 : 1) * (hours * 3600 + minutes * 60);
+    return true;
+  }
+
+  return false;
+}
+
+/**
+  @brief  Get the UTC time of an event plus an offset
+
+  @param  day Day computed by get_day
+  @param  anchor Solar event
+  @param  offset_s Offset from the event in seconds
+  @retval time_t - INVALID_TIME if the event doesn't occur on the day
+*/
+time_t Solar::get_time(const day_t& day, anchor_t anchor, int32_t offset_s)
+{
+  if (anchor >= ANCHOR_MAX || day.events[anchor] == INVALID_TIME)
+    return INVALID_TIME;
+
+  return day.events[anchor] + offset_s;
+}
\ No newline at end of file
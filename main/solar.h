@@ -0,0 +1,55 @@
+#ifndef __SOLAR_H__
+#define __SOLAR_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+#include "intensity.h"
+
+/**
+  @brief  Position of the sun for a configured location. Events of a day are
+          computed once and cached by the scheduler, which resolves schedule
+          keys relative to them into fixed times of day
+*/
+namespace Solar
+{
+  typedef struct
+  {
+    bool enabled;
+    float latitude;                   // Degrees, north positive
+    float longitude;                  // Degrees, east positive
+    int32_t channel;                  // Channel following the solar elevation, -1 for none
+    Intensity::intensity_t intensity; // Intensity of that channel with the sun overhead
+  } config_t;
+
+  typedef enum
+  {
+    ANCHOR_SUNRISE,
+    ANCHOR_NOON,
+    ANCHOR_SUNSET,
+    ANCHOR_MAX,
+  } anchor_t;
+
+  typedef struct
+  {
+    time_t date;               // Midnight UTC of the calendar date
+    time_t events[ANCHOR_MAX]; // UTC time of each anchor. INVALID_TIME if the sun doesn't rise or set
+    float sin_latitude;
+    float cos_latitude;
+    float sin_declination;
+    float cos_declination;
+    float solar_offset_min;    // True solar time minus UTC, from the equation of time and longitude
+  } day_t;
+
+  constexpr time_t INVALID_TIME = (time_t) -1;
+  constexpr uint32_t ELEVATION_STEP_S = 300; // Spacing of the elevation channel keyframes
+
+  day_t get_day(const config_t& config, time_t date);
+  float get_sin_elevation(const day_t& day, time_t utc);
+
+  bool parse_key(const std::string& key, anchor_t& anchor, int32_t& offset_s);
+  time_t get_time(const day_t& day, anchor_t anchor, int32_t offset_s);
+}
+
+#endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "esp_spiffs.h"
+#include "esp_partition.h"
 #include "esp_log.h"
 #include "esp_err.h"
 
@@ -7,33 +8,95 @@
 #include <sys/stat.h>
 
 #include "spiffs.h"
+#include "nvs_interface.h"
 
 #define TAG "SPIFFS"
 
+static constexpr uint8_t SLOT_NONE = 0xFF;
+
+static struct
+{
+  uint8_t mounted = SLOT_NONE;
+} spiffs;
+
 /**
-  @brief  Initialize and mount the SPIFFS
+  @brief  Find the partition of a SPIFFS slot
 
-  @param  none
-  @retval none
+  @param  slot Slot index
+  @retval const esp_partition_t* - nullptr if the partition table has no such slot
 */
-void SPIFFS::init()
+static const esp_partition_t* find_partition(uint8_t slot)
 {
+  if (slot >= SPIFFS::SLOT_COUNT)
+    return nullptr;
+
+  return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, SPIFFS::PARTITION_LABELS[slot]);
+}
+
+/**
+  @brief  Register the SPIFFS of a slot with the VFS
+
+  @param  slot Slot index
+  @param  format Format the partition if it fails to mount
+  @retval esp_err_t
+*/
+static esp_err_t mount(uint8_t slot, bool format)
+{
+  if (find_partition(slot) == nullptr)
+    return ESP_ERR_NOT_FOUND;
+
   esp_vfs_spiffs_conf_t config = 
   {
-    .base_path = ROOT_DIR,
-    .partition_label = NULL,
+    .base_path = SPIFFS::ROOT_DIR,
+    .partition_label = SPIFFS::PARTITION_LABELS[slot],
     .max_files = 5,
-    .format_if_mount_failed = true,
+    .format_if_mount_failed = format,
   };
 
   esp_err_t result = esp_vfs_spiffs_register(&config);
+  if (result != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Failed to mount slot '%s'. Error: %s", SPIFFS::PARTITION_LABELS[slot], esp_err_to_name(result));
+    return result;
+  }
+
+  spiffs.mounted = slot;
+  ESP_LOGI(TAG, "Mount OK. Slot '%s'.", SPIFFS::PARTITION_LABELS[slot]);
+
+  return ESP_OK;
+}
+
+/**
+  @brief  Initialize and mount the active SPIFFS slot. Falls back to the other
+          slot if the active one fails to mount. A slot is only formatted if
+          neither can be mounted
+
+  @param  none
+  @retval none
+*/
+void SPIFFS::init()
+{
+  uint8_t active = NVS::get_spiffs_slot();
+  if (find_partition(active) == nullptr)
+    active = 0;
+
+  uint8_t other = (active + 1) % SLOT_COUNT;
+
+  esp_err_t result = mount(active, false);
+  if (result != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Falling back to slot '%s'.", PARTITION_LABELS[other]);
+    result = mount(other, false);
+  }
+
+  if (result != ESP_OK)
+    result = mount(active, true);
+
   if (result != ESP_OK)
   {
     ESP_LOGE(TAG, "Failed to initialize filesystem. Error: %s", esp_err_to_name(result));
     return;
   }
-  
-  ESP_LOGI(TAG, "Mount OK.");
 
   // Check for root directory
   // Tricks the VFS into understanding a directory exists at the root of this FS
@@ -51,21 +114,67 @@ void SPIFFS::init()
 }
 
 /**
-  @brief  Remount the SPIFFS in case the partition has changed underneath
+  @brief  Remount the SPIFFS to switch to the active slot. The previously 
+          mounted slot is only unmounted, never erased
 
   @param  none
   @retval none
 */
 void SPIFFS::remount()
 {
-  if (esp_spiffs_mounted(nullptr))
+  if (spiffs.mounted != SLOT_NONE && esp_spiffs_mounted(PARTITION_LABELS[spiffs.mounted]))
   {
     // Unregister/demount if counted
-    esp_err_t result = esp_vfs_spiffs_unregister(nullptr);
+    esp_err_t result = esp_vfs_spiffs_unregister(PARTITION_LABELS[spiffs.mounted]);
     if (result != ESP_OK)
       ESP_LOGW(TAG, "Failed to unregister with VFS. Error: %s",  esp_err_to_name(result));
   }
 
+  spiffs.mounted = SLOT_NONE;
+
   // Remount
   SPIFFS::init();
+}
+
+/**
+  @brief  Get the partition an update should be written to. This is the slot
+          that isn't mounted. Partition tables predating the second slot are
+          updated in place
+
+  @param  none
+  @retval const esp_partition_t*
+*/
+const esp_partition_t* SPIFFS::get_update_partition()
+{
+  uint8_t mounted = (spiffs.mounted != SLOT_NONE) ? spiffs.mounted : 0;
+
+  const esp_partition_t* partition = find_partition((mounted + 1) % SLOT_COUNT);
+  if (partition == nullptr)
+  {
+    ESP_LOGW(TAG, "No inactive slot in partition table. Updating mounted slot in place.");
+    partition = find_partition(mounted);
+  }
+
+  return partition;
+}
+
+/**
+  @brief  Select the slot to mount on the next remount or boot
+
+  @param  partition Partition of the slot
+  @retval esp_err_t
+*/
+esp_err_t SPIFFS::set_active_partition(const esp_partition_t* partition)
+{
+  for (uint8_t slot = 0; slot < SLOT_COUNT; slot++)
+  {
+    if (find_partition(slot) != partition)
+      continue;
+
+    NVS::save_spiffs_slot(slot);
+    ESP_LOGI(TAG, "Active slot '%s'.", PARTITION_LABELS[slot]);
+    return ESP_OK;
+  }
+
+  return ESP_ERR_NOT_FOUND;
 }
\ No newline at end of file
@@ -1,12 +1,21 @@
 #ifndef __SPIFFS_H__
 #define __SPIFFS_H__
 
+#include "esp_partition.h"
+
 namespace SPIFFS
 {
   constexpr const char* ROOT_DIR = "/spiffs";
 
+  // Web assets are kept in two slots so an update never touches the mounted one
+  constexpr const char* PARTITION_LABELS[] = {"spiffs", "spiffs_b"};
+  constexpr uint8_t SLOT_COUNT = sizeof(PARTITION_LABELS) / sizeof(PARTITION_LABELS[0]);
+
   void init(void);
   void remount(void);
+
+  const esp_partition_t* get_update_partition(void);
+  esp_err_t set_active_partition(const esp_partition_t* partition);
 }
 
 #endif
\ No newline at end of file
@@ -21,6 +21,10 @@ String.prototype.format = function () {
 	return a
 }
 
+function isSolarTime(tod) {
+  return /^(sunrise|noon|sunset)([+-]\d\d:\d\d)?$/.test(tod || "");
+}
+
 function nullOrEmpty(id) {
   // We want 0 as a valid ID but want to exlude null, undef and empty
   return id == undefined || id == null || id === "";
@@ -82,6 +86,7 @@ class Channel {
     this.timer = opts.timer || 0;
     this.gpio = opts.gpio || null;
     this.enabled = opts.enabled || false;
+    this.watts = opts.watts || 0;
   }
 
   get columnDefinition() {
@@ -136,6 +141,8 @@ var Channels = {
 // "Namespace" to handle channel array
 var Schedule = {
    _data: [],
+   baseline: {}, // Schedule as last loaded from or saved to the device
+   solar: {}, // Today's sunrise, noon and sunset as reported by the device
   
   get data() {
     return this._data;
@@ -151,6 +158,43 @@ var Schedule = {
     return obj;
   },
 
+  // Build an edit of only the entries changed since the baseline
+  get edit() {
+    // Compare rows independent of key order and empty cells
+    let canonical = (row) => {
+      if (row === undefined)
+        return undefined;
+
+      return JSON.stringify(Object.keys(row).sort().map(k => [k, row[k] === "" ? null : row[k]]));
+    };
+
+    let current = this.dictionary;
+    let edit = { upsert: {}, delete: [] };
+
+    Object.keys(current).forEach(tod => {
+      if (canonical(current[tod]) !== canonical(this.baseline[tod]))
+        edit.upsert[tod] = current[tod];
+    });
+
+    Object.keys(this.baseline).filter(tod => !(tod in current)).forEach(tod => edit.delete.push(tod));
+
+    return edit;
+  },
+
+  // Resolve a TOD or a time relative to the sun, e.g. "sunset+00:30", to HH:mm
+  resolve: function(tod) {
+    let match = /^(sunrise|noon|sunset)(?:([+-])(\d\d):(\d\d))?$/.exec(tod || "");
+    if (!match)
+      return moment(tod, "HH:mm", true).isValid() ? tod : null;
+
+    let event = this.solar[match[1]];
+    if (nullOrEmpty(event))
+      return null;
+
+    let offset = match[2] ? (match[2] == "-" ? -1 : 1) * (parseInt(match[3]) * 60 + parseInt(match[4])) : 0;
+    return moment(event, "HH:mm").add(offset, "minutes").format("HH:mm");
+  },
+
   get datasets() {
     // Construct a dataset for each enabled channel
     let datasets = Channels.enabled.map(c => ({ label: c.name, data: [] }));
@@ -158,15 +202,15 @@ var Schedule = {
     // Object to store the last set values for each ID
     let lastValues = {};
 
-    this.data.forEach(row => {
-      // Ignore row if no TOD assigned
-      if (nullOrEmpty(row.tod))
-        return;
+    // Plot rows in the order they occur today. Ignore rows without a TOD
+    let rows = this.data.map(row => [this.resolve(row.tod), row]).filter(r => r[0] != null);
+    rows.sort((f, s) => f[0].localeCompare(s[0]));
 
+    rows.forEach(([tod, row]) => {
       let ids = Object.keys(row).filter(x => x !== "tod");
       ids.forEach(id => {
         if (!nullOrEmpty(row[id]) && datasets[id]) {
-          datasets[id].data.push({ x: row.tod, y: row[id] });
+          datasets[id].data.push({ x: tod, y: row[id] });
           lastValues[id] = row[id];
         }
       })
@@ -191,6 +235,17 @@ var Schedule = {
 function timeEditor(cell, onRendered, success, cancel, editorParams) {
   let editor = document.createElement("input");
 
+  // Times relative to the sun are edited as text
+  if (isSolarTime(cell.getValue())) {
+    editor.setAttribute("type", "text");
+    editor.value = cell.getValue();
+
+    onRendered(() => editor.focus());
+    editor.addEventListener("change", () => success(editor.value));
+    editor.addEventListener("blur", () => success(editor.value));
+    return editor;
+  }
+
   editor.setAttribute("id", "timepicker");
   editor.setAttribute("type", "time");
 
@@ -237,7 +292,7 @@ var Status = {
   },
 }
 
-function sendJsonXhrRequest(json, callback) {
+function sendJsonXhrRequest(json, action = "set") {
   if (typeof josn != "string")
     json = JSON.stringify(json);
 
@@ -259,7 +314,7 @@ function sendJsonXhrRequest(json, callback) {
       }
     };
 
-    xhr.open("POST", "http://" + location.host + "/?action=set");
+    xhr.open("POST", "http://" + location.host + "/?action=" + action);
     xhr.timeout = 5000;
     xhr.setRequestHeader("Content-Type", "application/json");
     xhr.send(json);
@@ -319,7 +374,48 @@ function save() {
   let settings = {};
   settings.timers = Timers.dictionary;
   settings.channels = Channels.dictionary;
-  settings.schedule = Schedule.dictionary;
+  settings.power = {
+    budget: parseFloat(document.getElementById("power_budget").value) || 0,
+  };
+
+  // A blank location disables times relative to the sun
+  let latitude = parseFloat(document.getElementById("solar_latitude").value);
+  let longitude = parseFloat(document.getElementById("solar_longitude").value);
+  let channel = parseInt(document.getElementById("solar_channel").value);
+  settings.solar = {
+    latitude: isNaN(latitude) ? null : latitude,
+    longitude: isNaN(longitude) ? null : longitude,
+    channel: isNaN(channel) ? -1 : channel,
+    intensity: parseFloat(document.getElementById("solar_intensity").value) || 0,
+  };
+
+  let moon_channel = parseInt(document.getElementById("moon_channel").value);
+  settings.moon = {
+    channel: isNaN(moon_channel) ? -1 : moon_channel,
+    intensity: parseFloat(document.getElementById("moon_intensity").value) || 0,
+    blend: document.getElementById("moon_blend").value,
+  };
+
+  // Empty times close the effect windows
+  let value = (id) => document.getElementById(id).value;
+  let effectWindow = (prefix) => ({
+    start: value(prefix + "_start") || null,
+    end: value(prefix + "_end") || null,
+  });
+  settings.effects = {
+    seed: parseInt(value("effects_seed")) || 0,
+    channels: value("effects_channels").split(",").map((c) => parseInt(c)).filter((c) => !isNaN(c)),
+    clouds: Object.assign(effectWindow("clouds"), {
+      cover: parseFloat(value("clouds_cover")) || 0,
+      depth: parseFloat(value("clouds_depth")) || 0,
+      period: parseInt(value("clouds_period")) || 120,
+    }),
+    storm: Object.assign(effectWindow("storm"), {
+      darkening: parseFloat(value("storm_darkening")) || 0,
+      flashes: parseInt(value("storm_flashes")) || 0,
+      flash: parseFloat(value("storm_flash")) || 0,
+    }),
+  };
 
   settings.system = {
     hostname: document.getElementById("hostname").value,
@@ -330,8 +426,19 @@ function save() {
     ],
   }
 
+  // Only send the schedule entries which changed
+  let edit = Schedule.edit;
+  let schedule = Schedule.dictionary;
+
   Status.set("Sending settings...");
   sendJsonXhrRequest(settings).then(() => {
+    if (Object.keys(edit.upsert).length == 0 && edit.delete.length == 0)
+      return;
+
+    Status.set("Sending schedule...");
+    return sendJsonXhrRequest(edit, "edit");
+  }).then(() => {
+    Schedule.baseline = JSON.parse(JSON.stringify(schedule));
     Status.set_success("Complete.");
   }).catch((message) => {
     Status.set_error("Save failed.", message);
@@ -341,10 +448,44 @@ function save() {
 function updateTables(settings) {
   timerTable.setData(Timers.from_dictionary(settings.timers));
   channelTable.setData(Channels.from_dictionary(settings.channels));
+  document.getElementById("power_budget").value = settings.power ? settings.power.budget : 0;
+
+  let solar = settings.solar || {};
+  document.getElementById("solar_latitude").value = nullOrEmpty(solar.latitude) ? "" : solar.latitude;
+  document.getElementById("solar_longitude").value = nullOrEmpty(solar.longitude) ? "" : solar.longitude;
+  document.getElementById("solar_channel").value = nullOrEmpty(solar.channel) ? -1 : solar.channel;
+  document.getElementById("solar_intensity").value = nullOrEmpty(solar.intensity) ? 100 : solar.intensity;
+  Schedule.solar = solar.today || {};
+  document.getElementById("solar_today").textContent = solar.today ?
+    "Today sunrise is at {0}, noon at {1} and sunset at {2}.".format(solar.today.sunrise || "-", solar.today.noon, solar.today.sunset || "-") : "";
+
+  let moon = settings.moon || {};
+  document.getElementById("moon_channel").value = nullOrEmpty(moon.channel) ? -1 : moon.channel;
+  document.getElementById("moon_intensity").value = nullOrEmpty(moon.intensity) ? 10 : moon.intensity;
+  document.getElementById("moon_blend").value = moon.blend || "max";
+  document.getElementById("moon_today").textContent = moon.today ?
+    "Today the moon is {0} days old and {1}% lit, rising at {2} and setting at {3}.".format(moon.today.age.toFixed(1), Math.round(moon.today.illumination), moon.today.rise || "-", moon.today.set || "-") : "";
+
+  let effects = settings.effects || {};
+  let clouds = effects.clouds || {};
+  let storm = effects.storm || {};
+  document.getElementById("effects_seed").value = effects.seed || 0;
+  document.getElementById("effects_channels").value = (effects.channels || []).join(",");
+  document.getElementById("clouds_start").value = clouds.start || "";
+  document.getElementById("clouds_end").value = clouds.end || "";
+  document.getElementById("clouds_cover").value = nullOrEmpty(clouds.cover) ? 50 : clouds.cover;
+  document.getElementById("clouds_depth").value = nullOrEmpty(clouds.depth) ? 60 : clouds.depth;
+  document.getElementById("clouds_period").value = nullOrEmpty(clouds.period) ? 120 : clouds.period;
+  document.getElementById("storm_start").value = storm.start || "";
+  document.getElementById("storm_end").value = storm.end || "";
+  document.getElementById("storm_darkening").value = nullOrEmpty(storm.darkening) ? 70 : storm.darkening;
+  document.getElementById("storm_flashes").value = nullOrEmpty(storm.flashes) ? 60 : storm.flashes;
+  document.getElementById("storm_flash").value = nullOrEmpty(storm.flash) ? 100 : storm.flash;
 
   // Manually trigger column update dumb!
   scheduleTable.setColumns(columnTemplate.concat(Channels.columns));
   scheduleTable.replaceData(Schedule.from_dictionary(settings.schedule));
+  Schedule.baseline = settings.schedule || {};
 
   document.getElementById("hostname").value = settings.system.hostname;
   document.getElementById("timezone").value = settings.system.timezone;
@@ -403,7 +544,10 @@ function restore() {
       return;
 
     file.text().then(text => {
+      // Keep diffing against what the device holds
+      let baseline = Schedule.baseline;
       updateTables(JSON.parse(text));
+      Schedule.baseline = baseline;
 
       Status.set_success("Settings restored.");
 
@@ -562,6 +706,10 @@ function updateScheduleData(data) {
   // Store the data back to the Schedule object and sort it
   Schedule.data = data;
   Schedule.data.sort((f,s) => { 
+    // Times relative to the sun follow the fixed times
+    if (isSolarTime(f.tod) || isSolarTime(s.tod))
+      return isSolarTime(f.tod) - isSolarTime(s.tod) || String(f.tod).localeCompare(String(s.tod));
+
     return moment(f.tod, "HH:mm") - moment(s.tod, "HH:mm");
   });
   
@@ -620,6 +768,9 @@ var channelTable = new Tabulator("#channelTable", {
         cellEdited: (c) => { if (!c.getData().valid) c.getRow().getCell("enabled").setValue(false) },
         tooltip: (c) => !c.isValid() ? "GPIO value must be unique and between 0-31" : "",
     },
+    { title: "Watts", field: "watts", editor: "number", editorParams: { min: 0, step: 0.1 }, validator: "min:0",
+        tooltip: "Draw at full intensity, used by the power budget.",
+    },
     { title: "Enabled", field: "enabled", formatter: "tickCross", hozAlign: "center",
         cellClick: (e, c) => { if (c.getData().valid) c.setValue(!c.getValue()) },
         tooltip: (c) => !c.getData().valid ? "GPIO must be assigned to enable channel." : "",
@@ -0,0 +1,292 @@
+#!/usr/bin/env python3
+#
+# Host side helper for preparing OTA images for ESP PWM.
+#
+#   compress  - Compress an image into a raw deflate stream the device can inflate
+#   verify    - Inflate a compressed image the same way the device does and compare
+#               it against the original image
+#   delta     - Generate a patch which rebuilds an image from the running firmware
+#   apply     - Apply a patch to a base image the same way the device does
+#   hash      - Write the SHA-256 of an image for verification on the device
+#
+import argparse
+import hashlib
+import struct
+import sys
+import zlib
+
+# Must match OTA::InflateHandle::WINDOW_BITS. The device inflates into a
+# circular window of this size so the stream must never reference further back.
+WINDOW_BITS = 12
+
+# Size of the multipart chunks mongoose typically delivers
+CHUNK_SIZE = 1460
+
+# Delta patch format. Must match OTA::DeltaHandle
+#   Header: magic, base size, target size, base SHA-256, target SHA-256
+#   Ops:    op (u8), offset (u32), length (u32) followed by literal data for inserts
+DELTA_MAGIC = b"EPD1"
+DELTA_HEADER = struct.Struct("<4sII32s32s")
+DELTA_OP = struct.Struct("<BII")
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+# Matches are found by indexing every DELTA_INDEX_STEP bytes of the base on
+# DELTA_KEY_SIZE byte keys. Shorter matches cost more than inserting literals
+DELTA_KEY_SIZE = 8
+DELTA_INDEX_STEP = 4
+DELTA_MIN_MATCH = 2 * DELTA_OP.size
+
+
+def compress(data):
+    compressor = zlib.compressobj(9, zlib.DEFLATED, -WINDOW_BITS, 9)
+    return compressor.compress(data) + compressor.flush()
+
+
+def inflate_stream(compressed, chunk_size=CHUNK_SIZE):
+    # Feed small chunks through a decompressor limited to the device window
+    decompressor = zlib.decompressobj(-WINDOW_BITS)
+    for offset in range(0, len(compressed), chunk_size):
+        yield decompressor.decompress(compressed[offset:offset + chunk_size])
+
+    if not decompressor.eof:
+        raise ValueError("compressed stream ended early")
+
+    if decompressor.unused_data:
+        raise ValueError("unexpected data after end of compressed stream")
+
+    yield decompressor.flush()
+
+
+def verify(compressed, original):
+    offset = 0
+    for chunk in inflate_stream(compressed):
+        if original[offset:offset + len(chunk)] != chunk:
+            raise ValueError("inflated data differs from original near offset 0x%x" % offset)
+        offset += len(chunk)
+
+    if offset != len(original):
+        raise ValueError("inflated size %d differs from original size %d" % (offset, len(original)))
+
+
+def match_length(a, a_offset, b, b_offset, block=64):
+    # Length of the common run starting at the given offsets
+    length = 0
+    limit = min(len(a) - a_offset, len(b) - b_offset)
+    while length + block <= limit and a[a_offset + length:a_offset + length + block] == b[b_offset + length:b_offset + length + block]:
+        length += block
+
+    while length < limit and a[a_offset + length] == b[b_offset + length]:
+        length += 1
+
+    return length
+
+
+def delta(base, target):
+    index = {}
+    for offset in range(0, len(base) - DELTA_KEY_SIZE + 1, DELTA_INDEX_STEP):
+        index.setdefault(base[offset:offset + DELTA_KEY_SIZE], offset)
+
+    ops = []
+
+    def insert(start, end):
+        if end > start:
+            ops.append(DELTA_OP.pack(OP_INSERT, 0, end - start) + target[start:end])
+
+    literal_start = 0
+    position = 0
+    while position <= len(target) - DELTA_KEY_SIZE:
+        match = index.get(target[position:position + DELTA_KEY_SIZE])
+        if match is not None:
+            forward = match_length(target, position, base, match)
+
+            # Grow backwards into pending literal data
+            backward = 0
+            while position - backward > literal_start and match - backward > 0 and target[position - backward - 1] == base[match - backward - 1]:
+                backward += 1
+
+            if forward + backward >= DELTA_MIN_MATCH:
+                insert(literal_start, position - backward)
+                ops.append(DELTA_OP.pack(OP_COPY, match - backward, forward + backward))
+                position += forward
+                literal_start = position
+                continue
+
+        position += 1
+
+    insert(literal_start, len(target))
+
+    header = DELTA_HEADER.pack(DELTA_MAGIC, len(base), len(target), hashlib.sha256(base).digest(), hashlib.sha256(target).digest())
+    return header + b"".join(ops)
+
+
+def apply(base, patch, chunk_size=CHUNK_SIZE):
+    # Parse the patch in chunks exactly like the device to exercise split headers
+    magic, base_size, target_size, base_sha256, target_sha256 = DELTA_HEADER.unpack_from(patch)
+    if magic != DELTA_MAGIC:
+        raise ValueError("invalid delta patch header")
+
+    if hashlib.sha256(base[:base_size]).digest() != base_sha256:
+        raise ValueError("base image does not match patch")
+
+    output = bytearray()
+    pending = b""
+    insert_remaining = 0
+    for offset in range(DELTA_HEADER.size, len(patch), chunk_size):
+        data = patch[offset:offset + chunk_size]
+        while data:
+            if insert_remaining:
+                count = min(insert_remaining, len(data))
+                output += data[:count]
+                insert_remaining -= count
+                data = data[count:]
+                continue
+
+            count = min(DELTA_OP.size - len(pending), len(data))
+            pending += data[:count]
+            data = data[count:]
+            if len(pending) < DELTA_OP.size:
+                continue
+
+            op, op_offset, length = DELTA_OP.unpack(pending)
+            pending = b""
+            if op == OP_COPY:
+                if op_offset + length > base_size:
+                    raise ValueError("copy outside of base image")
+                output += base[op_offset:op_offset + length]
+            elif op == OP_INSERT:
+                insert_remaining = length
+            else:
+                raise ValueError("invalid op 0x%02x" % op)
+
+            if len(output) > target_size:
+                raise ValueError("output exceeds target size")
+
+    if pending or insert_remaining or len(output) != target_size:
+        raise ValueError("patch incomplete")
+
+    if hashlib.sha256(output).digest() != target_sha256:
+        raise ValueError("patched image hash mismatch")
+
+    return bytes(output)
+
+
+def cmd_compress(args):
+    with open(args.input, "rb") as f:
+        data = f.read()
+
+    compressed = compress(data)
+    verify(compressed, data)
+
+    with open(args.output, "wb") as f:
+        f.write(compressed)
+
+    print("%s: %d -> %d bytes (%.1f%%)" % (args.output, len(data), len(compressed), 100.0 * len(compressed) / max(len(data), 1)))
+
+
+def cmd_verify(args):
+    with open(args.compressed, "rb") as f:
+        compressed = f.read()
+
+    with open(args.original, "rb") as f:
+        original = f.read()
+
+    try:
+        verify(compressed, original)
+    except (ValueError, zlib.error) as e:
+        print("%s: verify failed: %s" % (args.compressed, e))
+        return 1
+
+    print("%s: OK" % args.compressed)
+    return 0
+
+
+def cmd_delta(args):
+    with open(args.base, "rb") as f:
+        base = f.read()
+
+    with open(args.target, "rb") as f:
+        target = f.read()
+
+    patch = delta(base, target)
+
+    # Round trip the patch before writing it out
+    if apply(base, patch) != target:
+        print("%s: round trip failed" % args.output)
+        return 1
+
+    with open(args.output, "wb") as f:
+        f.write(patch)
+
+    print("%s: %d byte patch for %d byte image (%.1f%%)" % (args.output, len(patch), len(target), 100.0 * len(patch) / max(len(target), 1)))
+    return 0
+
+
+def cmd_apply(args):
+    with open(args.base, "rb") as f:
+        base = f.read()
+
+    with open(args.patch, "rb") as f:
+        patch = f.read()
+
+    try:
+        output = apply(base, patch)
+    except (ValueError, struct.error) as e:
+        print("%s: apply failed: %s" % (args.patch, e))
+        return 1
+
+    with open(args.output, "wb") as f:
+        f.write(output)
+
+    print("%s: OK" % args.output)
+    return 0
+
+
+def cmd_hash(args):
+    with open(args.input, "rb") as f:
+        digest = hashlib.sha256(f.read()).hexdigest()
+
+    with open(args.output, "w") as f:
+        f.write(digest)
+
+    print("%s: %s" % (args.output, digest))
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ESP PWM OTA image tool")
+    subparsers = parser.add_subparsers(dest="command", required=True)
+
+    p = subparsers.add_parser("compress", help="Compress an image for OTA")
+    p.add_argument("input")
+    p.add_argument("output")
+    p.set_defaults(func=cmd_compress)
+
+    p = subparsers.add_parser("verify", help="Verify a compressed image against the original")
+    p.add_argument("compressed")
+    p.add_argument("original")
+    p.set_defaults(func=cmd_verify)
+
+    p = subparsers.add_parser("delta", help="Generate a delta patch from the running firmware to a new image")
+    p.add_argument("base")
+    p.add_argument("target")
+    p.add_argument("output")
+    p.set_defaults(func=cmd_delta)
+
+    p = subparsers.add_parser("apply", help="Apply a delta patch to a base image")
+    p.add_argument("base")
+    p.add_argument("patch")
+    p.add_argument("output")
+    p.set_defaults(func=cmd_apply)
+
+    p = subparsers.add_parser("hash", help="Write the SHA-256 of an image")
+    p.add_argument("input")
+    p.add_argument("output")
+    p.set_defaults(func=cmd_hash)
+
+    args = parser.parse_args()
+    return args.func(args) or 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+#
+# Upload an OTA image to an ESP PWM device, resuming after disconnects.
+#
+# Disconnects can be injected with --disconnect-every to exercise the resume
+# path. The device only reports success once the complete image matches the
+# expected SHA-256, so a successful run verifies the final image.
+#
+#   tools/ota_upload.py esp-led-control.local firmware build/esp-led-control.bin --disconnect-every 65536
+#
+import argparse
+import hashlib
+import json
+import socket
+import sys
+import time
+import urllib.parse
+import urllib.request
+
+BOUNDARY = "----esp-pwm-ota-boundary"
+SEND_SIZE = 1460
+STALL_ATTEMPTS = 3  # Requests in a row which may end without the offset advancing
+
+
+def field(name, value):
+    return ("--%s\r\nContent-Disposition: form-data; name=\"%s\"\r\n\r\n%s\r\n" % (BOUNDARY, name, value)).encode()
+
+
+def fetch_offset(host, target, image_id):
+    query = urllib.parse.urlencode({"target": target, "id": image_id})
+    with urllib.request.urlopen("http://%s/ota?%s" % (host, query), timeout=10) as response:
+        return json.load(response)["offset"]
+
+
+def send(host, target, data, fields, offset, disconnect_after):
+    # Build the multipart body by hand so the connection can be dropped mid image
+    base = target.split(".")[0]
+    head = b"".join(field(base + "_" + k, v) for k, v in fields.items())
+    head += field(base + "_offset", offset)
+    head += ("--%s\r\nContent-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
+             "Content-Type: application/octet-stream\r\n\r\n" % (BOUNDARY, target, target)).encode()
+    tail = ("\r\n--%s--\r\n" % BOUNDARY).encode()
+    body = data[offset:]
+
+    sock = socket.create_connection((host, 80), timeout=30)
+    try:
+        sock.sendall(("POST /ota HTTP/1.1\r\nHost: %s\r\nContent-Type: multipart/form-data; boundary=%s\r\n"
+                      "Content-Length: %d\r\nConnection: close\r\n\r\n" % (host, BOUNDARY, len(head) + len(body) + len(tail))).encode())
+        sock.sendall(head)
+
+        for start in range(0, len(body), SEND_SIZE):
+            if disconnect_after and start >= disconnect_after:
+                print("Injecting disconnect at offset %d" % (offset + start))
+                return None
+
+            sock.sendall(body[start:start + SEND_SIZE])
+
+        sock.sendall(tail)
+
+        response = b""
+        while True:
+            chunk = sock.recv(1024)
+            if not chunk:
+                break
+            response += chunk
+
+        status = response.split(b"\r\n", 1)[0].decode()
+        text = response.split(b"\r\n\r\n", 1)[-1].decode()
+        return status, text
+    except OSError as e:
+        print("Connection lost: %s" % e)
+        return None
+    finally:
+        sock.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ESP PWM resumable OTA upload")
+    parser.add_argument("host", help="Device host name or address")
+    parser.add_argument("target", help="OTA target. e.g. firmware, spiffs.deflate")
+    parser.add_argument("image", help="Image file to upload")
+    parser.add_argument("--sha256", help="SHA-256 of the decoded image. Defaults to the hash of raw images")
+    parser.add_argument("--disconnect-every", type=int, default=0, metavar="BYTES",
+                        help="Drop the connection after sending this many bytes of each request")
+    parser.add_argument("--attempts", type=int, default=100, help="Maximum number of requests")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        data = f.read()
+
+    sha256 = args.sha256
+    if sha256 is None and "." not in args.target:
+        sha256 = hashlib.sha256(data).hexdigest()
+
+    image_id = sha256 or hashlib.sha256(data).hexdigest()
+    fields = {"id": image_id}
+    if sha256:
+        fields["sha256"] = sha256
+
+    offset = 0
+    stalls = 0
+    for attempt in range(args.attempts):
+        result = send(args.host, args.target, data, fields, offset, args.disconnect_every)
+        if result is not None:
+            status, text = result
+            print("%s: %s" % (status, text))
+            return 0 if " 200 " in status else 1
+
+        # Give the device a moment to notice the disconnect
+        time.sleep(1)
+
+        # Nothing may be programmed yet if the first request dropped early, so
+        # an offset of 0 starts over. Only an offset which loses progress or
+        # stops advancing means the device isn't keeping the upload
+        resume = fetch_offset(args.host, args.target, image_id)
+        if resume < offset:
+            print("Device went back from offset %d to %d." % (offset, resume))
+            return 1
+
+        stalls = stalls + 1 if resume == offset else 0
+        if stalls >= STALL_ATTEMPTS:
+            print("Offset %d stopped advancing after %d attempts." % (offset, stalls))
+            return 1
+
+        offset = resume
+        print("Resuming at offset %d of %d" % (offset, len(data)))
+
+    print("Gave up after %d attempts." % args.attempts)
+    return 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())